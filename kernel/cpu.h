@@ -0,0 +1,97 @@
+/**
+ * AuroraOS Kernel - CPU Helpers
+ *
+ * Per-CPU identification and interrupt state helpers
+ */
+
+#ifndef _KERNEL_CPU_H_
+#define _KERNEL_CPU_H_
+
+#include "types.h"
+
+// Maximum number of CPUs supported by per-CPU data structures
+#define MAX_CPUS 8
+
+// RFLAGS interrupt enable flag
+#define CPU_RFLAGS_IF 0x200
+
+/**
+ * Get the index of the executing CPU
+ *
+ * Only the boot CPU runs until SMP bring-up, so this is always 0.
+ * Per-CPU data is indexed with this so callers do not change later.
+ */
+static inline uint32_t cpu_current_id(void) {
+    return 0;
+}
+
+/**
+ * Disable interrupts and return the previous RFLAGS
+ */
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+/**
+ * Restore interrupt state saved by cpu_irq_save()
+ */
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & CPU_RFLAGS_IF) {
+        __asm__ __volatile__("sti" ::: "memory");
+    }
+}
+
+/**
+ * Execute CPUID for a leaf and subleaf
+ */
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+/**
+ * Read CR0
+ */
+static inline uint64_t cpu_read_cr0(void) {
+    uint64_t cr0;
+    __asm__ __volatile__("movq %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+/**
+ * Write CR0
+ */
+static inline void cpu_write_cr0(uint64_t cr0) {
+    __asm__ __volatile__("movq %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+/**
+ * Read CR2 (faulting address of the last page fault)
+ */
+static inline uint64_t cpu_read_cr2(void) {
+    uint64_t cr2;
+    __asm__ __volatile__("movq %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
+/**
+ * Read CR4
+ */
+static inline uint64_t cpu_read_cr4(void) {
+    uint64_t cr4;
+    __asm__ __volatile__("movq %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+/**
+ * Write CR4
+ */
+static inline void cpu_write_cr4(uint64_t cr4) {
+    __asm__ __volatile__("movq %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+#endif // _KERNEL_CPU_H_
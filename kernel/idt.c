@@ -9,6 +9,8 @@
 #include "io.h"
 #include "timer.h"
 #include "keyboard.h"
+#include "cpu.h"
+#include "vma.h"
 
 // IDT entries and pointer
 static idt_entry_t idt[IDT_ENTRIES];
@@ -177,6 +179,16 @@ void idt_load(void) {
  * CPU Exception Handler
  */
 void exception_handler(interrupt_frame_t *frame) {
+    // Page faults inside a process's regions are demand paging: map the
+    // page and retry the access
+    uint64_t fault_addr = 0;
+    if (frame->int_no == EXCEPTION_PAGE_FAULT) {
+        fault_addr = cpu_read_cr2();
+        if (vma_handle_fault(fault_addr, frame->error_code)) {
+            return;
+        }
+    }
+
     console_print("\n========================================\n");
     console_print("[EXCEPTION] CPU Exception Occurred!\n");
     console_print("========================================\n");
@@ -197,6 +209,12 @@ void exception_handler(interrupt_frame_t *frame) {
     console_print_hex(frame->error_code);
     console_print("\n");
 
+    if (frame->int_no == EXCEPTION_PAGE_FAULT) {
+        console_print("Fault Address: ");
+        console_print_hex(fault_addr);
+        console_print("\n");
+    }
+
     // Print register dump
     console_print("\nRegisters:\n");
     console_print("  RIP="); console_print_hex(frame->rip);
@@ -1,42 +1,156 @@
 /**
  * AuroraOS Kernel - Kernel Heap Allocator Implementation
  *
- * Simple block-based allocator with first-fit strategy
+ * Block-based TLSF (two-level segregated fit) allocator. Free blocks are
+ * kept in size-class lists indexed by two bitmaps, and boundary tags let
+ * kfree() merge with neighbours, so kmalloc() and kfree() are O(1)
  */
 
 #include "kheap.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "vmalloc.h"
 #include "console.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "io.h"
 #include "types.h"
 
+// Serial debug helper (COM1 = 0x3F8)
+static inline void serial_debug_char(char c) {
+    outb(0x3F8, c);
+}
+
+static inline void serial_debug_str(const char *s) {
+    while (*s) {
+        serial_debug_char(*s++);
+    }
+}
+
+static void serial_debug_dec(uint64_t num) {
+    char buffer[20];
+    int i = 0;
+
+    do {
+        buffer[i++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+
+    while (i > 0) {
+        serial_debug_char(buffer[--i]);
+    }
+}
+
+static void serial_debug_hex(uint64_t num) {
+    serial_debug_str("0x");
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        serial_debug_char("0123456789abcdef"[(num >> shift) & 0xF]);
+    }
+}
+
 // Block header structure
+// Every block is followed by a footer repeating its size, so both
+// physical neighbours of a block can be found in constant time
 typedef struct block_header {
-    uint64_t size;               // Size of data area (excluding header)
-    uint64_t flags;              // BLOCK_FREE or BLOCK_USED
-    struct block_header *next;   // Next block in list
-    struct block_header *prev;   // Previous block in list
-    uint32_t magic;              // Magic number for validation
-} __attribute__((packed)) block_header_t;
+    uint64_t size;                   // Size of data area (excluding header and footer)
+    uint32_t flags;                  // BLOCK_FREE or BLOCK_USED
+    uint32_t magic;                  // Magic number for validation
+    union {
+        struct block_header *next_free;  // Next block in free list (free blocks only)
+        uint64_t site;                   // Profiled callsite slot + 1, or 0 (used blocks only)
+    };
+    struct block_header *prev_free;  // Previous block in free list (free blocks only)
+} block_header_t;
+
+// Block footer (boundary tag)
+typedef struct {
+    uint64_t size;                   // Copy of the header's size
+    uint64_t magic;                  // Magic number for validation
+} block_footer_t;
 
 #define BLOCK_MAGIC 0xDEADBEEF
 #define HEADER_SIZE sizeof(block_header_t)
+#define FOOTER_SIZE sizeof(block_footer_t)
+#define BLOCK_OVERHEAD (HEADER_SIZE + FOOTER_SIZE)
+
+// TLSF size classes
+// The first level splits sizes by power of two, the second level splits
+// each power of two into TLSF_SL_COUNT linear classes. Sizes below
+// TLSF_SMALL_SIZE share first-level class 0 in HEAP_MIN_BLOCK steps.
+#define TLSF_SL_LOG2     4
+#define TLSF_SL_COUNT    (1U << TLSF_SL_LOG2)
+#define TLSF_ALIGN_LOG2  4                                  // log2(HEAP_MIN_BLOCK)
+#define TLSF_FL_SHIFT    (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL_SIZE  (1ULL << TLSF_FL_SHIFT)
+#define TLSF_FL_MAX      24                                 // log2(HEAP_MAX_SIZE)
+#define TLSF_FL_COUNT    (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
 
 // Heap state
 static struct {
     uint64_t heap_start;
     uint64_t heap_end;
     uint64_t heap_size;
-    block_header_t *first_block;
+    uint32_t fl_bitmap;                                      // Non-empty first-level classes
+    uint32_t sl_bitmap[TLSF_FL_COUNT];                       // Non-empty second-level classes
+    block_header_t *free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
     bool initialized;
     heap_stats_t stats;
 } heap_state = {0};
 
+// Protects heap_state
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+// Per-CPU magazines
+// Blocks in a magazine stay allocated as far as the heap is concerned, so
+// a small kmalloc/kfree pair only touches this CPU's data. An empty
+// magazine is refilled and a full one drained HEAP_MAGAZINE_BATCH blocks
+// at a time under a single acquisition of heap_lock.
+typedef struct {
+    uint32_t count;
+    void *blocks[HEAP_MAGAZINE_SIZE];
+} heap_magazine_t;
+
+static struct {
+    heap_magazine_t magazines[HEAP_CACHE_CLASSES];
+    uint64_t hits;
+    uint64_t misses;
+} heap_caches[MAX_CPUS];
+
+// Allocation profiling
+// Used heap blocks remember the callsite slot they were charged to, so
+// kfree() can credit the same slot even after profiling is switched off.
+// Slots are never reused, which keeps those references valid.
+typedef struct {
+    uint64_t caller;            // Return address of the allocating call
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+} heap_site_t;
+
+static struct {
+    bool enabled;
+    uint64_t num_sites;
+    uint64_t dropped;           // Allocations not charged because the table was full
+    heap_site_t sites[HEAP_PROFILE_SITES];
+} heap_profile;
+
+// Protects heap_profile
+static spinlock_t profile_lock = SPINLOCK_INIT;
+
 // Helper macros
 #define ALIGN_UP(addr, align)   (((addr) + (align) - 1) & ~((align) - 1))
 #define ALIGN_DOWN(addr, align) ((addr) & ~((align) - 1))
 #define IS_ALIGNED(addr, align) (((addr) & ((align) - 1)) == 0)
 
+// Helper: Copy count words (rep movsq - the kernel has no memcpy)
+static inline void copy_words(uint64_t *dst, const uint64_t *src, uint64_t count) {
+    __asm__ __volatile__("rep movsq"
+                         : "+D"(dst), "+S"(src), "+c"(count)
+                         :
+                         : "memory");
+}
+
 /**
  * Get data pointer from block header
  */
@@ -51,6 +165,44 @@ static inline block_header_t* ptr_to_block(void *ptr) {
     return (block_header_t*)((uint8_t*)ptr - HEADER_SIZE);
 }
 
+/**
+ * Get footer of a block
+ */
+static inline block_footer_t* block_footer(block_header_t *block) {
+    return (block_footer_t*)((uint8_t*)block + HEADER_SIZE + block->size);
+}
+
+/**
+ * Get physically next block, or NULL at the end of the heap
+ */
+static inline block_header_t* block_next(block_header_t *block) {
+    uint64_t next = (uint64_t)block + BLOCK_OVERHEAD + block->size;
+    return next < heap_state.heap_end ? (block_header_t*)next : NULL;
+}
+
+/**
+ * Get physically previous block from its footer, or NULL at the start of the heap
+ */
+static inline block_header_t* block_prev(block_header_t *block) {
+    if ((uint64_t)block <= heap_state.heap_start) {
+        return NULL;
+    }
+    block_footer_t *footer = (block_footer_t*)((uint8_t*)block - FOOTER_SIZE);
+    return (block_header_t*)((uint8_t*)footer - footer->size - HEADER_SIZE);
+}
+
+/**
+ * Set block size and write its header and footer
+ */
+static inline void block_init(block_header_t *block, uint64_t size, uint32_t flags) {
+    block->size = size;
+    block->flags = flags;
+    block->magic = BLOCK_MAGIC;
+    block_footer_t *footer = block_footer(block);
+    footer->size = size;
+    footer->magic = BLOCK_MAGIC;
+}
+
 /**
  * Validate block header
  */
@@ -62,93 +214,204 @@ static bool validate_block(block_header_t *block) {
 }
 
 /**
- * Find free block using first-fit strategy
+ * Get index of the highest set bit
  */
-static block_header_t* find_free_block(uint64_t size) {
-    block_header_t *current = heap_state.first_block;
+static inline uint32_t fls64(uint64_t value) {
+    return 63 - (uint32_t)__builtin_clzll(value);
+}
 
-    while (current) {
-        if (!validate_block(current)) {
-            console_print("[HEAP] ERROR: Corrupted block detected\n");
-            return NULL;
-        }
+/**
+ * Get the size class a free block of this size is filed under
+ */
+static inline void mapping_insert(uint64_t size, uint32_t *fl, uint32_t *sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = (uint32_t)(size >> TLSF_ALIGN_LOG2);
+    } else {
+        uint32_t bit = fls64(size);
+        *sl = (uint32_t)(size >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = bit - TLSF_FL_SHIFT + 1;
+    }
+}
+
+/**
+ * Get the first size class whose blocks are all at least this big
+ *
+ * @return false if the size is beyond the largest class
+ */
+static inline bool mapping_search(uint64_t size, uint32_t *fl, uint32_t *sl) {
+    if (size >= TLSF_SMALL_SIZE) {
+        size += (1ULL << (fls64(size) - TLSF_SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+    return *fl < TLSF_FL_COUNT;
+}
+
+/**
+ * Add block to the free list of its size class
+ */
+static inline void free_list_insert(block_header_t *block) {
+    uint32_t fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+
+    block_header_t **head = &heap_state.free_lists[fl][sl];
+    block->prev_free = NULL;
+    block->next_free = *head;
+    if (*head) {
+        (*head)->prev_free = block;
+    }
+    *head = block;
+
+    heap_state.fl_bitmap |= 1U << fl;
+    heap_state.sl_bitmap[fl] |= 1U << sl;
+}
+
+/**
+ * Remove block from the free list of its size class
+ */
+static inline void free_list_remove(block_header_t *block) {
+    uint32_t fl, sl;
+    mapping_insert(block->size, &fl, &sl);
 
-        if ((current->flags & BLOCK_USED) == 0 && current->size >= size) {
-            return current;
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap_state.free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (!heap_state.free_lists[fl][sl]) {
+        heap_state.sl_bitmap[fl] &= ~(1U << sl);
+        if (!heap_state.sl_bitmap[fl]) {
+            heap_state.fl_bitmap &= ~(1U << fl);
         }
+    }
+}
+
+/**
+ * Find a free block of at least size bytes in constant time
+ */
+static block_header_t* find_free_block(uint64_t size) {
+    uint32_t fl, sl;
+    if (!mapping_search(size, &fl, &sl)) {
+        return NULL;
+    }
 
-        current = current->next;
+    // Same first-level class, big enough second-level class
+    uint32_t sl_map = heap_state.sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        // Otherwise the smallest non-empty larger first-level class
+        uint32_t fl_map = fl + 1 < 32 ? heap_state.fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = (uint32_t)__builtin_ctz(fl_map);
+        sl_map = heap_state.sl_bitmap[fl];
     }
+    sl = (uint32_t)__builtin_ctz(sl_map);
 
-    return NULL;
+    block_header_t *block = heap_state.free_lists[fl][sl];
+    if (!validate_block(block)) {
+        console_print("[HEAP] ERROR: Corrupted block detected\n");
+        return NULL;
+    }
+    return block;
 }
 
 /**
  * Split block if large enough
+ * The block has been taken off the free list; the remainder goes back on it
  */
 static void split_block(block_header_t *block, uint64_t size) {
-    if (block->size < size + HEADER_SIZE + HEAP_MIN_BLOCK) {
+    if (block->size < size + BLOCK_OVERHEAD + HEAP_MIN_BLOCK) {
         // Block too small to split
         return;
     }
 
     // Create new free block from remaining space
-    uint64_t remaining = block->size - size - HEADER_SIZE;
-    block_header_t *new_block = (block_header_t*)((uint8_t*)block + HEADER_SIZE + size);
+    uint64_t remaining = block->size - size - BLOCK_OVERHEAD;
+    block_init(block, size, block->flags);
 
-    new_block->size = remaining;
-    new_block->flags = BLOCK_FREE;
-    new_block->magic = BLOCK_MAGIC;
-    new_block->next = block->next;
-    new_block->prev = block;
+    block_header_t *new_block = block_next(block);
+    block_init(new_block, remaining, BLOCK_FREE);
+    free_list_insert(new_block);
 
-    if (block->next) {
-        block->next->prev = new_block;
+    heap_state.stats.num_blocks++;
+    heap_state.stats.num_free_blocks++;
+    heap_state.stats.free_size -= BLOCK_OVERHEAD;
+}
+
+/**
+ * Merge a free block with its free neighbours and put it on the free list
+ * The block itself must not be on the free list yet
+ */
+static block_header_t* merge_block(block_header_t *block) {
+    block_header_t *next = block_next(block);
+    if (next && next->flags == BLOCK_FREE) {
+        free_list_remove(next);
+        block_init(block, block->size + BLOCK_OVERHEAD + next->size, BLOCK_FREE);
+        heap_state.stats.num_blocks--;
+        heap_state.stats.num_free_blocks--;
+        heap_state.stats.free_size += BLOCK_OVERHEAD;
     }
 
-    block->next = new_block;
-    block->size = size;
+    block_header_t *prev = block_prev(block);
+    if (prev && prev->flags == BLOCK_FREE) {
+        free_list_remove(prev);
+        block_init(prev, prev->size + BLOCK_OVERHEAD + block->size, BLOCK_FREE);
+        block = prev;
+        heap_state.stats.num_blocks--;
+        heap_state.stats.num_free_blocks--;
+        heap_state.stats.free_size += BLOCK_OVERHEAD;
+    }
 
-    heap_state.stats.num_blocks++;
-    heap_state.stats.num_free_blocks++;
+    free_list_insert(block);
+    return block;
 }
 
 /**
  * Coalesce adjacent free blocks
+ * kfree() merges neighbours immediately, so this only repairs a heap
+ * whose free blocks were left unmerged
  */
 void kheap_coalesce(void) {
-    block_header_t *current = heap_state.first_block;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    block_header_t *current = heap_state.heap_size ? (block_header_t*)heap_state.heap_start : NULL;
 
-    while (current && current->next) {
+    while (current) {
         if (!validate_block(current)) {
             console_print("[HEAP] ERROR: Invalid block during coalesce\n");
-            return;
+            break;
         }
 
-        // If current and next are both free, merge them
-        if ((current->flags & BLOCK_USED) == 0 &&
-            (current->next->flags & BLOCK_USED) == 0) {
+        block_header_t *next = block_next(current);
 
-            block_header_t *next = current->next;
-            current->size += HEADER_SIZE + next->size;
-            current->next = next->next;
-
-            if (next->next) {
-                next->next->prev = current;
-            }
+        // If current and next are both free, merge them
+        if (current->flags == BLOCK_FREE && next && next->flags == BLOCK_FREE) {
+            // Refile the merged block under its new size
+            free_list_remove(current);
+            free_list_remove(next);
+            block_init(current, current->size + BLOCK_OVERHEAD + next->size, BLOCK_FREE);
+            free_list_insert(current);
 
             heap_state.stats.num_blocks--;
             heap_state.stats.num_free_blocks--;
+            heap_state.stats.free_size += BLOCK_OVERHEAD;
         } else {
-            current = current->next;
+            current = next;
         }
     }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 /**
  * Expand heap by allocating more pages
+ * Caller holds heap_lock
  */
-void kheap_expand(uint64_t size) {
+static void heap_expand(uint64_t size) {
     // Align size to page boundary
     size = ALIGN_UP(size, PAGE_SIZE);
 
@@ -160,43 +423,42 @@ void kheap_expand(uint64_t size) {
 
     // Allocate physical pages
     uint64_t num_pages = size / PAGE_SIZE;
+    uint64_t mapped = 0;
 
     for (uint64_t i = 0; i < num_pages; i++) {
         uint64_t phys = pmm_alloc_frame();
         if (phys == 0) {
             console_print("[HEAP] ERROR: Failed to allocate physical page\n");
-            return;
+            break;
         }
 
         uint64_t virt = heap_state.heap_end + (i * PAGE_SIZE);
         if (!vmm_map_page(virt, phys, PTE_KERNEL_FLAGS)) {
             console_print("[HEAP] ERROR: Failed to map heap page\n");
             pmm_free_frame(phys);
-            return;
+            break;
         }
+
+        // Heap pages are only reached through their mapping, so
+        // compaction may move them
+        page_t *page = pmm_page(phys);
+        if (page) {
+            page->owner = PAGE_OWNER_HEAP;
+            page->flags |= PAGE_FLAG_MOVABLE;
+            page->mapcount = 1;
+            page->private = virt;
+        }
+        mapped++;
+    }
+
+    // Keep whatever was mapped before a failure
+    size = mapped * PAGE_SIZE;
+    if (size == 0) {
+        return;
     }
 
     // Create new free block at end of heap
     block_header_t *new_block = (block_header_t*)heap_state.heap_end;
-    new_block->size = size - HEADER_SIZE;
-    new_block->flags = BLOCK_FREE;
-    new_block->magic = BLOCK_MAGIC;
-    new_block->next = NULL;
-    new_block->prev = NULL;
-
-    // Find last block and append
-    if (!heap_state.first_block) {
-        // First block ever - initialize the list
-        heap_state.first_block = new_block;
-    } else {
-        // Find last block and append
-        block_header_t *last = heap_state.first_block;
-        while (last && last->next) {
-            last = last->next;
-        }
-        last->next = new_block;
-        new_block->prev = last;
-    }
 
     // Memory barrier to ensure all writes are visible
     __asm__ volatile("mfence" ::: "memory");
@@ -204,38 +466,200 @@ void kheap_expand(uint64_t size) {
     heap_state.heap_end += size;
     heap_state.heap_size += size;
     heap_state.stats.total_size += size;
-    heap_state.stats.free_size += size - HEADER_SIZE;
+    heap_state.stats.free_size += size - BLOCK_OVERHEAD;
     heap_state.stats.num_blocks++;
     heap_state.stats.num_free_blocks++;
 
-    // Try to coalesce with previous block
-    kheap_coalesce();
+    // The old tail block is found through its footer and absorbs the
+    // new space if it is free
+    block_init(new_block, size - BLOCK_OVERHEAD, BLOCK_FREE);
+    merge_block(new_block);
 }
 
 /**
- * Allocate memory from heap
+ * Get the free block at the end of the heap
+ * Caller holds heap_lock
+ *
+ * @return The block, or NULL if the last block is in use
  */
-void* kmalloc(uint64_t size) {
-    if (!heap_state.initialized) {
-        console_print("[HEAP] ERROR: Heap not initialized\n");
+static block_header_t* heap_tail_free(void) {
+    if (heap_state.heap_size == 0) {
         return NULL;
     }
 
-    if (size == 0) {
+    block_footer_t *footer = (block_footer_t*)(heap_state.heap_end - FOOTER_SIZE);
+    block_header_t *last = (block_header_t*)(heap_state.heap_end - FOOTER_SIZE - footer->size - HEADER_SIZE);
+    if (!validate_block(last) || last->flags != BLOCK_FREE) {
         return NULL;
     }
+    return last;
+}
+
+/**
+ * Get the number of pages heap_trim() could release
+ * The heap never shrinks below HEAP_INITIAL_SIZE, and the tail block
+ * keeps room for a minimum block
+ * Caller holds heap_lock
+ */
+static uint64_t heap_trimmable(block_header_t *last) {
+    if (!last) {
+        return 0;
+    }
+
+    uint64_t keep_end = ALIGN_UP((uint64_t)last + BLOCK_OVERHEAD + HEAP_MIN_BLOCK, PAGE_SIZE);
+    if (keep_end < heap_state.heap_start + HEAP_INITIAL_SIZE) {
+        keep_end = heap_state.heap_start + HEAP_INITIAL_SIZE;
+    }
+    return keep_end < heap_state.heap_end ? (heap_state.heap_end - keep_end) / PAGE_SIZE : 0;
+}
+
+/**
+ * Give free pages at the end of the heap back to the PMM
+ *
+ * The tail block shrinks first, then its pages are unmapped into one TLB
+ * batch, which frees their frames after a single flush.
+ * Caller holds heap_lock
+ *
+ * @return Number of pages released
+ */
+static uint64_t heap_trim(uint64_t max_pages) {
+    block_header_t *last = heap_tail_free();
+    uint64_t pages = heap_trimmable(last);
+    if (pages > max_pages) {
+        pages = max_pages;
+    }
+    if (pages == 0) {
+        return 0;
+    }
+
+    uint64_t size = pages * PAGE_SIZE;
+    free_list_remove(last);
+    heap_state.heap_end -= size;
+    heap_state.heap_size -= size;
+    heap_state.stats.total_size -= size;
+    heap_state.stats.free_size -= size;
+    block_init(last, last->size - size, BLOCK_FREE);
+    free_list_insert(last);
+
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, vmm_kernel_address_space());
+
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t virt = heap_state.heap_end + i * PAGE_SIZE;
+        uint64_t phys = vmm_clear_pte(virt);
+        if (phys == 0) {
+            continue;
+        }
+
+        page_t *page = pmm_page(phys);
+        if (page) {
+            page->flags &= ~PAGE_FLAG_MOVABLE;
+        }
+        vmm_gather_page(&tlb, virt);
+        vmm_gather_free_frame(&tlb, phys);
+    }
+
+    vmm_gather_finish(&tlb);
+    return pages;
+}
+
+/**
+ * Expand heap by allocating more pages
+ */
+void kheap_expand(uint64_t size) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    heap_expand(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/**
+ * Return a used block to the heap
+ * Caller holds heap_lock
+ */
+static void heap_free(block_header_t *block) {
+    // Mark as free
+    block->flags = BLOCK_FREE;
+
+    // Update statistics
+    heap_state.stats.used_size -= block->size;
+    heap_state.stats.free_size += block->size;
+    heap_state.stats.num_used_blocks--;
+    heap_state.stats.num_free_blocks++;
+    heap_state.stats.num_frees++;
+
+    // Merge with free neighbours
+    merge_block(block);
+}
+
+/**
+ * Resize a used block without moving it
+ *
+ * Growing absorbs the physically next block if it is free and big enough;
+ * any space beyond size is then split off and merged back into the heap
+ * Caller holds heap_lock
+ *
+ * @return false if the block can't grow in place
+ */
+static bool heap_resize(block_header_t *block, uint64_t size) {
+    size = ALIGN_UP(size, HEAP_MIN_BLOCK);
+
+    if (size > block->size) {
+        block_header_t *next = block_next(block);
+        if (!next || next->flags != BLOCK_FREE || block->size + BLOCK_OVERHEAD + next->size < size) {
+            return false;
+        }
+
+        free_list_remove(next);
+        heap_state.stats.used_size += next->size + BLOCK_OVERHEAD;
+        heap_state.stats.free_size -= next->size;
+        heap_state.stats.num_blocks--;
+        heap_state.stats.num_free_blocks--;
+        block_init(block, block->size + BLOCK_OVERHEAD + next->size, block->flags);
+    }
+
+    if (block->size >= size + BLOCK_OVERHEAD + HEAP_MIN_BLOCK) {
+        uint64_t remaining = block->size - size - BLOCK_OVERHEAD;
+        block_init(block, size, block->flags);
+
+        block_header_t *tail = block_next(block);
+        block_init(tail, remaining, BLOCK_FREE);
+        heap_state.stats.used_size -= remaining + BLOCK_OVERHEAD;
+        heap_state.stats.free_size += remaining;
+        heap_state.stats.num_blocks++;
+        heap_state.stats.num_free_blocks++;
+        merge_block(tail);
+    }
+
+    return true;
+}
 
-    // Align size to 8-byte boundary
-    size = ALIGN_UP(size, 8);
+/**
+ * Carve an allocation out of the heap
+ *
+ * For alignments above HEAP_MIN_BLOCK the found block is split twice:
+ * the space in front of the aligned address becomes a free block of its
+ * own and the tail is split off as usual, so no slack stays allocated
+ * Caller holds heap_lock
+ */
+static void* heap_alloc(uint64_t size, uint64_t alignment) {
+    // Align size so every header stays 16-byte aligned
+    size = ALIGN_UP(size, HEAP_MIN_BLOCK);
+
+    // Worst case, the aligned address is a whole free block past the start
+    uint64_t search = size;
+    if (alignment > HEAP_MIN_BLOCK) {
+        search += alignment + BLOCK_OVERHEAD + HEAP_MIN_BLOCK;
+    }
 
     // Find free block
-    block_header_t *block = find_free_block(size);
+    block_header_t *block = find_free_block(search);
 
     // If no block found, expand heap
     if (!block) {
-        uint64_t expand_size = ALIGN_UP(size + HEADER_SIZE, PAGE_SIZE);
-        kheap_expand(expand_size);
-        block = find_free_block(size);
+        // Leave room for the size-class rounding of find_free_block()
+        uint64_t expand_size = ALIGN_UP(search + (search >> TLSF_SL_LOG2) + BLOCK_OVERHEAD, PAGE_SIZE);
+        heap_expand(expand_size);
+        block = find_free_block(search);
 
         if (!block) {
             console_print("[HEAP] ERROR: Out of memory\n");
@@ -243,11 +667,34 @@ void* kmalloc(uint64_t size) {
         }
     }
 
-    // Split block if large enough
-    split_block(block, size);
+    free_list_remove(block);
+
+    uint64_t data = (uint64_t)block_to_ptr(block);
+    uint64_t aligned = ALIGN_UP(data, alignment);
+    if (aligned != data) {
+        // The leading gap must be able to hold a free block
+        if (aligned - data < BLOCK_OVERHEAD + HEAP_MIN_BLOCK) {
+            aligned = ALIGN_UP(data + BLOCK_OVERHEAD + HEAP_MIN_BLOCK, alignment);
+        }
 
-    // Mark as used
+        uint64_t gap = aligned - data;
+        uint64_t total = block->size;
+        block_header_t *aligned_block = ptr_to_block((void*)aligned);
+
+        block_init(block, gap - BLOCK_OVERHEAD, BLOCK_FREE);
+        free_list_insert(block);
+        block_init(aligned_block, total - gap, BLOCK_FREE);
+        block = aligned_block;
+
+        heap_state.stats.num_blocks++;
+        heap_state.stats.num_free_blocks++;
+        heap_state.stats.free_size -= BLOCK_OVERHEAD;
+    }
+
+    // Mark as used and split block if large enough
     block->flags = BLOCK_USED;
+    block->site = 0;
+    split_block(block, size);
 
     // Update statistics
     heap_state.stats.used_size += block->size;
@@ -259,32 +706,410 @@ void* kmalloc(uint64_t size) {
     return block_to_ptr(block);
 }
 
+/**
+ * Allocate whole identity-mapped pages for a page-aligned request
+ * The page count is kept in the first page's descriptor for kfree()
+ *
+ * @return NULL if the PMM can't satisfy it
+ */
+static void* page_alloc(uint64_t size, uint64_t alignment) {
+    uint64_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    uint64_t phys;
+
+    if (alignment == PAGE_SIZE) {
+        phys = pmm_alloc_frames(pages);
+    } else {
+        // A buddy block is aligned to its size; give back the unused tail
+        uint64_t align_pages = alignment / PAGE_SIZE;
+        uint32_t order = 0;
+        while ((1ULL << order) < pages || (1ULL << order) < align_pages) {
+            order++;
+        }
+        if (order > PMM_MAX_ORDER) {
+            return NULL;
+        }
+
+        phys = pmm_alloc_order(order);
+        if (phys && (1ULL << order) > pages) {
+            pmm_free_frames(phys + pages * PAGE_SIZE, (1ULL << order) - pages);
+        }
+    }
+
+    if (phys == 0) {
+        return NULL;
+    }
+
+    page_t *page = pmm_page(phys);
+    if (!page) {
+        pmm_free_frames(phys, pages);
+        return NULL;
+    }
+    page->owner = PAGE_OWNER_HEAP;
+    page->order = 0;
+    page->private = pages;
+
+    heap_state.stats.num_allocations++;
+    return (void*)phys;
+}
+
+/**
+ * Check whether a pointer came from page_alloc()
+ */
+static inline bool is_page_alloc(void *ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    return addr < heap_state.heap_start || addr >= heap_state.heap_end;
+}
+
+/**
+ * Get usable size of an allocation
+ *
+ * @return 0 if ptr is not a valid allocation
+ */
+static uint64_t allocation_size(void *ptr) {
+    if (is_vmalloc_addr(ptr)) {
+        return vmalloc_size(ptr);
+    }
+
+    if (is_page_alloc(ptr)) {
+        page_t *page = pmm_page((uint64_t)ptr);
+        if (!IS_ALIGNED((uint64_t)ptr, PAGE_SIZE) || !page || page->owner != PAGE_OWNER_HEAP ||
+            (page->flags & PAGE_FLAG_MOVABLE)) {
+            return 0;
+        }
+        return page->private * PAGE_SIZE;
+    }
+
+    block_header_t *block = ptr_to_block(ptr);
+    if (!validate_block(block) || block->flags != BLOCK_USED) {
+        return 0;
+    }
+    return block->size;
+}
+
+/**
+ * Find or claim the profiling slot of a callsite
+ * Caller holds profile_lock
+ *
+ * @return Slot index + 1, or 0 if the table is full
+ */
+static uint64_t profile_site(uint64_t caller) {
+    uint32_t index = (uint32_t)((caller * 0x9E3779B97F4A7C15ULL) >> (64 - HEAP_PROFILE_SITES_LOG2));
+
+    for (uint32_t i = 0; i < HEAP_PROFILE_SITES; i++) {
+        heap_site_t *site = &heap_profile.sites[index];
+        if (site->caller == caller) {
+            return index + 1;
+        }
+        if (site->caller == 0) {
+            site->caller = caller;
+            heap_profile.num_sites++;
+            return index + 1;
+        }
+        index = (index + 1) & (HEAP_PROFILE_SITES - 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Charge a newly allocated heap block to the callsite that asked for it
+ */
+static void profile_alloc(void *ptr, void *caller) {
+    if (!heap_profile.enabled || !ptr) {
+        return;
+    }
+
+    block_header_t *block = ptr_to_block(ptr);
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+
+    uint64_t slot = profile_site((uint64_t)caller);
+    if (slot) {
+        heap_site_t *site = &heap_profile.sites[slot - 1];
+        site->allocations++;
+        site->live_bytes += block->size;
+        if (site->live_bytes > site->peak_bytes) {
+            site->peak_bytes = site->live_bytes;
+        }
+    } else {
+        heap_profile.dropped++;
+    }
+    block->site = slot;
+
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+/**
+ * Credit a heap block that is being freed back to its callsite
+ */
+static void profile_free(block_header_t *block) {
+    if (block->site == 0) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+    heap_site_t *site = &heap_profile.sites[block->site - 1];
+    site->frees++;
+    site->live_bytes -= block->size;
+    spin_unlock_irqrestore(&profile_lock, flags);
+
+    block->site = 0;
+}
+
+/**
+ * Move a profiled block's live bytes to its new size
+ */
+static void profile_resize(block_header_t *block, uint64_t old_size) {
+    if (block->site == 0) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+    heap_site_t *site = &heap_profile.sites[block->site - 1];
+    site->live_bytes += block->size - old_size;
+    if (site->live_bytes > site->peak_bytes) {
+        site->peak_bytes = site->live_bytes;
+    }
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+/**
+ * Get the cache size class for a request of at most 2^HEAP_CACHE_MAX_SHIFT bytes
+ */
+static inline uint32_t size_class(uint64_t size) {
+    if (size <= (1ULL << HEAP_CACHE_MIN_SHIFT)) {
+        return 0;
+    }
+    return 64 - (uint32_t)__builtin_clzll(size - 1) - HEAP_CACHE_MIN_SHIFT;
+}
+
+/**
+ * Fill a magazine with a batch of blocks from the heap
+ * Caller has interrupts disabled
+ */
+static void magazine_refill(heap_magazine_t *mag, uint32_t cls) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    for (uint32_t i = 0; i < HEAP_MAGAZINE_BATCH && mag->count < HEAP_MAGAZINE_SIZE; i++) {
+        void *ptr = heap_alloc(1ULL << (cls + HEAP_CACHE_MIN_SHIFT), HEAP_MIN_BLOCK);
+        if (!ptr) {
+            break;
+        }
+        ptr_to_block(ptr)->flags = BLOCK_USED | BLOCK_CACHED;
+        mag->blocks[mag->count++] = ptr;
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/**
+ * Return blocks from a magazine to the heap until only keep are left
+ * Caller holds heap_lock
+ */
+static void magazine_release(heap_magazine_t *mag, uint32_t keep) {
+    while (mag->count > keep) {
+        block_header_t *block = ptr_to_block(mag->blocks[--mag->count]);
+        heap_free(block);
+    }
+}
+
+/**
+ * Return blocks from a magazine to the heap until only keep are left
+ * Caller has interrupts disabled
+ */
+static void magazine_drain(heap_magazine_t *mag, uint32_t keep) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    magazine_release(mag, keep);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/**
+ * Pop a block of a size class from this CPU's magazine
+ */
+static void* cache_alloc(uint32_t cls) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    heap_magazine_t *mag = &heap_caches[cpu].magazines[cls];
+
+    if (mag->count == 0) {
+        heap_caches[cpu].misses++;
+        magazine_refill(mag, cls);
+    } else {
+        heap_caches[cpu].hits++;
+    }
+
+    void *ptr = NULL;
+    if (mag->count > 0) {
+        ptr = mag->blocks[--mag->count];
+        ptr_to_block(ptr)->flags = BLOCK_USED;
+    }
+
+    cpu_irq_restore(flags);
+    return ptr;
+}
+
+/**
+ * Push a block onto this CPU's magazine, draining a batch when full
+ */
+static void cache_free(uint32_t cls, void *ptr) {
+    uint64_t flags = cpu_irq_save();
+    heap_magazine_t *mag = &heap_caches[cpu_current_id()].magazines[cls];
+
+    if (mag->count == HEAP_MAGAZINE_SIZE) {
+        magazine_drain(mag, HEAP_MAGAZINE_SIZE - HEAP_MAGAZINE_BATCH);
+    }
+
+    ptr_to_block(ptr)->flags = BLOCK_USED | BLOCK_CACHED;
+    mag->blocks[mag->count++] = ptr;
+
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Return all of this CPU's cached blocks to the heap
+ */
+void kheap_cache_drain(void) {
+    uint64_t flags = cpu_irq_save();
+
+    for (uint32_t cls = 0; cls < HEAP_CACHE_CLASSES; cls++) {
+        magazine_drain(&heap_caches[cpu_current_id()].magazines[cls], 0);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Estimate the pages the heap shrinker could release
+ * Blocks in this CPU's magazines count as well, as draining them may
+ * free up the end of the heap
+ */
+static uint64_t heap_shrink_count(void) {
+    // The PMM may be called with heap_lock held while the heap grows
+    uint64_t flags = cpu_irq_save();
+    if (!spin_trylock(&heap_lock)) {
+        cpu_irq_restore(flags);
+        return 0;
+    }
+
+    uint64_t cached = 0;
+    for (uint32_t cls = 0; cls < HEAP_CACHE_CLASSES; cls++) {
+        cached += (uint64_t)heap_caches[cpu_current_id()].magazines[cls].count << (cls + HEAP_CACHE_MIN_SHIFT);
+    }
+    uint64_t pages = heap_trimmable(heap_tail_free()) + cached / PAGE_SIZE;
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return pages;
+}
+
+/**
+ * Drain this CPU's magazines and release free pages at the end of the heap
+ */
+static uint64_t heap_shrink_scan(uint64_t target) {
+    uint64_t flags = cpu_irq_save();
+    if (!spin_trylock(&heap_lock)) {
+        cpu_irq_restore(flags);
+        return 0;
+    }
+
+    for (uint32_t cls = 0; cls < HEAP_CACHE_CLASSES; cls++) {
+        magazine_release(&heap_caches[cpu_current_id()].magazines[cls], 0);
+    }
+    uint64_t freed = heap_trim(target);
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return freed;
+}
+
+static pmm_shrinker_t heap_shrinker = {
+    .name = "kheap",
+    .count = heap_shrink_count,
+    .scan = heap_shrink_scan,
+    .priority = PMM_SHRINKER_PRIORITY_NORMAL,
+};
+
+/**
+ * Allocate memory from heap on behalf of caller
+ */
+static void* kmalloc_caller(uint64_t size, void *caller) {
+    if (!heap_state.initialized) {
+        console_print("[HEAP] ERROR: Heap not initialized\n");
+        return NULL;
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    // Big buffers get their own virtual range instead of eating the heap
+    if (size >= HEAP_VMALLOC_THRESHOLD) {
+        void *ptr = vmalloc(size);
+        if (ptr || size > HEAP_MAX_SIZE) {
+            return ptr;
+        }
+    }
+
+    if (size <= (1ULL << HEAP_CACHE_MAX_SHIFT)) {
+        void *ptr = cache_alloc(size_class(size));
+        if (ptr) {
+            profile_alloc(ptr, caller);
+            return ptr;
+        }
+    }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void *ptr = heap_alloc(size, HEAP_MIN_BLOCK);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    profile_alloc(ptr, caller);
+    return ptr;
+}
+
+/**
+ * Allocate memory from heap
+ */
+void* kmalloc(uint64_t size) {
+    return kmalloc_caller(size, __builtin_return_address(0));
+}
+
 /**
  * Allocate aligned memory
+ * Page or larger alignments get whole pages from the PMM, smaller ones
+ * are carved from the heap
  */
 void* kmalloc_aligned(uint64_t size, uint64_t alignment) {
-    if (!IS_ALIGNED(alignment, alignment)) {
+    if (alignment == 0 || !IS_ALIGNED(alignment, alignment)) {
         return NULL;
     }
 
-    // Allocate extra space for alignment
-    uint64_t total_size = size + alignment + HEADER_SIZE;
-    void *ptr = kmalloc(total_size);
+    if (!heap_state.initialized) {
+        console_print("[HEAP] ERROR: Heap not initialized\n");
+        return NULL;
+    }
 
-    if (!ptr) {
+    if (size == 0 || size > HEAP_MAX_SIZE) {
         return NULL;
     }
 
-    // Calculate aligned address
-    uint64_t addr = (uint64_t)ptr;
-    uint64_t aligned = ALIGN_UP(addr, alignment);
+    if (alignment < HEAP_MIN_BLOCK) {
+        alignment = HEAP_MIN_BLOCK;
+    }
 
-    // If already aligned, return as-is
-    if (aligned == addr) {
-        return ptr;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    void *ptr = NULL;
+    if (alignment >= PAGE_SIZE) {
+        ptr = page_alloc(size, alignment);
     }
 
-    // Otherwise, we need to adjust (simplified - just return unaligned for now)
+    bool from_heap = !ptr;
+    if (from_heap) {
+        ptr = heap_alloc(size, alignment);
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (from_heap) {
+        profile_alloc(ptr, __builtin_return_address(0));
+    }
     return ptr;
 }
 
@@ -293,7 +1118,7 @@ void* kmalloc_aligned(uint64_t size, uint64_t alignment) {
  */
 void* kcalloc(uint64_t num, uint64_t size) {
     uint64_t total = num * size;
-    void *ptr = kmalloc(total);
+    void *ptr = kmalloc_caller(total, __builtin_return_address(0));
 
     if (ptr) {
         // Zero the memory
@@ -319,6 +1144,28 @@ void kfree(void *ptr) {
         return;
     }
 
+    // Large buffers from vmalloc()
+    if (is_vmalloc_addr(ptr)) {
+        vfree(ptr);
+        return;
+    }
+
+    // Whole pages from kmalloc_aligned()
+    if (is_page_alloc(ptr)) {
+        uint64_t size = allocation_size(ptr);
+        if (size == 0) {
+            console_print("[HEAP] ERROR: Invalid pointer in kfree\n");
+            return;
+        }
+
+        pmm_free_frames((uint64_t)ptr, size / PAGE_SIZE);
+
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+        heap_state.stats.num_frees++;
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return;
+    }
+
     // Get block header
     block_header_t *block = ptr_to_block(ptr);
 
@@ -327,31 +1174,73 @@ void kfree(void *ptr) {
         return;
     }
 
-    if ((block->flags & BLOCK_USED) == 0) {
+    if (block->flags != BLOCK_USED) {
         console_print("[HEAP] WARNING: Double free detected\n");
         return;
     }
 
-    // Mark as free
-    block->flags = BLOCK_FREE;
+    profile_free(block);
 
-    // Update statistics
-    heap_state.stats.used_size -= block->size;
-    heap_state.stats.free_size += block->size;
-    heap_state.stats.num_used_blocks--;
-    heap_state.stats.num_free_blocks++;
-    heap_state.stats.num_frees++;
+    // Blocks of exactly a cached size go back to this CPU's magazine
+    if (block->size <= (1ULL << HEAP_CACHE_MAX_SHIFT) &&
+        block->size == (1ULL << (size_class(block->size) + HEAP_CACHE_MIN_SHIFT))) {
+        cache_free(size_class(block->size), ptr);
+        return;
+    }
 
-    // Coalesce adjacent free blocks
-    kheap_coalesce();
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    heap_free(block);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/**
+ * Resize an allocation without moving it
+ * Whole-page allocations give back their tail pages, heap blocks grow into
+ * or shrink towards their next neighbour
+ *
+ * @return false if the allocation has to move
+ */
+static bool realloc_in_place(void *ptr, uint64_t old_size, uint64_t new_size) {
+    bool grow = new_size > old_size;
+    bool resized;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    if (is_vmalloc_addr(ptr)) {
+        resized = !grow;
+    } else if (is_page_alloc(ptr)) {
+        uint64_t old_pages = old_size / PAGE_SIZE;
+        uint64_t new_pages = ALIGN_UP(new_size, PAGE_SIZE) / PAGE_SIZE;
+        resized = !grow;
+        if (resized && new_pages < old_pages) {
+            pmm_free_frames((uint64_t)ptr + new_pages * PAGE_SIZE, old_pages - new_pages);
+            pmm_page((uint64_t)ptr)->private = new_pages;
+        }
+    } else {
+        block_header_t *block = ptr_to_block(ptr);
+        resized = heap_resize(block, new_size);
+        if (resized) {
+            profile_resize(block, old_size);
+        }
+    }
+
+    if (resized && grow) {
+        heap_state.stats.num_realloc_grown++;
+    } else if (resized) {
+        heap_state.stats.num_realloc_shrunk++;
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return resized;
 }
 
 /**
  * Reallocate memory
+ * Resizes in place when the neighbourhood allows and copies otherwise
  */
 void* krealloc(void *ptr, uint64_t new_size) {
     if (!ptr) {
-        return kmalloc(new_size);
+        return kmalloc_caller(new_size, __builtin_return_address(0));
     }
 
     if (new_size == 0) {
@@ -359,32 +1248,33 @@ void* krealloc(void *ptr, uint64_t new_size) {
         return NULL;
     }
 
-    block_header_t *block = ptr_to_block(ptr);
-    if (!validate_block(block)) {
+    uint64_t old_size = allocation_size(ptr);
+    if (old_size == 0) {
         return NULL;
     }
 
-    // If new size fits in current block, just return it
-    if (new_size <= block->size) {
+    if (realloc_in_place(ptr, old_size, new_size)) {
         return ptr;
     }
 
     // Allocate new block
-    void *new_ptr = kmalloc(new_size);
+    void *new_ptr = kmalloc_caller(new_size, __builtin_return_address(0));
     if (!new_ptr) {
         return NULL;
     }
 
-    // Copy old data
-    uint8_t *src = (uint8_t*)ptr;
-    uint8_t *dst = (uint8_t*)new_ptr;
-    for (uint64_t i = 0; i < block->size && i < new_size; i++) {
-        dst[i] = src[i];
-    }
+    // Copy old data. Usable sizes are multiples of HEAP_MIN_BLOCK, so
+    // rounding to whole words stays inside both allocations
+    uint64_t copy = ALIGN_UP(old_size < new_size ? old_size : new_size, sizeof(uint64_t));
+    copy_words((uint64_t*)new_ptr, (const uint64_t*)ptr, copy / sizeof(uint64_t));
 
     // Free old block
     kfree(ptr);
 
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    heap_state.stats.num_realloc_moved++;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
     return new_ptr;
 }
 
@@ -411,6 +1301,7 @@ void kheap_init(boot_info_t *boot_info) {
     }
 
     heap_state.initialized = true;
+    pmm_register_shrinker(&heap_shrinker);
 
     console_print("[HEAP] Initialized at ");
     console_print_hex(heap_state.heap_start);
@@ -425,35 +1316,117 @@ void kheap_init(boot_info_t *boot_info) {
 
 /**
  * Validate heap integrity
+ * Caller holds heap_lock
  */
-bool kheap_validate(void) {
-    if (!heap_state.initialized) {
-        return false;
-    }
-
-    block_header_t *current = heap_state.first_block;
+static bool heap_validate(void) {
+    block_header_t *current = (block_header_t*)heap_state.heap_start;
     uint64_t count = 0;
+    uint64_t free_count = 0;
+    bool prev_free = false;
 
     while (current) {
-        if (!validate_block(current)) {
+        if (!validate_block(current) || block_footer(current)->size != current->size ||
+            block_footer(current)->magic != BLOCK_MAGIC) {
             console_print("[HEAP] Validation failed at block ");
             console_print_dec(count);
             console_print("\n");
             return false;
         }
 
+        bool free = current->flags == BLOCK_FREE;
+        if (free && prev_free) {
+            console_print("[HEAP] Validation failed: unmerged free blocks at block ");
+            console_print_dec(count);
+            console_print("\n");
+            return false;
+        }
+        prev_free = free;
+        free_count += free;
+
         count++;
         if (count > heap_state.stats.num_blocks + 10) {
             console_print("[HEAP] Validation failed: infinite loop detected\n");
             return false;
         }
 
-        current = current->next;
+        current = block_next(current);
+    }
+
+    // Every free block must be on the list of its size class, and the
+    // bitmaps must match the lists
+    uint64_t listed = 0;
+    for (uint32_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (uint32_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            block_header_t *block = heap_state.free_lists[fl][sl];
+            bool mapped = (heap_state.fl_bitmap & (1U << fl)) && (heap_state.sl_bitmap[fl] & (1U << sl));
+            if (mapped != (block != NULL)) {
+                console_print("[HEAP] Validation failed: free bitmap mismatch\n");
+                return false;
+            }
+
+            for (; block; block = block->next_free) {
+                uint32_t block_fl, block_sl;
+                mapping_insert(block->size, &block_fl, &block_sl);
+                if (block->flags != BLOCK_FREE || block_fl != fl || block_sl != sl ||
+                    ++listed > free_count) {
+                    console_print("[HEAP] Validation failed: corrupted free list\n");
+                    return false;
+                }
+            }
+        }
+    }
+    if (listed != free_count) {
+        console_print("[HEAP] Validation failed: free block missing from free list\n");
+        return false;
     }
 
     return true;
 }
 
+/**
+ * Validate heap integrity
+ */
+bool kheap_validate(void) {
+    if (!heap_state.initialized) {
+        return false;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    bool valid = heap_validate();
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return valid;
+}
+
+/**
+ * Get the size of the largest free block
+ * Caller holds heap_lock
+ */
+static uint64_t largest_free_block(void) {
+    if (!heap_state.fl_bitmap) {
+        return 0;
+    }
+
+    // Only the highest non-empty class can hold it
+    uint32_t fl = fls64(heap_state.fl_bitmap);
+    uint32_t sl = fls64(heap_state.sl_bitmap[fl]);
+
+    uint64_t largest = 0;
+    for (block_header_t *block = heap_state.free_lists[fl][sl]; block; block = block->next_free) {
+        if (block->size > largest) {
+            largest = block->size;
+        }
+    }
+    return largest;
+}
+
+/**
+ * Get external fragmentation: the percentage of free memory that lies
+ * outside the largest free block
+ */
+static inline uint64_t heap_fragmentation(uint64_t largest, uint64_t free) {
+    return free ? 100 - largest * 100 / free : 0;
+}
+
 /**
  * Print heap statistics
  */
@@ -475,7 +1448,135 @@ void kheap_print_stats(void) {
     console_print_dec(heap_state.stats.num_allocations);
     console_print("\n  Frees:         ");
     console_print_dec(heap_state.stats.num_frees);
-    console_print("\n");
+    console_print("\n  Reallocs:      ");
+    console_print_dec(heap_state.stats.num_realloc_grown);
+    console_print(" grown, ");
+    console_print_dec(heap_state.stats.num_realloc_shrunk);
+    console_print(" shrunk, ");
+    console_print_dec(heap_state.stats.num_realloc_moved);
+    console_print(" moved");
+
+    uint64_t cached = 0, hits = 0, misses = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (uint32_t cls = 0; cls < HEAP_CACHE_CLASSES; cls++) {
+            cached += heap_caches[cpu].magazines[cls].count;
+        }
+        hits += heap_caches[cpu].hits;
+        misses += heap_caches[cpu].misses;
+    }
+    console_print("\n  Cached Blocks: ");
+    console_print_dec(cached);
+    console_print(" (hits ");
+    console_print_dec(hits);
+    console_print(" misses ");
+    console_print_dec(misses);
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    uint64_t largest = largest_free_block();
+    uint64_t free = heap_state.stats.free_size;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    console_print(")\n  Fragmentation: ");
+    console_print_dec(heap_fragmentation(largest, free));
+    console_print("% (largest free block ");
+    console_print_dec(largest / 1024);
+    console_print(" KB)\n");
+}
+
+/**
+ * Turn per-callsite allocation profiling on or off
+ * Blocks charged while it was on are still credited when freed
+ */
+void kheap_profile_enable(bool enable) {
+    heap_profile.enabled = enable;
+    console_print(enable ? "[HEAP] Allocation profiling enabled\n" :
+                           "[HEAP] Allocation profiling disabled\n");
+}
+
+/**
+ * Write the allocation profile and free block histogram to serial
+ *
+ * One record per line, as space-separated key=value fields:
+ *   heapprof begin enabled=<0|1> sites=<n> dropped=<n>
+ *   heapprof site caller=<hex> allocs=<n> frees=<n> live=<bytes> peak=<bytes>
+ *   heapprof free size=<bytes> blocks=<n> bytes=<n>   (size is the bucket's power of two)
+ *   heapprof frag free=<bytes> largest=<bytes> external_pct=<n>
+ *   heapprof end
+ */
+void kheap_profile_dump(void) {
+    serial_debug_str("heapprof begin enabled=");
+    serial_debug_dec(heap_profile.enabled);
+    serial_debug_str(" sites=");
+    serial_debug_dec(heap_profile.num_sites);
+    serial_debug_str(" dropped=");
+    serial_debug_dec(heap_profile.dropped);
+    serial_debug_str("\n");
+
+    // Copy one slot at a time so allocations aren't held up by serial output
+    for (uint32_t i = 0; i < HEAP_PROFILE_SITES; i++) {
+        uint64_t flags = spin_lock_irqsave(&profile_lock);
+        heap_site_t site = heap_profile.sites[i];
+        spin_unlock_irqrestore(&profile_lock, flags);
+
+        if (site.caller == 0) {
+            continue;
+        }
+
+        serial_debug_str("heapprof site caller=");
+        serial_debug_hex(site.caller);
+        serial_debug_str(" allocs=");
+        serial_debug_dec(site.allocations);
+        serial_debug_str(" frees=");
+        serial_debug_dec(site.frees);
+        serial_debug_str(" live=");
+        serial_debug_dec(site.live_bytes);
+        serial_debug_str(" peak=");
+        serial_debug_dec(site.peak_bytes);
+        serial_debug_str("\n");
+    }
+
+    // Free block sizes by power of two
+    uint64_t counts[64];
+    uint64_t bytes[64];
+    for (uint32_t bucket = 0; bucket < 64; bucket++) {
+        counts[bucket] = 0;
+        bytes[bucket] = 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    for (uint32_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (uint32_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            for (block_header_t *block = heap_state.free_lists[fl][sl]; block; block = block->next_free) {
+                uint32_t bucket = fls64(block->size);
+                counts[bucket]++;
+                bytes[bucket] += block->size;
+            }
+        }
+    }
+    uint64_t largest = largest_free_block();
+    uint64_t free = heap_state.stats.free_size;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    for (uint32_t bucket = 0; bucket < 64; bucket++) {
+        if (counts[bucket] == 0) {
+            continue;
+        }
+        serial_debug_str("heapprof free size=");
+        serial_debug_dec(1ULL << bucket);
+        serial_debug_str(" blocks=");
+        serial_debug_dec(counts[bucket]);
+        serial_debug_str(" bytes=");
+        serial_debug_dec(bytes[bucket]);
+        serial_debug_str("\n");
+    }
+
+    serial_debug_str("heapprof frag free=");
+    serial_debug_dec(free);
+    serial_debug_str(" largest=");
+    serial_debug_dec(largest);
+    serial_debug_str(" external_pct=");
+    serial_debug_dec(heap_fragmentation(largest, free));
+    serial_debug_str("\nheapprof end\n");
 }
 
 /**
@@ -484,7 +1585,7 @@ void kheap_print_stats(void) {
 void kheap_dump_blocks(void) {
     console_print("\n[HEAP] Block Dump:\n");
 
-    block_header_t *current = heap_state.first_block;
+    block_header_t *current = heap_state.heap_size ? (block_header_t*)heap_state.heap_start : NULL;
     uint64_t index = 0;
 
     while (current && index < 20) {
@@ -495,10 +1596,11 @@ void kheap_dump_blocks(void) {
         console_print(" size=");
         console_print_dec(current->size);
         console_print(" ");
-        console_print((current->flags & BLOCK_USED) ? "USED" : "FREE");
+        console_print((current->flags & BLOCK_CACHED) ? "CACHED" :
+                      (current->flags & BLOCK_USED) ? "USED" : "FREE");
         console_print("\n");
 
-        current = current->next;
+        current = block_next(current);
         index++;
     }
 
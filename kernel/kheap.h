@@ -12,14 +12,29 @@
 #include "boot.h"
 
 // Heap configuration
-#define HEAP_START_ADDR   0x200000      // 2MB (after kernel)
+// The heap lives in its own slot of the kernel half, outside the identity
+// map, so mapping it never hides the identity address of a physical frame
+#define HEAP_START_ADDR   0xFFFFC80000000000ULL
 #define HEAP_INITIAL_SIZE (1024 * 1024) // 1MB initial heap
 #define HEAP_MAX_SIZE     (16 * 1024 * 1024) // 16MB max heap
 #define HEAP_MIN_BLOCK    16             // Minimum block size
+#define HEAP_VMALLOC_THRESHOLD (64 * 1024) // Larger kmalloc() requests go to vmalloc()
 
 // Block header flags
-#define BLOCK_FREE  0x0
-#define BLOCK_USED  0x1
+#define BLOCK_FREE   0x0
+#define BLOCK_USED   0x1
+#define BLOCK_CACHED 0x2                 // Used block parked in a per-CPU cache
+
+// Per-CPU caches for small power-of-two size classes
+#define HEAP_CACHE_MIN_SHIFT 4           // 16 bytes
+#define HEAP_CACHE_MAX_SHIFT 11          // 2048 bytes
+#define HEAP_CACHE_CLASSES   (HEAP_CACHE_MAX_SHIFT - HEAP_CACHE_MIN_SHIFT + 1)
+#define HEAP_MAGAZINE_SIZE   32          // Blocks per CPU and size class
+#define HEAP_MAGAZINE_BATCH  16          // Blocks moved per refill or drain
+
+// Allocation profiling
+#define HEAP_PROFILE_SITES_LOG2 8
+#define HEAP_PROFILE_SITES   (1U << HEAP_PROFILE_SITES_LOG2) // Tracked callsites
 
 // Heap statistics
 typedef struct {
@@ -31,6 +46,9 @@ typedef struct {
     uint64_t num_used_blocks;   // Used blocks
     uint64_t num_allocations;   // Total allocations
     uint64_t num_frees;         // Total frees
+    uint64_t num_realloc_grown; // krealloc() calls grown in place
+    uint64_t num_realloc_shrunk;// krealloc() calls shrunk in place
+    uint64_t num_realloc_moved; // krealloc() calls that had to copy
 } heap_stats_t;
 
 // Heap initialization
@@ -46,10 +64,13 @@ void  kfree(void *ptr);
 // Heap management
 void kheap_expand(uint64_t size);
 void kheap_coalesce(void);
+void kheap_cache_drain(void);
 
 // Debugging and statistics
 void kheap_print_stats(void);
 void kheap_dump_blocks(void);
 bool kheap_validate(void);
+void kheap_profile_enable(bool enable);
+void kheap_profile_dump(void);
 
 #endif // _KERNEL_KHEAP_H_
@@ -13,6 +13,9 @@
 #include "pmm.h"
 #include "vmm.h"
 #include "kheap.h"
+#include "slab.h"
+#include "vmalloc.h"
+#include "vma.h"
 #include "timer.h"
 #include "keyboard.h"
 #include "process.h"
@@ -172,6 +175,18 @@ void kernel_main(boot_info_t *boot_info) {
     serial_debug_str("after_kheap_init\n");
     console_print("  [OK] Kernel Heap\n");
 
+    // Initialize Slab Allocator
+    slab_init();
+    console_print("  [OK] Slab Allocator\n");
+
+    // Initialize vmalloc region
+    vmalloc_init();
+    console_print("  [OK] vmalloc\n");
+
+    // Initialize virtual memory areas (demand-paged user regions)
+    vma_init();
+    console_print("  [OK] Virtual Memory Areas\n");
+
     // Initialize Timer (PIT)
     timer_init(TIMER_FREQ_1000HZ);  // 1000 Hz = 1ms tick
     console_print("  [OK] Timer (PIT)\n");
@@ -1,11 +1,14 @@
 /**
  * AuroraOS Kernel - Physical Memory Manager Implementation
  *
- * Bitmap-based physical page frame allocator
+ * Bitmap-based physical page frame allocator with a binary buddy
+ * allocator per memory zone (DMA, DMA32, Normal) for finding free blocks
  */
 
 #include "pmm.h"
 #include "console.h"
+#include "cpu.h"
+#include "spinlock.h"
 #include "io.h"
 
 // Serial debug helper (COM1 = 0x3F8)
@@ -20,12 +23,77 @@ static inline void serial_debug_str(const char *s) {
 }
 
 // Bitmap to track page allocation (1 = allocated, 0 = free)
-// Each bit represents one 4KB page
-// 1MB bitmap = supports up to 32GB RAM (1MB * 8 bits * 4KB)
-#define BITMAP_SIZE (1024 * 1024)  // 1MB
-// Initialize all pages as allocated (0xFF) at compile time to avoid runtime loop
-// Using GCC designated initializer extension
-static uint8_t page_bitmap[BITMAP_SIZE] = {[0 ... (BITMAP_SIZE-1)] = 0xFF};
+// Each bit represents one 4KB page, stored as 64-bit words
+// Sized from the memory map and carved out of boot memory by pmm_init
+static uint64_t *page_bitmap = NULL;
+
+// Summarized free map (1 = block free)
+// l1 bit N: map word N is non-zero
+// l2 bit N: l1 word N is non-zero
+// Finding the lowest free block is three find-first-set operations
+// instead of a bit-by-bit walk
+typedef struct {
+    uint64_t *map;
+    uint64_t *l1;
+    uint64_t *l2;
+    uint64_t bits;             // Number of blocks tracked
+    uint64_t l2_words;
+    uint64_t hint;             // No set bit below this l2 word
+} free_map_t;
+
+#define FREE_MAP_NONE (~0ULL)
+
+// Binary buddy allocator
+// free[k] tracks free naturally aligned blocks of 2^k pages. A block and
+// its buddy are never both free: they are merged into one order k+1 block.
+typedef struct {
+    uint64_t base_page;                         // First page covered
+    uint64_t num_pages;                         // Pages covered
+    free_map_t free[PMM_MAX_ORDER + 1];         // Free blocks per order
+    uint64_t free_blocks[PMM_MAX_ORDER + 1];    // Free block count per order
+} buddy_t;
+
+// One buddy allocator per zone, each covering its zone's pages up to
+// highest_page
+static buddy_t zones[PMM_ZONE_COUNT];
+
+static const char *zone_names[PMM_ZONE_COUNT] = {"DMA", "DMA32", "Normal"};
+
+// First page above each zone
+static const uint64_t zone_limits[PMM_ZONE_COUNT] = {
+    ADDR_TO_PAGE(PMM_ZONE_DMA_LIMIT),
+    ADDR_TO_PAGE(PMM_ZONE_DMA32_LIMIT),
+    ~0ULL,
+};
+
+// Kernel image end (from linker script)
+extern char _kernel_end[];
+
+// Static fallback for PMM metadata when no region above the kernel is
+// available
+// About 33 bytes per page: 144KB covers 16MB of RAM
+#define PMM_BOOT_ARENA_WORDS 18432
+static uint64_t pmm_boot_arena[PMM_BOOT_ARENA_WORDS] __attribute__((aligned(64)));
+
+// Where the bitmap, buddy free maps and page descriptors were placed
+static struct {
+    uint64_t *base;            // Bitmap followed by buddy free maps
+    uint64_t words;
+    page_t *pages;             // Page descriptors
+    uint64_t pages_words;
+    bool in_ram;               // Carved from available memory (not the arena)
+} pmm_metadata = {0};
+
+// Page descriptor array, indexed by frame number
+// Only used once page_descs_ready is set: descriptors placed above the
+// boot identity map are set up later from vmm_init()
+static page_t *page_descs = NULL;
+static bool page_descs_ready = false;
+
+// Memory map assumed when the bootloader does not pass one (test mode)
+static memory_descriptor_t default_memory_map[] = {
+    {MEMORY_TYPE_AVAILABLE, 0, 0, (16 * 1024 * 1024) / PAGE_SIZE, 0},  // 16MB
+};
 
 // PMM state
 static struct {
@@ -36,344 +104,2012 @@ static struct {
     bool initialized;
 } pmm_state = {0};
 
-// Helper: Set a bit in the bitmap
-static inline void bitmap_set(uint64_t bit) {
-    page_bitmap[bit / 8] |= (1 << (bit % 8));
-}
+// Protects page_bitmap, zones and pmm_state
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Per-CPU page frame cache
+// Frames in a cache are allocated as far as the bitmap and buddy allocator
+// are concerned, so the common alloc/free pair never touches shared state.
+// An empty cache is refilled up to low; a cache above high is drained
+// back down to low.
+typedef struct {
+    uint32_t count;
+    uint64_t pages[PMM_PCP_CAPACITY];
+} pmm_pcp_t;
+
+static pmm_pcp_t pcp_caches[MAX_CPUS];
+
+static struct {
+    uint32_t low;
+    uint32_t high;
+} pcp_watermarks = {PMM_PCP_LOW, PMM_PCP_HIGH};
+
+// Highest zone with memory; caches only take back frames from this zone
+static uint32_t pcp_zone = PMM_ZONE_DMA;
+
+// Pre-zeroed frame pool (protected by pmm_lock)
+// Frames are cleared ahead of time, normally from the idle task, so page
+// tables and other zero-filled allocations skip the clearing. Like cached
+// frames, pooled frames are allocated in the bitmap.
+static struct {
+    uint32_t count;
+    uint64_t pages[PMM_ZERO_POOL_SIZE];
+    uint64_t hits;             // Served from the pool
+    uint64_t misses;           // Cleared on the allocation path
+} zero_pool = {0};
+
+// Reserved huge frame pools (protected by pmm_lock)
+// Pooled frames are allocated in the bitmap and handed out by
+// pmm_alloc_huge() before it tries the buddy allocator
+typedef struct {
+    uint32_t order;
+    uint32_t target;           // Requested pool size
+    uint32_t count;
+    uint64_t pages[PMM_HUGE_POOL_MAX];
+} huge_pool_t;
+
+static huge_pool_t huge_pools[] = {
+    {.order = PMM_HUGE_ORDER_2MB},
+    {.order = PMM_HUGE_ORDER_1GB},
+};
+
+// Compaction state
+// After a background pass that moves nothing, the next
+// PMM_COMPACT_DEFER background calls are skipped
+#define PMM_COMPACT_DEFER 1024
+
+static pmm_migrate_fn migrate_page = NULL;
+
+static struct {
+    uint64_t runs;
+    uint64_t pages_migrated;
+    uint64_t blocks_freed;
+    uint32_t defer;
+} compaction = {0};
+
+// Registered shrinkers, sorted by priority (protected by shrinker_lock)
+static pmm_shrinker_t *shrinkers = NULL;
+static spinlock_t shrinker_lock = SPINLOCK_INIT;
+
+static struct {
+    uint32_t active;           // A pass is running; nested passes back off
+    uint64_t passes;
+    uint64_t reclaimed;
+} shrink_state = {0};
+
+static pmm_shrinker_t huge_pool_shrinker;
+
+// Helper: Set a bit in the bitmap
+static inline void bitmap_set(uint64_t bit) {
+    page_bitmap[bit / 64] |= (1ULL << (bit % 64));
+}
+
+// Helper: Clear a bit in the bitmap
+static inline void bitmap_clear(uint64_t bit) {
+    page_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+// Helper: Test a bit in the bitmap
+static inline bool bitmap_test(uint64_t bit) {
+    return (page_bitmap[bit / 64] & (1ULL << (bit % 64))) != 0;
+}
+
+// Helper: Index of lowest set bit (compiles to tzcnt/bsf), word must be non-zero
+static inline uint64_t find_first_set(uint64_t word) {
+    return (uint64_t)__builtin_ctzll(word);
+}
+
+// Helper: Fill count words with value (rep stosq - the kernel has no memset)
+static inline void fill_words(uint64_t *dst, uint64_t count, uint64_t value) {
+    __asm__ __volatile__("rep stosq"
+                         : "+D"(dst), "+c"(count)
+                         : "a"(value)
+                         : "memory");
+}
+
+/**
+ * Set (or clear) every bit for pages [start, end)
+ * Partial words at either end are masked, whole words in between are filled
+ */
+static void bitmap_fill_range(uint64_t start, uint64_t end, bool set) {
+    if (start >= end) {
+        return;
+    }
+
+    uint64_t first = start / 64;
+    uint64_t last = (end - 1) / 64;
+    uint64_t head = ~0ULL << (start % 64);
+    uint64_t tail = ~0ULL >> (63 - (end - 1) % 64);
+
+    if (first == last) {
+        head &= tail;
+    }
+
+    page_bitmap[first] = set ? (page_bitmap[first] | head) : (page_bitmap[first] & ~head);
+    if (first == last) {
+        return;
+    }
+
+    fill_words(&page_bitmap[first + 1], last - first - 1, set ? ~0ULL : 0);
+    page_bitmap[last] = set ? (page_bitmap[last] | tail) : (page_bitmap[last] & ~tail);
+}
+
+static inline void bitmap_set_range(uint64_t start, uint64_t end) {
+    bitmap_fill_range(start, end, true);
+}
+
+static inline void bitmap_clear_range(uint64_t start, uint64_t end) {
+    bitmap_fill_range(start, end, false);
+}
+
+/**
+ * Find the first page in [page, end) whose bit equals set, a word at a time
+ *
+ * @return Page number, or end if there is none
+ */
+static uint64_t bitmap_find_next(uint64_t page, uint64_t end, bool set) {
+    while (page < end) {
+        uint64_t word = page_bitmap[page / 64];
+        if (!set) {
+            word = ~word;
+        }
+        word &= ~0ULL << (page % 64);
+
+        if (word) {
+            uint64_t found = (page & ~63ULL) + find_first_set(word);
+            return found < end ? found : end;
+        }
+        page = (page & ~63ULL) + 64;
+    }
+
+    return end;
+}
+
+// Helper: Smallest order whose block holds count pages
+static inline uint32_t order_for_count(uint64_t count) {
+    if (count <= 1) {
+        return 0;
+    }
+    return 64 - (uint32_t)__builtin_clzll(count - 1);
+}
+
+/**
+ * Carve a free map for the given number of blocks out of *pool
+ */
+static void free_map_setup(free_map_t *fm, uint64_t bits, uint64_t **pool) {
+    uint64_t words = (bits + 63) / 64;
+    uint64_t l1_words = (words + 63) / 64;
+
+    fm->bits = bits;
+    fm->l2_words = (l1_words + 63) / 64;
+    fm->hint = 0;
+
+    fm->map = *pool;
+    fm->l1 = fm->map + words;
+    fm->l2 = fm->l1 + l1_words;
+    *pool = fm->l2 + fm->l2_words;
+
+    fill_words(fm->map, (uint64_t)(*pool - fm->map), 0);
+}
+
+static inline bool free_map_test(free_map_t *fm, uint64_t bit) {
+    return (fm->map[bit / 64] & (1ULL << (bit % 64))) != 0;
+}
+
+static inline void free_map_set(free_map_t *fm, uint64_t bit) {
+    uint64_t word = bit / 64;
+    uint64_t l1_word = word / 64;
+
+    fm->map[word] |= 1ULL << (bit % 64);
+    fm->l1[l1_word] |= 1ULL << (word % 64);
+    fm->l2[l1_word / 64] |= 1ULL << (l1_word % 64);
+
+    if (l1_word / 64 < fm->hint) {
+        fm->hint = l1_word / 64;
+    }
+}
+
+static inline void free_map_clear(free_map_t *fm, uint64_t bit) {
+    uint64_t word = bit / 64;
+    uint64_t l1_word = word / 64;
+
+    fm->map[word] &= ~(1ULL << (bit % 64));
+    if (fm->map[word] == 0) {
+        fm->l1[l1_word] &= ~(1ULL << (word % 64));
+        if (fm->l1[l1_word] == 0) {
+            fm->l2[l1_word / 64] &= ~(1ULL << (l1_word % 64));
+        }
+    }
+}
+
+/**
+ * Find the lowest set bit in a free map
+ *
+ * @return Block index, or FREE_MAP_NONE if the map is empty
+ */
+static uint64_t free_map_find_first(free_map_t *fm) {
+    for (uint64_t l2 = fm->hint; l2 < fm->l2_words; l2++) {
+        if (fm->l2[l2] == 0) {
+            // Nothing free here - no need to look at this word again
+            fm->hint = l2 + 1;
+            continue;
+        }
+
+        uint64_t l1_word = l2 * 64 + find_first_set(fm->l2[l2]);
+        uint64_t word = l1_word * 64 + find_first_set(fm->l1[l1_word]);
+        return word * 64 + find_first_set(fm->map[word]);
+    }
+
+    return FREE_MAP_NONE;
+}
+
+/**
+ * Words free_map_setup carves for the given number of blocks
+ */
+static uint64_t free_map_words(uint64_t bits) {
+    uint64_t words = (bits + 63) / 64;
+    uint64_t l1_words = (words + 63) / 64;
+    return words + l1_words + (l1_words + 63) / 64;
+}
+
+/**
+ * Pages [*start, *end) covered by a zone when highest_page pages are tracked
+ */
+static void zone_span(uint32_t zone, uint64_t highest_page, uint64_t *start, uint64_t *end) {
+    *start = zone > 0 ? zone_limits[zone - 1] : 0;
+    *end = zone_limits[zone] < highest_page ? zone_limits[zone] : highest_page;
+    if (*start > *end) {
+        *start = *end;
+    }
+}
+
+/**
+ * Words of metadata (page bitmap plus per-zone buddy free maps) when
+ * highest_page pages are tracked
+ */
+static uint64_t metadata_words(uint64_t highest_page) {
+    uint64_t words = (highest_page + 63) / 64;
+
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        uint64_t start, end;
+        zone_span(zone, highest_page, &start, &end);
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            words += free_map_words((end - start) >> order);
+        }
+    }
+    return words;
+}
+
+/**
+ * Set up buddy free maps covering num_pages pages from base_page,
+ * carving their storage out of *pool
+ */
+static void buddy_setup(buddy_t *bd, uint64_t base_page, uint64_t num_pages, uint64_t **pool) {
+    bd->base_page = base_page;
+    bd->num_pages = num_pages;
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_map_setup(&bd->free[order], num_pages >> order, pool);
+        bd->free_blocks[order] = 0;
+    }
+}
+
+/**
+ * Free a block and merge it with its buddy as far up as possible
+ */
+static void buddy_free_block(buddy_t *bd, uint64_t page, uint32_t order) {
+    uint64_t index = (page - bd->base_page) >> order;
+
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy_index = index ^ 1;
+        if (buddy_index >= bd->free[order].bits ||
+            !free_map_test(&bd->free[order], buddy_index)) {
+            break;
+        }
+
+        // Buddy is free - take it out and move up one order
+        free_map_clear(&bd->free[order], buddy_index);
+        bd->free_blocks[order]--;
+        index >>= 1;
+        order++;
+    }
+
+    free_map_set(&bd->free[order], index);
+    bd->free_blocks[order]++;
+}
+
+/**
+ * Allocate a block of 2^order pages, splitting larger blocks as needed
+ *
+ * @return First page of the block, or FREE_MAP_NONE
+ */
+static uint64_t buddy_alloc_block(buddy_t *bd, uint32_t order) {
+    for (uint32_t current = order; current <= PMM_MAX_ORDER; current++) {
+        uint64_t index = free_map_find_first(&bd->free[current]);
+        if (index == FREE_MAP_NONE) {
+            continue;
+        }
+
+        free_map_clear(&bd->free[current], index);
+        bd->free_blocks[current]--;
+
+        // Split down, keeping the lower half and freeing the upper half
+        while (current > order) {
+            current--;
+            index <<= 1;
+            free_map_set(&bd->free[current], index + 1);
+            bd->free_blocks[current]++;
+        }
+
+        return bd->base_page + (index << order);
+    }
+
+    return FREE_MAP_NONE;
+}
+
+/**
+ * Free an arbitrary page range as the largest aligned blocks that fit
+ */
+static void buddy_free_range(buddy_t *bd, uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t offset = page - bd->base_page;
+        uint32_t order = offset ? (uint32_t)find_first_set(offset) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) {
+            order = PMM_MAX_ORDER;
+        }
+        while ((1ULL << order) > count) {
+            order--;
+        }
+
+        buddy_free_block(bd, page, order);
+        page += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+/**
+ * Take the free pages [start, end) out of the free blocks that contain
+ * them, giving back the parts of those blocks outside the range
+ * All pages in the range must be free
+ */
+static void buddy_remove_range(buddy_t *bd, uint64_t start, uint64_t end) {
+    uint64_t page = start;
+
+    while (page < end) {
+        uint64_t offset = page - bd->base_page;
+        uint32_t order = 0;
+
+        while (order <= PMM_MAX_ORDER &&
+               ((offset >> order) >= bd->free[order].bits ||
+                !free_map_test(&bd->free[order], offset >> order))) {
+            order++;
+        }
+        if (order > PMM_MAX_ORDER) {
+            page++;  // Not tracked by the buddy allocator
+            continue;
+        }
+
+        uint64_t index = offset >> order;
+        uint64_t block_start = bd->base_page + (index << order);
+        uint64_t block_end = block_start + (1ULL << order);
+
+        free_map_clear(&bd->free[order], index);
+        bd->free_blocks[order]--;
+
+        if (block_start < page) {
+            buddy_free_range(bd, block_start, page - block_start);
+        }
+        if (block_end > end) {
+            buddy_free_range(bd, end, block_end - end);
+            block_end = end;
+        }
+        page = block_end;
+    }
+}
+
+/**
+ * Allocate a run of more than 2^PMM_MAX_ORDER pages from consecutive
+ * max-order blocks, starting on a multiple of align pages
+ *
+ * @return First page of the run, or FREE_MAP_NONE
+ */
+static uint64_t buddy_alloc_run(buddy_t *bd, uint64_t count, uint64_t align) {
+    free_map_t *fm = &bd->free[PMM_MAX_ORDER];
+    uint64_t blocks = (count + (1ULL << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+
+    for (uint64_t index = 0; index < fm->bits; index++) {
+        if (!free_map_test(fm, index)) {
+            run_length = 0;
+            continue;
+        }
+
+        if (run_length == 0) {
+            if ((bd->base_page + (index << PMM_MAX_ORDER)) & (align - 1)) {
+                continue;  // Can't start a run here
+            }
+            run_start = index;
+        }
+        if (++run_length < blocks) {
+            continue;
+        }
+
+        for (uint64_t i = run_start; i <= index; i++) {
+            free_map_clear(fm, i);
+        }
+        bd->free_blocks[PMM_MAX_ORDER] -= blocks;
+        return bd->base_page + (run_start << PMM_MAX_ORDER);
+    }
+
+    return FREE_MAP_NONE;
+}
+
+/**
+ * Feed every free page of the bitmap into the buddy allocator
+ */
+static void buddy_build_from_bitmap(buddy_t *bd) {
+    uint64_t page = bd->base_page;
+    uint64_t end = bd->base_page + bd->num_pages;
+
+    while (page < end) {
+        uint64_t start = bitmap_find_next(page, end, false);
+        if (start >= end) {
+            break;
+        }
+
+        page = bitmap_find_next(start, end, true);
+        buddy_free_range(bd, start, page - start);
+    }
+}
+
+// Helper: Zone that contains a page
+static inline uint32_t page_zone(uint64_t page) {
+    uint32_t zone = 0;
+    while (page >= zone_limits[zone]) {
+        zone++;
+    }
+    return zone;
+}
+
+// Helper: Zone allocator that owns a page
+static inline buddy_t* zone_of_page(uint64_t page) {
+    return &zones[page_zone(page)];
+}
+
+/**
+ * Allocate a block of 2^order pages from zone, falling back to lower zones
+ *
+ * @return First page of the block, or FREE_MAP_NONE
+ */
+static uint64_t zone_alloc_block(uint32_t order, pmm_zone_t zone) {
+    for (int z = zone; z >= 0; z--) {
+        uint64_t page = buddy_alloc_block(&zones[z], order);
+        if (page != FREE_MAP_NONE) {
+            return page;
+        }
+    }
+    return FREE_MAP_NONE;
+}
+
+/**
+ * Allocate a run of more than 2^PMM_MAX_ORDER pages from zone, falling
+ * back to lower zones
+ *
+ * @return First page of the run, or FREE_MAP_NONE
+ */
+static uint64_t zone_alloc_run(uint64_t count, uint64_t align, pmm_zone_t zone) {
+    for (int z = zone; z >= 0; z--) {
+        uint64_t page = buddy_alloc_run(&zones[z], count, align);
+        if (page != FREE_MAP_NONE) {
+            return page;
+        }
+    }
+    return FREE_MAP_NONE;
+}
+
+/**
+ * Free pages [start, end) to the zones that contain them
+ */
+static void zones_free_range(uint64_t start, uint64_t end) {
+    for (uint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+        buddy_t *bd = &zones[z];
+        uint64_t lo = start > bd->base_page ? start : bd->base_page;
+        uint64_t hi = end < bd->base_page + bd->num_pages ? end : bd->base_page + bd->num_pages;
+        if (lo < hi) {
+            buddy_free_range(bd, lo, hi - lo);
+        }
+    }
+}
+
+/**
+ * Take free pages [start, end) out of the zones that contain them
+ */
+static void zones_remove_range(uint64_t start, uint64_t end) {
+    for (uint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+        buddy_t *bd = &zones[z];
+        uint64_t lo = start > bd->base_page ? start : bd->base_page;
+        uint64_t hi = end < bd->base_page + bd->num_pages ? end : bd->base_page + bd->num_pages;
+        if (lo < hi) {
+            buddy_remove_range(bd, lo, hi);
+        }
+    }
+}
+
+/**
+ * Count free pages held by a zone's buddy allocator
+ */
+static uint64_t zone_free_pages(buddy_t *bd) {
+    uint64_t pages = 0;
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        pages += bd->free_blocks[order] << order;
+    }
+    return pages;
+}
+
+/**
+ * Reserve pages that are currently free in the bitmap
+ */
+static void reserve_pages(uint64_t start_page, uint64_t end_page) {
+    if (end_page > pmm_state.highest_page) {
+        end_page = pmm_state.highest_page;
+    }
+
+    // Only pages that were free change the count
+    uint64_t page = start_page;
+    while (page < end_page) {
+        uint64_t free_start = bitmap_find_next(page, end_page, false);
+        if (free_start >= end_page) {
+            break;
+        }
+
+        page = bitmap_find_next(free_start, end_page, true);
+        bitmap_set_range(free_start, page);
+        pmm_state.free_pages -= page - free_start;
+    }
+}
+
+/**
+ * End of the kernel image, rounded up to a page and at least 2MB
+ */
+static uint64_t kernel_reserved_end(void) {
+    uint64_t kernel_end = PAGE_ALIGN_UP((uint64_t)_kernel_end);
+    if (kernel_end < 0x200000) {
+        kernel_end = 0x200000;  // Keep the historic 1MB-2MB kernel reservation
+    }
+    return kernel_end;
+}
+
+/**
+ * Reserve the first 1MB (BIOS, VGA, etc.) and the kernel image
+ */
+static void reserve_low_memory(void) {
+    reserve_pages(0, ADDR_TO_PAGE(0x100000));
+    reserve_pages(ADDR_TO_PAGE(0x100000), ADDR_TO_PAGE(kernel_reserved_end()));
+}
+
+/**
+ * Words of page descriptors when highest_page pages are tracked
+ * (plus slack to align the array to a cache line)
+ */
+static uint64_t page_desc_words(uint64_t highest_page) {
+    return highest_page * sizeof(page_t) / sizeof(uint64_t) + 8;
+}
+
+/**
+ * Find room for words of metadata in available memory between floor
+ * and limit
+ *
+ * @return Physical address, or 0 if no region is large enough
+ */
+static uint64_t find_metadata_region(memory_descriptor_t *mmap, uint64_t num_entries,
+                                     uint64_t desc_size, uint64_t words,
+                                     uint64_t floor, uint64_t limit) {
+    uint64_t size = PAGE_ALIGN_UP(words * sizeof(uint64_t));
+
+    for (uint64_t i = 0; i < num_entries; i++) {
+        memory_descriptor_t *entry = (memory_descriptor_t*)((uint8_t*)mmap + i * desc_size);
+        if (entry->type != MEMORY_TYPE_AVAILABLE) {
+            continue;
+        }
+
+        uint64_t start = PAGE_ALIGN_UP(entry->physical_start);
+        uint64_t end = entry->physical_start + entry->number_of_pages * PAGE_SIZE;
+        if (start < floor) {
+            start = floor;
+        }
+        if (end > limit) {
+            end = limit;
+        }
+
+        if (end > start && end - start >= size) {
+            return start;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Size the page bitmap, buddy free maps and page descriptors from
+ * highest_page and carve them out of available memory (or the boot arena)
+ *
+ * The bitmap and free maps are needed right away, so they must sit below
+ * the boot identity map. Descriptors go with them when there is room,
+ * otherwise into the first large region anywhere.
+ */
+static void setup_metadata(memory_descriptor_t *mmap, uint64_t num_entries, uint64_t desc_size) {
+    uint64_t words = metadata_words(pmm_state.highest_page);
+    uint64_t pages_words = page_desc_words(pmm_state.highest_page);
+    uint64_t floor = kernel_reserved_end();
+    uint64_t pages_addr = 0;
+
+    uint64_t addr = find_metadata_region(mmap, num_entries, desc_size, words + pages_words,
+                                         floor, PMM_IDENTITY_LIMIT);
+    if (addr) {
+        pages_addr = addr + words * sizeof(uint64_t);
+    } else {
+        addr = find_metadata_region(mmap, num_entries, desc_size, words,
+                                    floor, PMM_IDENTITY_LIMIT);
+        if (addr) {
+            pages_addr = find_metadata_region(mmap, num_entries, desc_size, pages_words,
+                                              PAGE_ALIGN_UP(addr + words * sizeof(uint64_t)), ~0ULL);
+        }
+    }
+
+    if (addr && pages_addr) {
+        pmm_metadata.base = (uint64_t*)addr;
+        pmm_metadata.in_ram = true;
+    } else {
+        if (words + pages_words > PMM_BOOT_ARENA_WORDS) {
+            console_print("[PMM] WARNING: No region large enough for metadata\n");
+            while (metadata_words(pmm_state.highest_page) +
+                   page_desc_words(pmm_state.highest_page) > PMM_BOOT_ARENA_WORDS) {
+                pmm_state.highest_page /= 2;
+            }
+            words = metadata_words(pmm_state.highest_page);
+            pages_words = page_desc_words(pmm_state.highest_page);
+            console_print("[PMM] Tracking only ");
+            console_print_dec(pmm_state.highest_page * PAGE_SIZE / (1024 * 1024));
+            console_print(" MB\n");
+        }
+        pmm_metadata.base = pmm_boot_arena;
+        pmm_metadata.in_ram = false;
+        pages_addr = (uint64_t)(pmm_boot_arena + words);
+    }
+    pmm_metadata.words = words;
+    pmm_metadata.pages = (page_t*)((pages_addr + 63) & ~63ULL);
+    pmm_metadata.pages_words = pages_words;
+
+    // Every page starts out allocated; the buddy maps are cleared by buddy_setup
+    page_bitmap = pmm_metadata.base;
+    fill_words(page_bitmap, (pmm_state.highest_page + 63) / 64, ~0ULL);
+
+    console_print("[PMM] Metadata: ");
+    console_print_dec(words * sizeof(uint64_t) / 1024);
+    console_print(" KB at ");
+    console_print_hex((uint64_t)pmm_metadata.base);
+    console_print(", page descriptors: ");
+    console_print_dec(pages_words * sizeof(uint64_t) / 1024);
+    console_print(" KB at ");
+    console_print_hex((uint64_t)pmm_metadata.pages);
+    console_print("\n");
+}
+
+/**
+ * Clear all page descriptors and mark the pages allocated so far as reserved
+ */
+static void page_descriptors_setup(void) {
+    page_descs = pmm_metadata.pages;
+    fill_words((uint64_t*)page_descs, pmm_state.highest_page * sizeof(page_t) / sizeof(uint64_t), 0);
+
+    uint64_t page = 0;
+    while (page < pmm_state.highest_page) {
+        uint64_t start = bitmap_find_next(page, pmm_state.highest_page, true);
+        page = bitmap_find_next(start, pmm_state.highest_page, false);
+
+        for (uint64_t p = start; p < page; p++) {
+            page_descs[p].flags = PAGE_FLAG_RESERVED;
+            page_descs[p].refcount = 1;
+            page_descs[p].zone = (uint8_t)(zone_of_page(p) - zones);
+            page_descs[p].owner = PAGE_OWNER_KERNEL;
+        }
+    }
+
+    // Frames already sitting in per-CPU caches are free
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (uint32_t i = 0; i < pcp_caches[cpu].count; i++) {
+            page_descs[pcp_caches[cpu].pages[i]] = (page_t){.flags = PAGE_FLAG_PCP};
+        }
+    }
+
+    page_descs_ready = true;
+}
+
+/**
+ * Set up descriptors for count freshly allocated pages
+ */
+static inline void page_descs_alloc(uint64_t page, uint64_t count, uint32_t order) {
+    if (!page_descs_ready) {
+        return;
+    }
+
+    uint8_t zone = (uint8_t)(zone_of_page(page) - zones);
+    for (uint64_t p = page; p < page + count; p++) {
+        page_descs[p] = (page_t){.refcount = 1, .zone = zone};
+    }
+    page_descs[page].order = (uint8_t)order;
+}
+
+/**
+ * Reset descriptors of count pages being freed
+ */
+static inline void page_descs_free(uint64_t page, uint64_t count) {
+    if (!page_descs_ready) {
+        return;
+    }
+
+    for (uint64_t p = page; p < page + count; p++) {
+        page_descs[p] = (page_t){0};
+    }
+}
+
+/**
+ * Initialize PMM with boot memory map
+ */
+void pmm_init(boot_info_t *boot_info) {
+    serial_debug_str("pmm_init_start\n");
+    console_print("[PMM] Initializing Physical Memory Manager...\n");
+
+    pmm_state.total_pages = 0;
+    pmm_state.free_pages = 0;
+    pmm_state.used_pages = 0;
+    pmm_state.highest_page = 0;
+
+    memory_descriptor_t *mmap;
+    uint64_t num_entries;
+    uint64_t desc_size;
+
+    // Check if we have boot info
+    if (!boot_info || !boot_info->memory_map || boot_info->memory_map_size == 0) {
+        serial_debug_str("boot_info_null_path\n");
+        console_print("[PMM] WARNING: No memory map available\n");
+        console_print("[PMM] Using default 16MB memory assumption\n");
+
+        mmap = default_memory_map;
+        num_entries = sizeof(default_memory_map) / sizeof(default_memory_map[0]);
+        desc_size = sizeof(memory_descriptor_t);
+    } else {
+        // Parse UEFI memory map
+        console_print("[PMM] Parsing memory map...\n");
+
+        mmap = boot_info->memory_map;
+        desc_size = boot_info->memory_map_descriptor_size;
+        num_entries = boot_info->memory_map_size / desc_size;
+
+        console_print("[PMM] Memory map entries: ");
+        console_print_dec(num_entries);
+        console_print("\n");
+    }
+
+    // First pass: Find total memory and highest page
+    // Only conventional memory is tracked, so MMIO holes high in the
+    // address space don't inflate the metadata
+    for (uint64_t i = 0; i < num_entries; i++) {
+        memory_descriptor_t *entry = (memory_descriptor_t*)((uint8_t*)mmap + i * desc_size);
+        if (entry->type != MEMORY_TYPE_AVAILABLE) {
+            continue;
+        }
+
+        uint64_t end_page = ADDR_TO_PAGE(entry->physical_start) + entry->number_of_pages;
+        if (end_page > pmm_state.highest_page) {
+            pmm_state.highest_page = end_page;
+        }
+        pmm_state.total_pages += entry->number_of_pages;
+    }
+
+    console_print("[PMM] Highest page: ");
+    console_print_hex(pmm_state.highest_page);
+    console_print("\n");
+
+    setup_metadata(mmap, num_entries, desc_size);
+    serial_debug_str("pmm_metadata_ready\n");
+
+    // Second pass: Mark available pages as free
+    for (uint64_t i = 0; i < num_entries; i++) {
+        memory_descriptor_t *entry = (memory_descriptor_t*)((uint8_t*)mmap + i * desc_size);
+
+        // Only mark conventional (available) memory as free
+        if (entry->type != MEMORY_TYPE_AVAILABLE) {
+            continue;
+        }
+
+        uint64_t start_page = ADDR_TO_PAGE(entry->physical_start);
+        uint64_t num_pages = entry->number_of_pages;
+
+        // Skip if beyond our bitmap
+        if (start_page >= pmm_state.highest_page) {
+            continue;
+        }
+
+        // Limit to bitmap size
+        if (start_page + num_pages > pmm_state.highest_page) {
+            num_pages = pmm_state.highest_page - start_page;
+        }
+
+        // Mark pages as free
+        bitmap_clear_range(start_page, start_page + num_pages);
+        pmm_state.free_pages += num_pages;
+    }
+
+    // Reserve first 1MB (BIOS, VGA, etc.), the kernel image and the metadata
+    reserve_low_memory();
+    if (pmm_metadata.in_ram) {
+        uint64_t start_page = ADDR_TO_PAGE((uint64_t)pmm_metadata.base);
+        reserve_pages(start_page, start_page +
+                      ADDR_TO_PAGE(PAGE_ALIGN_UP(pmm_metadata.words * sizeof(uint64_t))));
+
+        start_page = ADDR_TO_PAGE((uint64_t)pmm_metadata.pages);
+        reserve_pages(start_page, ADDR_TO_PAGE(PAGE_ALIGN_UP(
+                      (uint64_t)(pmm_metadata.pages + pmm_state.highest_page))));
+    }
+
+    // Hand the remaining free pages to the per-zone buddy allocators
+    uint64_t *pool = pmm_metadata.base + (pmm_state.highest_page + 63) / 64;
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        uint64_t start, end;
+        zone_span(zone, pmm_state.highest_page, &start, &end);
+        buddy_setup(&zones[zone], start, end - start, &pool);
+        buddy_build_from_bitmap(&zones[zone]);
+        if (end > start) {
+            pcp_zone = zone;
+        }
+    }
+
+    // Descriptors above the boot identity map wait for vmm_init()
+    if ((uint64_t)(pmm_metadata.pages + pmm_state.highest_page) <= PMM_IDENTITY_LIMIT) {
+        page_descriptors_setup();
+    } else {
+        console_print("[PMM] Page descriptors deferred until memory is mapped\n");
+    }
+
+    pmm_state.used_pages = pmm_state.total_pages - pmm_state.free_pages;
+    pmm_state.initialized = true;
+
+    // Set the boot-time huge frame reservations aside while memory is
+    // still unfragmented
+    pmm_huge_pool_reserve(PMM_HUGE_ORDER_2MB, PMM_HUGE_POOL_2MB);
+    pmm_huge_pool_reserve(PMM_HUGE_ORDER_1GB, PMM_HUGE_POOL_1GB);
+    pmm_register_shrinker(&huge_pool_shrinker);
+
+    console_print("[PMM] Initialization complete\n");
+    serial_debug_str("pmm_init_done\n");
+    pmm_print_stats();
+}
+
+/**
+ * Mark or unmark a frame as held in a per-CPU cache
+ */
+static inline void pcp_set_cached(uint64_t page, bool cached) {
+    if (!page_descs_ready) {
+        return;
+    }
+
+    if (cached) {
+        page_descs[page].flags |= PAGE_FLAG_PCP;
+    } else {
+        page_descs[page].flags &= ~PAGE_FLAG_PCP;
+    }
+}
+
+/**
+ * Move up to count frames from the global allocator into a per-CPU cache
+ * Caller has interrupts disabled
+ */
+static void pcp_refill(pmm_pcp_t *pcp, uint32_t count) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    while (count-- > 0 && pcp->count < PMM_PCP_CAPACITY) {
+        uint64_t page = zone_alloc_block(0, PMM_ZONE_NORMAL);
+        if (page == FREE_MAP_NONE) {
+            break;
+        }
+
+        bitmap_set(page);
+        pmm_state.free_pages--;
+        pmm_state.used_pages++;
+        pcp_set_cached(page, true);
+        pcp->pages[pcp->count++] = page;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/**
+ * Return frames from a per-CPU cache to the global allocator until
+ * only keep frames are left
+ * Caller has interrupts disabled
+ */
+static void pcp_drain(pmm_pcp_t *pcp, uint32_t keep) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    while (pcp->count > keep) {
+        uint64_t page = pcp->pages[--pcp->count];
+        pcp_set_cached(page, false);
+        bitmap_clear(page);
+        buddy_free_block(zone_of_page(page), page, 0);
+        pmm_state.free_pages++;
+        pmm_state.used_pages--;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/**
+ * Take every frame in [start, end) out of the current CPU's cache
+ */
+static void pcp_steal_range(uint64_t start, uint64_t end) {
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[cpu_current_id()];
+
+    for (uint32_t i = 0; i < pcp->count; ) {
+        if (pcp->pages[i] >= start && pcp->pages[i] < end) {
+            pcp_set_cached(pcp->pages[i], false);
+            pcp->pages[i] = pcp->pages[--pcp->count];
+        } else {
+            i++;
+        }
+    }
+
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Count frames held in per-CPU caches
+ */
+static uint64_t pcp_cached_pages(void) {
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += pcp_caches[cpu].count;
+    }
+    return total;
+}
+
+/**
+ * Return all frames cached by the current CPU to the global allocator
+ */
+void pmm_pcp_drain(void) {
+    uint64_t flags = cpu_irq_save();
+    pcp_drain(&pcp_caches[cpu_current_id()], 0);
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Set per-CPU cache watermarks
+ */
+void pmm_pcp_set_watermarks(uint32_t low, uint32_t high) {
+    if (low >= high || high >= PMM_PCP_CAPACITY) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    pcp_watermarks.low = low;
+    pcp_watermarks.high = high;
+
+    pmm_pcp_t *pcp = &pcp_caches[cpu_current_id()];
+    if (pcp->count > high) {
+        pcp_drain(pcp, low);
+    }
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Zero a frame with non-temporal stores, so clearing it does not
+ * evict useful cache lines
+ */
+static void zero_frame(uint64_t addr) {
+    uint64_t *p = (uint64_t*)addr;
+    uint64_t *end = p + PAGE_SIZE / sizeof(uint64_t);
+
+    for (; p < end; p += 8) {
+        __asm__ __volatile__(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            "movnti %1, 32(%0)\n\t"
+            "movnti %1, 40(%0)\n\t"
+            "movnti %1, 48(%0)\n\t"
+            "movnti %1, 56(%0)"
+            : : "r"(p), "r"(0ULL) : "memory");
+    }
+
+    // Non-temporal stores are weakly ordered
+    __asm__ __volatile__("sfence" : : : "memory");
+}
+
+/**
+ * Take every frame in [start, end) out of the zero pool
+ * Caller holds pmm_lock
+ */
+static void zero_pool_steal_range(uint64_t start, uint64_t end) {
+    for (uint32_t i = 0; i < zero_pool.count; ) {
+        if (zero_pool.pages[i] >= start && zero_pool.pages[i] < end) {
+            zero_pool.pages[i] = zero_pool.pages[--zero_pool.count];
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Pop a frame from the zero pool
+ *
+ * @return Page number, or FREE_MAP_NONE if the pool is empty
+ */
+static uint64_t zero_pool_pop(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t page = zero_pool.count > 0 ? zero_pool.pages[--zero_pool.count] : FREE_MAP_NONE;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return page;
+}
+
+/**
+ * Return every pooled frame to the buddy allocator
+ */
+static void zero_pool_drain(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    while (zero_pool.count > 0) {
+        uint64_t page = zero_pool.pages[--zero_pool.count];
+        bitmap_clear(page);
+        buddy_free_block(zone_of_page(page), page, 0);
+        pmm_state.free_pages++;
+        pmm_state.used_pages--;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/**
+ * Pop a frame from this CPU's cache, refilling it in one batch from the
+ * buddy allocator when empty
+ *
+ * @param refilled Set if the cache had to be refilled
+ * @return Page number, or FREE_MAP_NONE
+ */
+static uint64_t pcp_alloc(bool *refilled) {
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[cpu_current_id()];
+
+    *refilled = pcp->count == 0;
+    if (*refilled) {
+        pcp_refill(pcp, pcp_watermarks.low);
+    }
+
+    uint64_t page = pcp->count > 0 ? pcp->pages[--pcp->count] : FREE_MAP_NONE;
+    if (page != FREE_MAP_NONE) {
+        pcp_set_cached(page, false);
+    }
+    cpu_irq_restore(flags);
+    return page;
+}
+
+/**
+ * Allocate a single physical page frame
+ */
+uint64_t pmm_alloc_frame(void) {
+    if (!pmm_state.initialized) {
+        console_print("[DEBUG] PMM not initialized!\n");
+        return 0;
+    }
+
+    bool refilled;
+    uint64_t page = pcp_alloc(&refilled);
+
+    if (page == FREE_MAP_NONE) {
+        // Last resort: a pre-zeroed frame is still a frame
+        page = zero_pool_pop();
+    }
+
+    if (page == FREE_MAP_NONE && pmm_shrink(PMM_SHRINK_BATCH) > 0) {
+        page = pcp_alloc(&refilled);
+    }
+
+    if (page == FREE_MAP_NONE) {
+        console_print("[DEBUG] PMM: Out of memory!\n");
+        return 0;
+    }
+
+    page_descs_alloc(page, 1, 0);
+
+    // Only checked when the cache went back to the buddy allocator, so the
+    // fast path stays untouched
+    if (refilled && pmm_state.free_pages < PMM_SHRINK_WATERMARK) {
+        pmm_shrink(PMM_SHRINK_WATERMARK - pmm_state.free_pages);
+    }
+
+    return PAGE_TO_ADDR(page);
+}
+
+/**
+ * Allocate a single physical page frame from zone or a lower zone
+ */
+uint64_t pmm_alloc_frame_zone(pmm_zone_t zone) {
+    if (zone >= PMM_ZONE_NORMAL) {
+        return pmm_alloc_frame();
+    }
+
+    // Per-CPU caches hold frames from any zone, so constrained
+    // requests go straight to the zone allocators
+    return pmm_alloc_frames_zone(1, zone);
+}
+
+/**
+ * Allocate a zero-filled physical page frame
+ */
+uint64_t pmm_alloc_zeroed_frame(void) {
+    if (!pmm_state.initialized) {
+        return 0;
+    }
+
+    uint64_t page = zero_pool_pop();
+    if (page != FREE_MAP_NONE) {
+        __atomic_add_fetch(&zero_pool.hits, 1, __ATOMIC_RELAXED);
+        page_descs_alloc(page, 1, 0);
+        return PAGE_TO_ADDR(page);
+    }
+
+    // Pool is empty - clear a frame on the allocation path
+    __atomic_add_fetch(&zero_pool.misses, 1, __ATOMIC_RELAXED);
+    uint64_t addr = pmm_alloc_frame();
+    if (addr) {
+        zero_frame(addr);
+    }
+    return addr;
+}
+
+/**
+ * Zero frames ahead of time for pmm_alloc_zeroed_frame()
+ */
+uint32_t pmm_zero_pool_refill(uint32_t max) {
+    uint32_t zeroed = 0;
+
+    if (!pmm_state.initialized) {
+        return 0;
+    }
+
+    while (zeroed < max) {
+        // Stop when full, and leave the last free memory for real allocations
+        if (zero_pool.count >= PMM_ZERO_POOL_SIZE ||
+            pmm_state.free_pages < PMM_ZERO_POOL_RESERVE) {
+            break;
+        }
+
+        uint64_t addr = pmm_alloc_frame();
+        if (addr == 0) {
+            break;
+        }
+
+        // Clear outside the lock; only the push is serialized
+        zero_frame(addr);
+
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        bool pooled = zero_pool.count < PMM_ZERO_POOL_SIZE;
+        if (pooled) {
+            zero_pool.pages[zero_pool.count++] = ADDR_TO_PAGE(addr);
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+
+        if (!pooled) {
+            pmm_free_frame(addr);  // Filled up concurrently
+            break;
+        }
+        zeroed++;
+    }
+
+    return zeroed;
+}
+
+/**
+ * Allocate contiguous pages from the global allocator
+ * Runs larger than the biggest buddy block start on a multiple of align
+ * pages; smaller power-of-two blocks are always aligned to their size
+ * Caller holds pmm_lock
+ *
+ * @return First page, or FREE_MAP_NONE
+ */
+static uint64_t global_alloc_frames(uint64_t count, uint64_t align, pmm_zone_t zone) {
+    if (pmm_state.free_pages < count) {
+        return FREE_MAP_NONE;  // Not enough memory
+    }
+
+    uint32_t order = order_for_count(count);
+    uint64_t start_page;
+
+    if (order <= PMM_MAX_ORDER) {
+        start_page = zone_alloc_block(order, zone);
+        if (start_page == FREE_MAP_NONE) {
+            return FREE_MAP_NONE;  // Not enough contiguous pages
+        }
+
+        // Give back the part of the block beyond count
+        buddy_free_range(zone_of_page(start_page), start_page + count, (1ULL << order) - count);
+    } else {
+        start_page = zone_alloc_run(count, align, zone);
+        if (start_page == FREE_MAP_NONE) {
+            return FREE_MAP_NONE;  // Not enough contiguous pages
+        }
+
+        uint64_t run_pages = ((count + (1ULL << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER) << PMM_MAX_ORDER;
+        buddy_free_range(zone_of_page(start_page), start_page + count, run_pages - count);
+    }
+
+    bitmap_set_range(start_page, start_page + count);
+    pmm_state.free_pages -= count;
+    pmm_state.used_pages += count;
+    return start_page;
+}
+
+/**
+ * Allocate multiple contiguous physical page frames
+ */
+uint64_t pmm_alloc_frames(uint64_t count) {
+    return pmm_alloc_frames_zone(count, PMM_ZONE_NORMAL);
+}
+
+/**
+ * Allocate contiguous pages, draining frame caches and retrying once
+ *
+ * @return First page, or FREE_MAP_NONE
+ */
+static uint64_t alloc_contiguous(uint64_t count, uint64_t align, pmm_zone_t zone) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t start_page = global_alloc_frames(count, align, zone);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (start_page == FREE_MAP_NONE) {
+        // Take memory back from caches if free memory is short, then
+        // return cached and pre-zeroed single frames that may be
+        // splitting the run we need
+        if (pmm_state.free_pages < count + PMM_SHRINK_WATERMARK) {
+            pmm_shrink(count);
+        }
+        pmm_pcp_drain();
+        zero_pool_drain();
+
+        flags = spin_lock_irqsave(&pmm_lock);
+        start_page = global_alloc_frames(count, align, zone);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    if (start_page == FREE_MAP_NONE && count > 1) {
+        // Enough memory may be free, just not in one piece
+        uint32_t order = order_for_count(count);
+        uint32_t blocks = 1;
+        if (order > PMM_MAX_ORDER) {
+            order = PMM_MAX_ORDER;
+            blocks = (uint32_t)((count + (1ULL << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER);
+        }
+
+        if (pmm_compact(order, zone, blocks) > 0) {
+            flags = spin_lock_irqsave(&pmm_lock);
+            start_page = global_alloc_frames(count, align, zone);
+            spin_unlock_irqrestore(&pmm_lock, flags);
+        }
+    }
+
+    return start_page;
+}
+
+/**
+ * Allocate multiple contiguous physical page frames from zone or a lower zone
+ */
+uint64_t pmm_alloc_frames_zone(uint64_t count, pmm_zone_t zone) {
+    if (!pmm_state.initialized || count == 0 || zone >= PMM_ZONE_COUNT) {
+        return 0;
+    }
+
+    uint64_t start_page = alloc_contiguous(count, 1, zone);
+    if (start_page == FREE_MAP_NONE) {
+        return 0;
+    }
+
+    page_descs_alloc(start_page, count, 0);
+    return PAGE_TO_ADDR(start_page);
+}
+
+/**
+ * Allocate a naturally aligned block of 2^order pages
+ */
+uint64_t pmm_alloc_order(uint32_t order) {
+    if (!pmm_state.initialized || order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    // A power-of-two run from the buddy allocator is always aligned
+    // to its size
+    uint64_t addr = pmm_alloc_frames(1ULL << order);
+    if (addr && page_descs_ready) {
+        page_descs[ADDR_TO_PAGE(addr)].order = (uint8_t)order;
+    }
+    return addr;
+}
+
+/**
+ * Free a block allocated with pmm_alloc_order()
+ */
+void pmm_free_order(uint64_t addr, uint32_t order) {
+    if (!pmm_state.initialized || order > PMM_MAX_ORDER) {
+        return;
+    }
+
+    uint64_t start_page = ADDR_TO_PAGE(addr);
+    uint64_t count = 1ULL << order;
+    if (start_page + count > pmm_state.highest_page || (start_page & (count - 1)) != 0) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    if (bitmap_test(start_page)) {
+        page_descs_free(start_page, count);
+        bitmap_clear_range(start_page, start_page + count);
+        buddy_free_block(zone_of_page(start_page), start_page, order);
+        pmm_state.free_pages += count;
+        pmm_state.used_pages -= count;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Helper: Pool for a huge frame order
+static inline huge_pool_t* huge_pool_for(uint32_t order) {
+    for (uint32_t i = 0; i < sizeof(huge_pools) / sizeof(huge_pools[0]); i++) {
+        if (huge_pools[i].order == order) {
+            return &huge_pools[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a huge frame
+ */
+uint64_t pmm_alloc_huge(uint32_t order) {
+    huge_pool_t *pool = huge_pool_for(order);
+    if (!pmm_state.initialized || !pool) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t page = pool->count > 0 ? pool->pages[--pool->count] : FREE_MAP_NONE;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (page == FREE_MAP_NONE) {
+        page = alloc_contiguous(1ULL << order, 1ULL << order, PMM_ZONE_NORMAL);
+        if (page == FREE_MAP_NONE) {
+            return 0;
+        }
+    }
+
+    page_descs_alloc(page, 1ULL << order, order);
+    if (page_descs_ready) {
+        page_descs[page].flags |= PAGE_FLAG_HUGE;
+    }
+    return PAGE_TO_ADDR(page);
+}
+
+/**
+ * Free a huge frame
+ */
+void pmm_free_huge(uint64_t addr, uint32_t order) {
+    huge_pool_t *pool = huge_pool_for(order);
+    if (!pmm_state.initialized || !pool) {
+        return;
+    }
+
+    uint64_t page = ADDR_TO_PAGE(addr);
+    uint64_t count = 1ULL << order;
+    if (page + count > pmm_state.highest_page || (page & (count - 1)) != 0 || !bitmap_test(page)) {
+        return;
+    }
+
+    page_descs_free(page, count);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    bool pooled = pool->count < pool->target;
+    if (pooled) {
+        pool->pages[pool->count++] = page;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (!pooled) {
+        pmm_free_frames(addr, count);
+    }
+}
+
+/**
+ * Resize the reserved pool of huge frames
+ */
+uint32_t pmm_huge_pool_reserve(uint32_t order, uint32_t count) {
+    huge_pool_t *pool = huge_pool_for(order);
+    if (!pmm_state.initialized || !pool) {
+        return 0;
+    }
+
+    if (count > PMM_HUGE_POOL_MAX) {
+        count = PMM_HUGE_POOL_MAX;
+    }
+    pool->target = count;
+
+    while (pool->count < count) {
+        // Leave most memory to ordinary allocations
+        if ((pmm_state.free_pages >> 3) < (1ULL << order)) {
+            break;
+        }
+
+        uint64_t page = alloc_contiguous(1ULL << order, 1ULL << order, PMM_ZONE_NORMAL);
+        if (page == FREE_MAP_NONE) {
+            break;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        pool->pages[pool->count++] = page;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    while (pool->count > count) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        uint64_t page = pool->pages[--pool->count];
+        spin_unlock_irqrestore(&pmm_lock, flags);
+
+        pmm_free_frames(PAGE_TO_ADDR(page), 1ULL << order);
+    }
+
+    return pool->count;
+}
+
+/**
+ * Free a physical page frame
+ */
+void pmm_free_frame(uint64_t addr) {
+    if (!pmm_state.initialized) {
+        return;
+    }
+
+    uint64_t page = ADDR_TO_PAGE(addr);
+    if (page >= pmm_state.highest_page) {
+        return;
+    }
+
+    // Read-only double free check; the bitmap word is only written
+    // when caches are refilled or drained
+    if (!bitmap_test(page)) {
+        return;
+    }
+
+    // Cached frames stay allocated in the bitmap, so a second free of
+    // a frame still sitting in a cache is only visible in its descriptor
+    if (page_descs_ready && (page_descs[page].flags & PAGE_FLAG_PCP)) {
+        console_print("[PMM] WARNING: Double free of cached frame ");
+        console_print_hex(addr);
+        console_print("\n");
+        return;
+    }
+
+    page_descs_free(page, 1);
 
-// Helper: Clear a bit in the bitmap
-static inline void bitmap_clear(uint64_t bit) {
-    page_bitmap[bit / 8] &= ~(1 << (bit % 8));
-}
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[cpu_current_id()];
 
-// Helper: Test a bit in the bitmap
-static inline bool bitmap_test(uint64_t bit) {
-    return (page_bitmap[bit / 8] & (1 << (bit % 8))) != 0;
+    // Lower-zone frames go straight back to their zone, so allocations
+    // that only need Normal memory keep coming from the highest zone
+    if (page_zone(page) < pcp_zone) {
+        uint64_t lock_flags = spin_lock_irqsave(&pmm_lock);
+        bitmap_clear(page);
+        buddy_free_block(zone_of_page(page), page, 0);
+        pmm_state.free_pages++;
+        pmm_state.used_pages--;
+        spin_unlock_irqrestore(&pmm_lock, lock_flags);
+        cpu_irq_restore(flags);
+        return;
+    }
+
+    // Fast path: push onto this CPU's cache, draining a batch back to
+    // the buddy allocator when it grows past the high watermark
+    pcp_set_cached(page, true);
+    pcp->pages[pcp->count++] = page;
+    if (pcp->count > pcp_watermarks.high) {
+        pcp_drain(pcp, pcp_watermarks.low);
+    }
+
+    cpu_irq_restore(flags);
 }
 
 /**
- * Initialize PMM with boot memory map
+ * Free multiple contiguous physical page frames
  */
-void pmm_init(boot_info_t *boot_info) {
-    serial_debug_str("pmm_init_start\n");
-    console_print("[PMM] Initializing Physical Memory Manager...\n");
-    serial_debug_str("after_pmm_console_print\n");
+void pmm_free_frames(uint64_t addr, uint64_t count) {
+    if (!pmm_state.initialized) {
+        return;
+    }
 
-    // Bitmap already initialized to 0xFF at compile time
-    // No need for runtime clearing loop
-    serial_debug_str("bitmap_already_init\n");
+    uint64_t page = ADDR_TO_PAGE(addr);
+    uint64_t end = page + count;
+    if (end > pmm_state.highest_page) {
+        end = pmm_state.highest_page;
+    }
 
-    serial_debug_str("clearing_pmm_state\n");
-    serial_debug_str("set_total_pages\n");
-    pmm_state.total_pages = 0;
-    serial_debug_str("set_free_pages\n");
-    pmm_state.free_pages = 0;
-    serial_debug_str("set_used_pages\n");
-    pmm_state.used_pages = 0;
-    serial_debug_str("set_highest_page\n");
-    pmm_state.highest_page = 0;
-    serial_debug_str("after_pmm_state\n");
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
 
-    // Check if we have boot info
-    serial_debug_str("checking_boot_info\n");
-    if (!boot_info || !boot_info->memory_map || boot_info->memory_map_size == 0) {
-        serial_debug_str("boot_info_null_path\n");
-        console_print("[PMM] WARNING: No memory map available\n");
-        serial_debug_str("after_warning\n");
-        console_print("[PMM] Using default 16MB memory assumption\n");
-        serial_debug_str("after_default_msg\n");
-
-        // Default: Mark first 16MB as available (except first 1MB)
-        serial_debug_str("calc_default_pages\n");
-        uint64_t default_pages = (16 * 1024 * 1024) / PAGE_SIZE;  // 16MB = 4096 pages
-        uint64_t reserved_pages = (1 * 1024 * 1024) / PAGE_SIZE;  // First 1MB reserved
-
-        serial_debug_str("set_total_pages\n");
-        pmm_state.total_pages = default_pages;
-        pmm_state.highest_page = default_pages;
-
-        // Mark pages 256-4095 as free (1MB-16MB)
-        serial_debug_str("before_mark_free\n");
-        for (uint64_t i = reserved_pages; i < default_pages; i++) {
-            bitmap_clear(i);
-            pmm_state.free_pages++;
-        }
-        serial_debug_str("after_mark_free\n");
-
-        // IMPORTANT: Reserve kernel memory (1MB-2MB) - kernel lives here!
-        serial_debug_str("reserving_kernel\n");
-        uint64_t kernel_start_page = ADDR_TO_PAGE(0x100000);  // 1MB
-        uint64_t kernel_end_page = ADDR_TO_PAGE(0x200000);    // 2MB
-        for (uint64_t page = kernel_start_page; page < kernel_end_page; page++) {
-            if (!bitmap_test(page)) {
-                bitmap_set(page);
-                if (pmm_state.free_pages > 0) {
-                    pmm_state.free_pages--;
-                }
-            }
+    // Free each run of allocated pages as whole buddy blocks,
+    // skipping pages that are already free
+    while (page < end) {
+        uint64_t run_start = bitmap_find_next(page, end, true);
+        if (run_start >= end) {
+            break;
         }
-        serial_debug_str("kernel_reserved\n");
 
-        serial_debug_str("calc_used_pages\n");
-        pmm_state.used_pages = pmm_state.total_pages - pmm_state.free_pages;
-        pmm_state.initialized = true;
+        page = bitmap_find_next(run_start, end, false);
+        page_descs_free(run_start, page - run_start);
+        bitmap_clear_range(run_start, page);
 
-        serial_debug_str("before_init_msg\n");
-        console_print("[PMM] Initialized with default memory layout\n");
-        serial_debug_str("before_print_stats\n");
-        pmm_print_stats();
-        serial_debug_str("pmm_init_done\n");
-        return;
+        zones_free_range(run_start, page);
+        pmm_state.free_pages += page - run_start;
+        pmm_state.used_pages -= page - run_start;
     }
 
-    // Parse UEFI memory map
-    console_print("[PMM] Parsing memory map...\n");
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
 
-    uint64_t num_entries = boot_info->memory_map_size / boot_info->memory_map_descriptor_size;
-    memory_descriptor_t *mmap = boot_info->memory_map;
+/**
+ * Mark a physical page as used
+ */
+void pmm_mark_used(uint64_t addr) {
+    pmm_mark_used_range(addr, 1);
+}
 
-    console_print("[PMM] Memory map entries: ");
-    console_print_dec(num_entries);
-    console_print("\n");
+/**
+ * Mark multiple pages as used
+ */
+void pmm_mark_used_range(uint64_t addr, uint64_t count) {
+    if (!pmm_state.initialized) {
+        return;
+    }
 
-    // First pass: Find total memory and highest page
-    for (uint64_t i = 0; i < num_entries; i++) {
-        memory_descriptor_t *entry = (memory_descriptor_t*)
-            ((uint8_t*)mmap + (i * boot_info->memory_map_descriptor_size));
+    uint64_t page = ADDR_TO_PAGE(addr);
+    uint64_t end = page + count;
+    if (end > pmm_state.highest_page) {
+        end = pmm_state.highest_page;
+    }
 
-        uint64_t start_page = ADDR_TO_PAGE(entry->physical_start);
-        uint64_t num_pages = entry->number_of_pages;
-        uint64_t end_page = start_page + num_pages;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
 
-        if (end_page > pmm_state.highest_page) {
-            pmm_state.highest_page = end_page;
+    // Already allocated pages may be sitting in a frame cache or the
+    // zero pool waiting to be handed out again - keep them from being reused
+    pcp_steal_range(page, end);
+    zero_pool_steal_range(page, end);
+
+    // Take each free run out of the buddy allocator
+    while (page < end) {
+        uint64_t free_start = bitmap_find_next(page, end, false);
+        if (free_start >= end) {
+            break;
         }
 
-        // Only count conventional memory as total
-        if (entry->type == MEMORY_TYPE_AVAILABLE) {
-            pmm_state.total_pages += num_pages;
+        page = bitmap_find_next(free_start, end, true);
+        bitmap_set_range(free_start, page);
+        zones_remove_range(free_start, page);
+        pmm_state.free_pages -= page - free_start;
+        pmm_state.used_pages += page - free_start;
+
+        if (page_descs_ready) {
+            for (uint64_t p = free_start; p < page; p++) {
+                page_descs[p].flags = PAGE_FLAG_RESERVED;
+                page_descs[p].refcount = 1;
+                page_descs[p].zone = (uint8_t)(zone_of_page(p) - zones);
+                page_descs[p].owner = PAGE_OWNER_KERNEL;
+            }
         }
     }
 
-    console_print("[PMM] Highest page: ");
-    console_print_hex(pmm_state.highest_page);
-    console_print("\n");
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
 
-    // Check if we have enough bitmap space
-    uint64_t required_bitmap_bytes = (pmm_state.highest_page + 7) / 8;
-    if (required_bitmap_bytes > BITMAP_SIZE) {
-        console_print("[PMM] WARNING: Not enough bitmap space\n");
-        console_print("[PMM] Required: ");
-        console_print_dec(required_bitmap_bytes);
-        console_print(" bytes, Available: ");
-        console_print_dec(BITMAP_SIZE);
-        console_print(" bytes\n");
-        pmm_state.highest_page = BITMAP_SIZE * 8;
+/**
+ * Check if a physical page is allocated
+ */
+bool pmm_is_allocated(uint64_t addr) {
+    if (!pmm_state.initialized) {
+        return true;
     }
 
-    // Second pass: Mark available pages as free
-    for (uint64_t i = 0; i < num_entries; i++) {
-        memory_descriptor_t *entry = (memory_descriptor_t*)
-            ((uint8_t*)mmap + (i * boot_info->memory_map_descriptor_size));
+    uint64_t page = ADDR_TO_PAGE(addr);
+    if (page >= pmm_state.highest_page) {
+        return true;
+    }
 
-        // Only mark conventional (available) memory as free
-        if (entry->type != MEMORY_TYPE_AVAILABLE) {
-            continue;
-        }
+    return bitmap_test(page);
+}
 
-        uint64_t start_page = ADDR_TO_PAGE(entry->physical_start);
-        uint64_t num_pages = entry->number_of_pages;
+/**
+ * Set up page descriptors deferred by pmm_init()
+ */
+void pmm_init_page_descriptors(void) {
+    if (!pmm_state.initialized || page_descs_ready) {
+        return;
+    }
 
-        // Skip if beyond our bitmap
-        if (start_page >= pmm_state.highest_page) {
-            continue;
-        }
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    page_descriptors_setup();
+    spin_unlock_irqrestore(&pmm_lock, flags);
 
-        // Limit to bitmap size
-        if (start_page + num_pages > pmm_state.highest_page) {
-            num_pages = pmm_state.highest_page - start_page;
-        }
+    console_print("[PMM] Page descriptors ready\n");
+}
 
-        // Mark pages as free
-        for (uint64_t page = start_page; page < start_page + num_pages; page++) {
-            bitmap_clear(page);
-            pmm_state.free_pages++;
-        }
+/**
+ * Get the descriptor of a physical page
+ */
+page_t* pmm_page(uint64_t addr) {
+    uint64_t page = ADDR_TO_PAGE(addr);
+    if (!page_descs_ready || page >= pmm_state.highest_page) {
+        return NULL;
     }
+    return &page_descs[page];
+}
 
-    // Reserve first 1MB (BIOS, VGA, etc.)
-    uint64_t reserved_pages = (1 * 1024 * 1024) / PAGE_SIZE;
-    for (uint64_t page = 0; page < reserved_pages; page++) {
-        if (!bitmap_test(page)) {
-            bitmap_set(page);
-            if (pmm_state.free_pages > 0) {
-                pmm_state.free_pages--;
-            }
-        }
-    }
+/**
+ * Get the physical address described by a page descriptor
+ */
+uint64_t pmm_page_addr(page_t *page) {
+    return PAGE_TO_ADDR((uint64_t)(page - page_descs));
+}
 
-    // Reserve kernel memory (1MB - 2MB range)
-    uint64_t kernel_start_page = ADDR_TO_PAGE(0x100000);  // 1MB
-    uint64_t kernel_end_page = ADDR_TO_PAGE(0x200000);    // 2MB
-    for (uint64_t page = kernel_start_page; page < kernel_end_page; page++) {
-        if (!bitmap_test(page)) {
-            bitmap_set(page);
-            if (pmm_state.free_pages > 0) {
-                pmm_state.free_pages--;
-            }
-        }
+/**
+ * Take an additional reference on a page
+ */
+void pmm_page_get(page_t *page) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference on a page
+ */
+int32_t pmm_page_put(page_t *page) {
+    int32_t refs = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refs > 0) {
+        return refs;
     }
 
-    pmm_state.used_pages = pmm_state.total_pages - pmm_state.free_pages;
-    pmm_state.initialized = true;
+    // Last reference - a pmm_alloc_huge() or pmm_alloc_order() head frees
+    // its whole block (skipping any pages already freed on their own)
+    uint64_t addr = pmm_page_addr(page);
+    if (page->flags & PAGE_FLAG_HUGE) {
+        pmm_free_huge(addr, page->order);
+    } else if (page->order > 0) {
+        pmm_free_frames(addr, 1ULL << page->order);
+    } else {
+        pmm_free_frame(addr);
+    }
+    return 0;
+}
 
-    console_print("[PMM] Initialization complete\n");
-    pmm_print_stats();
+/**
+ * Register the migration callback used by compaction
+ */
+void pmm_register_migrate(pmm_migrate_fn fn) {
+    migrate_page = fn;
 }
 
 /**
- * Allocate a single physical page frame
+ * Register a cache shrinker
  */
-uint64_t pmm_alloc_frame(void) {
-    if (!pmm_state.initialized) {
-        console_print("[DEBUG] PMM not initialized!\n");
-        return 0;
+void pmm_register_shrinker(pmm_shrinker_t *shrinker) {
+    if (!shrinker || !shrinker->count || !shrinker->scan) {
+        return;
     }
 
-    if (pmm_state.free_pages == 0) {
-        console_print("[DEBUG] PMM: Out of memory!\n");
-        return 0;
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+
+    pmm_shrinker_t **link = &shrinkers;
+    while (*link && (*link)->priority <= shrinker->priority) {
+        link = &(*link)->next;
     }
+    shrinker->next = *link;
+    *link = shrinker;
+
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+}
 
-    // Find first free page (first-fit)
-    for (uint64_t page = 0; page < pmm_state.highest_page; page++) {
-        if (!bitmap_test(page)) {
-            // Found free page - mark as used
-            page_bitmap[page / 8] |= (1 << (page % 8));
-            pmm_state.free_pages--;
-            pmm_state.used_pages++;
-            return PAGE_TO_ADDR(page);
+/**
+ * Unregister a cache shrinker
+ */
+void pmm_unregister_shrinker(pmm_shrinker_t *shrinker) {
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
+
+    for (pmm_shrinker_t **link = &shrinkers; *link; link = &(*link)->next) {
+        if (*link == shrinker) {
+            *link = shrinker->next;
+            shrinker->next = NULL;
+            break;
         }
     }
 
-    console_print("[DEBUG] PMM: No free pages found!\n");
-    return 0;
+    spin_unlock_irqrestore(&shrinker_lock, flags);
 }
 
 /**
- * Allocate multiple contiguous physical page frames
+ * Ask registered shrinkers for frames
  */
-uint64_t pmm_alloc_frames(uint64_t count) {
-    if (!pmm_state.initialized || count == 0) {
+uint64_t pmm_shrink(uint64_t target) {
+    // Shrinkers free memory through the PMM and may allocate while doing
+    // so; an allocation made from inside a pass must not start another
+    if (__atomic_exchange_n(&shrink_state.active, 1, __ATOMIC_ACQUIRE)) {
         return 0;
     }
 
-    if (pmm_state.free_pages < count) {
-        return 0;  // Not enough memory
-    }
-
-    // Find contiguous free pages
-    uint64_t start_page = 0;
-    uint64_t found_count = 0;
+    uint64_t reclaimed = 0;
+    uint64_t flags = spin_lock_irqsave(&shrinker_lock);
 
-    for (uint64_t page = 0; page < pmm_state.highest_page; page++) {
-        if (!bitmap_test(page)) {
-            if (found_count == 0) {
-                start_page = page;
-            }
-            found_count++;
-
-            if (found_count == count) {
-                // Found enough contiguous pages, allocate them
-                for (uint64_t i = 0; i < count; i++) {
-                    bitmap_set(start_page + i);
-                }
-                pmm_state.free_pages -= count;
-                pmm_state.used_pages += count;
-                return PAGE_TO_ADDR(start_page);
-            }
-        } else {
-            found_count = 0;
+    for (pmm_shrinker_t *shrinker = shrinkers; shrinker && reclaimed < target; shrinker = shrinker->next) {
+        if (shrinker->count() == 0) {
+            continue;
         }
+
+        uint64_t freed = shrinker->scan(target - reclaimed);
+        shrinker->reclaimed += freed;
+        reclaimed += freed;
     }
 
-    return 0;  // Not enough contiguous pages
+    shrink_state.passes++;
+    shrink_state.reclaimed += reclaimed;
+
+    spin_unlock_irqrestore(&shrinker_lock, flags);
+    __atomic_store_n(&shrink_state.active, 0, __ATOMIC_RELEASE);
+    return reclaimed;
 }
 
 /**
- * Free a physical page frame
+ * Count frames held in the huge frame pools
  */
-void pmm_free_frame(uint64_t addr) {
-    if (!pmm_state.initialized) {
-        return;
+static uint64_t huge_pool_count(void) {
+    uint64_t frames = 0;
+    for (uint32_t i = 0; i < sizeof(huge_pools) / sizeof(huge_pools[0]); i++) {
+        frames += (uint64_t)huge_pools[i].count << huge_pools[i].order;
     }
+    return frames;
+}
 
-    uint64_t page = ADDR_TO_PAGE(addr);
-    if (page >= pmm_state.highest_page) {
-        return;
-    }
+/**
+ * Release pooled huge frames, smallest first
+ * Pool targets are kept, so frees refill the pools once memory recovers
+ */
+static uint64_t huge_pool_scan(uint64_t target) {
+    uint64_t freed = 0;
 
-    if (bitmap_test(page)) {
-        bitmap_clear(page);
-        pmm_state.free_pages++;
-        pmm_state.used_pages--;
+    for (uint32_t i = 0; i < sizeof(huge_pools) / sizeof(huge_pools[0]) && freed < target; i++) {
+        huge_pool_t *pool = &huge_pools[i];
+
+        while (freed < target) {
+            uint64_t flags = spin_lock_irqsave(&pmm_lock);
+            uint64_t page = pool->count > 0 ? pool->pages[--pool->count] : FREE_MAP_NONE;
+            spin_unlock_irqrestore(&pmm_lock, flags);
+
+            if (page == FREE_MAP_NONE) {
+                break;
+            }
+            pmm_free_frames(PAGE_TO_ADDR(page), 1ULL << pool->order);
+            freed += 1ULL << pool->order;
+        }
     }
+
+    return freed;
 }
 
+static pmm_shrinker_t huge_pool_shrinker = {
+    .name = "huge_pool",
+    .count = huge_pool_count,
+    .scan = huge_pool_scan,
+    .priority = PMM_SHRINKER_PRIORITY_LOW,
+};
+
 /**
- * Free multiple contiguous physical page frames
+ * Get the fragmentation of free memory for an allocation order
  */
-void pmm_free_frames(uint64_t addr, uint64_t count) {
-    for (uint64_t i = 0; i < count; i++) {
-        pmm_free_frame(addr + (i * PAGE_SIZE));
+uint32_t pmm_fragmentation(uint32_t order) {
+    uint64_t free = 0;
+    uint64_t usable = 0;
+
+    if (order > PMM_MAX_ORDER) {
+        order = PMM_MAX_ORDER;
+    }
+
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+            uint64_t pages = zones[zone].free_blocks[o] << o;
+            free += pages;
+            if (o >= order) {
+                usable += pages;
+            }
+        }
     }
+
+    return free ? (uint32_t)((free - usable) * 100 / free) : 0;
 }
 
 /**
- * Mark a physical page as used
+ * Try to empty one block by migrating its allocated pages elsewhere
+ *
+ * The block's free pages are taken out of the buddy allocator first so
+ * no migration target lands inside it. If a page can't be moved, the
+ * pages freed so far are released one by one and the rest stay put.
+ * Caller holds pmm_lock
+ *
+ * @return Pages migrated, or 0 if the block was not emptied
  */
-void pmm_mark_used(uint64_t addr) {
-    if (!pmm_state.initialized) {
-        return;
+static uint64_t compact_block(buddy_t *bd, uint64_t block, uint32_t order) {
+    uint64_t end = block + (1ULL << order);
+    uint64_t used = 0;
+
+    // Every allocated page must be movable
+    for (uint64_t p = bitmap_find_next(block, end, true); p < end;
+         p = bitmap_find_next(p + 1, end, true)) {
+        page_t *page = &page_descs[p];
+        if (!(page->flags & PAGE_FLAG_MOVABLE) || page->refcount != 1 || page->mapcount != 1) {
+            return 0;
+        }
+        used++;
     }
 
-    uint64_t page = ADDR_TO_PAGE(addr);
-    if (page >= pmm_state.highest_page) {
-        return;
+    uint64_t free_inside = (1ULL << order) - used;
+    if (used == 0 || pmm_state.free_pages < free_inside + used) {
+        return 0;  // Already free, or nowhere to move the pages to
     }
 
-    if (!bitmap_test(page)) {
-        bitmap_set(page);
-        if (pmm_state.free_pages > 0) {
-            pmm_state.free_pages--;
+    // Pages of the block that are (or have become) free, held back
+    // from the buddy allocator
+    uint64_t held[(1ULL << PMM_MAX_ORDER) / 64] = {0};
+
+    for (uint64_t p = bitmap_find_next(block, end, false); p < end;
+         p = bitmap_find_next(p + 1, end, false)) {
+        held[(p - block) / 64] |= 1ULL << ((p - block) % 64);
+    }
+    for (uint64_t p = block; p < end; ) {
+        uint64_t start = bitmap_find_next(p, end, false);
+        if (start >= end) {
+            break;
+        }
+        p = bitmap_find_next(start, end, true);
+        bitmap_set_range(start, p);
+        buddy_remove_range(bd, start, p);
+    }
+
+    uint64_t moved = 0;
+    for (uint64_t p = block; p < end && moved < used; p++) {
+        if (held[(p - block) / 64] & (1ULL << ((p - block) % 64))) {
+            continue;
+        }
+
+        uint64_t target = zone_alloc_block(0, PMM_ZONE_NORMAL);
+        if (target == FREE_MAP_NONE) {
+            break;
+        }
+        if (!migrate_page(&page_descs[p], PAGE_TO_ADDR(p), PAGE_TO_ADDR(target))) {
+            buddy_free_block(zone_of_page(target), target, 0);
+            break;
+        }
+
+        bitmap_set(target);
+        page_descs[target] = page_descs[p];
+        page_descs[target].zone = (uint8_t)(zone_of_page(target) - zones);
+        page_descs[p] = (page_t){0};
+        held[(p - block) / 64] |= 1ULL << ((p - block) % 64);
+        moved++;
+    }
+
+    if (moved == used) {
+        bitmap_clear_range(block, end);
+        buddy_free_block(bd, block, order);
+        return moved;
+    }
+
+    // Couldn't empty the block - release what was held
+    for (uint64_t p = block; p < end; p++) {
+        if (held[(p - block) / 64] & (1ULL << ((p - block) % 64))) {
+            bitmap_clear(p);
+            buddy_free_block(bd, p, 0);
         }
-        pmm_state.used_pages++;
     }
+    return 0;
 }
 
 /**
- * Mark multiple pages as used
+ * Free blocks of 2^order pages by migrating movable pages out of them
  */
-void pmm_mark_used_range(uint64_t addr, uint64_t count) {
-    for (uint64_t i = 0; i < count; i++) {
-        pmm_mark_used(addr + (i * PAGE_SIZE));
+uint32_t pmm_compact(uint32_t order, pmm_zone_t zone, uint32_t blocks) {
+    if (!pmm_state.initialized || !page_descs_ready || !migrate_page ||
+        zone >= PMM_ZONE_COUNT || blocks == 0) {
+        return 0;
+    }
+
+    if (order > PMM_MAX_ORDER) {
+        order = PMM_MAX_ORDER;
+    }
+
+    // Cached frames look allocated but aren't movable - give them back first
+    pmm_pcp_drain();
+    zero_pool_drain();
+
+    uint32_t before = pmm_fragmentation(order);
+    uint64_t size = 1ULL << order;
+    uint64_t migrated = 0;
+    uint32_t freed = 0;
+
+    for (int z = zone; z >= 0 && freed < blocks; z--) {
+        buddy_t *bd = &zones[z];
+        if (bd->num_pages < size) {
+            continue;
+        }
+
+        // Scan from the top of the zone: migration targets come from the bottom
+        uint64_t block = bd->base_page + (bd->num_pages / size - 1) * size;
+        while (freed < blocks) {
+            uint64_t flags = spin_lock_irqsave(&pmm_lock);
+            uint64_t moved = compact_block(bd, block, order);
+            spin_unlock_irqrestore(&pmm_lock, flags);
+
+            if (moved > 0) {
+                migrated += moved;
+                freed++;
+            }
+            if (block == bd->base_page) {
+                break;
+            }
+            block -= size;
+        }
+    }
+
+    compaction.runs++;
+    compaction.pages_migrated += migrated;
+    compaction.blocks_freed += freed;
+
+    if (migrated > 0) {
+        console_print("[PMM] Compaction (order ");
+        console_print_dec(order);
+        console_print("): migrated ");
+        console_print_dec(migrated);
+        console_print(" pages, fragmentation ");
+        console_print_dec(before);
+        console_print("% -> ");
+        console_print_dec(pmm_fragmentation(order));
+        console_print("%\n");
     }
+
+    return freed;
 }
 
 /**
- * Check if a physical page is allocated
+ * Compact one max-order block if free memory is badly fragmented
  */
-bool pmm_is_allocated(uint64_t addr) {
-    if (!pmm_state.initialized) {
-        return true;
+bool pmm_compact_background(void) {
+    if (compaction.defer > 0) {
+        compaction.defer--;
+        return false;
     }
 
-    uint64_t page = ADDR_TO_PAGE(addr);
-    if (page >= pmm_state.highest_page) {
-        return true;
+    // Only worth it when plenty of memory is free but little of it is
+    // in max-order blocks
+    if (pmm_state.free_pages < (2ULL << PMM_MAX_ORDER) ||
+        pmm_fragmentation(PMM_MAX_ORDER) < PMM_COMPACT_FRAG_THRESHOLD) {
+        return false;
     }
 
-    return bitmap_test(page);
+    if (pmm_compact(PMM_MAX_ORDER, PMM_ZONE_NORMAL, 1) == 0) {
+        compaction.defer = PMM_COMPACT_DEFER;
+        return false;
+    }
+    return true;
 }
 
 /**
@@ -384,12 +2120,15 @@ void pmm_get_stats(pmm_stats_t *stats) {
         return;
     }
 
+    // Frames sitting in per-CPU caches or the zero pool count as free
+    uint64_t cached = pcp_cached_pages() + zero_pool.count;
+
     stats->total_pages = pmm_state.total_pages;
-    stats->free_pages = pmm_state.free_pages;
-    stats->used_pages = pmm_state.used_pages;
+    stats->free_pages = pmm_state.free_pages + cached;
+    stats->used_pages = pmm_state.used_pages - cached;
     stats->reserved_pages = pmm_state.total_pages - pmm_state.free_pages - pmm_state.used_pages;
     stats->total_memory = pmm_state.total_pages * PAGE_SIZE;
-    stats->free_memory = pmm_state.free_pages * PAGE_SIZE;
+    stats->free_memory = stats->free_pages * PAGE_SIZE;
 }
 
 /**
@@ -403,13 +2142,23 @@ uint64_t pmm_get_total_memory(void) {
  * Get free physical memory
  */
 uint64_t pmm_get_free_memory(void) {
-    return pmm_state.free_pages * PAGE_SIZE;
+    return (pmm_state.free_pages + pcp_cached_pages() + zero_pool.count) * PAGE_SIZE;
+}
+
+/**
+ * Get the end of the highest tracked page
+ */
+uint64_t pmm_get_highest_address(void) {
+    return PAGE_TO_ADDR(pmm_state.highest_page);
 }
 
 /**
  * Print PMM statistics
  */
 void pmm_print_stats(void) {
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+
     console_print("[PMM] Memory Statistics:\n");
     console_print("  Total Pages: ");
     console_print_dec(pmm_state.total_pages);
@@ -418,14 +2167,84 @@ void pmm_print_stats(void) {
     console_print(" MB)\n");
 
     console_print("  Free Pages:  ");
-    console_print_dec(pmm_state.free_pages);
+    console_print_dec(stats.free_pages);
     console_print(" (");
-    console_print_dec(pmm_state.free_pages * PAGE_SIZE / 1024 / 1024);
+    console_print_dec(stats.free_pages * PAGE_SIZE / 1024 / 1024);
     console_print(" MB)\n");
 
     console_print("  Used Pages:  ");
-    console_print_dec(pmm_state.used_pages);
+    console_print_dec(stats.used_pages);
     console_print(" (");
-    console_print_dec(pmm_state.used_pages * PAGE_SIZE / 1024 / 1024);
+    console_print_dec(stats.used_pages * PAGE_SIZE / 1024 / 1024);
     console_print(" MB)\n");
+
+    console_print("  Cached:      ");
+    console_print_dec(pcp_cached_pages());
+    console_print(" (per-CPU, low ");
+    console_print_dec(pcp_watermarks.low);
+    console_print(" high ");
+    console_print_dec(pcp_watermarks.high);
+    console_print(")\n");
+
+    console_print("  Huge Pool:   2MB ");
+    console_print_dec(huge_pools[0].count);
+    console_print("/");
+    console_print_dec(huge_pools[0].target);
+    console_print(", 1GB ");
+    console_print_dec(huge_pools[1].count);
+    console_print("/");
+    console_print_dec(huge_pools[1].target);
+    console_print("\n");
+
+    console_print("  Compaction:  ");
+    console_print_dec(compaction.runs);
+    console_print(" runs, ");
+    console_print_dec(compaction.pages_migrated);
+    console_print(" pages migrated, ");
+    console_print_dec(compaction.blocks_freed);
+    console_print(" blocks freed, fragmentation ");
+    console_print_dec(pmm_fragmentation(PMM_MAX_ORDER));
+    console_print("% (order ");
+    console_print_dec(PMM_MAX_ORDER);
+    console_print(")\n");
+
+    console_print("  Shrinkers:   ");
+    console_print_dec(shrink_state.passes);
+    console_print(" passes, ");
+    console_print_dec(shrink_state.reclaimed);
+    console_print(" pages reclaimed");
+    for (pmm_shrinker_t *shrinker = shrinkers; shrinker; shrinker = shrinker->next) {
+        console_print(", ");
+        console_print(shrinker->name);
+        console_print(" ");
+        console_print_dec(shrinker->reclaimed);
+    }
+    console_print("\n");
+
+    console_print("  Zeroed:      ");
+    console_print_dec(zero_pool.count);
+    console_print(" (hits ");
+    console_print_dec(zero_pool.hits);
+    console_print(" misses ");
+    console_print_dec(zero_pool.misses);
+    console_print(")\n");
+
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        buddy_t *bd = &zones[zone];
+        if (bd->num_pages == 0) {
+            continue;
+        }
+
+        console_print("  Zone ");
+        console_print(zone_names[zone]);
+        console_print(": ");
+        console_print_dec(zone_free_pages(bd));
+        console_print(" of ");
+        console_print_dec(bd->num_pages);
+        console_print(" pages free, blocks ");
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            console_print_dec(bd->free_blocks[order]);
+            console_print(order < PMM_MAX_ORDER ? " " : "\n");
+        }
+    }
 }
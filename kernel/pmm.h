@@ -2,6 +2,7 @@
  * AuroraOS Kernel - Physical Memory Manager (PMM)
  *
  * Manages physical memory pages using a bitmap allocator
+ * backed by a binary buddy allocator
  */
 
 #ifndef _KERNEL_PMM_H_
@@ -26,6 +27,116 @@
 // Get address from page frame number
 #define PAGE_TO_ADDR(page) ((page) << PAGE_SHIFT)
 
+// entry.S identity-maps physical memory below this with 2MB pages
+#define PMM_IDENTITY_LIMIT 0x40000000ULL  // 1GB
+
+// Largest buddy block: 2^PMM_MAX_ORDER pages (order 10 = 4MB)
+#define PMM_MAX_ORDER 10
+
+// Per-CPU page frame cache (frames)
+#define PMM_PCP_CAPACITY 64   // Hard limit per CPU
+#define PMM_PCP_HIGH     48   // Drain back to low above this
+#define PMM_PCP_LOW      16   // Refill up to this when empty
+
+// Pre-zeroed frame pool (frames)
+#define PMM_ZERO_POOL_SIZE    64    // Zeroed frames kept ready
+#define PMM_ZERO_POOL_BATCH   8     // Frames zeroed per idle pass
+#define PMM_ZERO_POOL_RESERVE 1024  // Don't pre-zero below this many free frames
+
+// Huge frames
+#define PMM_HUGE_ORDER_2MB 9    // 512 pages
+#define PMM_HUGE_ORDER_1GB 18   // 262144 pages
+#define PMM_HUGE_POOL_MAX  64   // Pool capacity per size
+#define PMM_HUGE_POOL_2MB  4    // 2MB frames reserved at boot
+#define PMM_HUGE_POOL_1GB  0    // 1GB frames reserved at boot
+
+// Physical memory zones
+// A request for a zone may be served from any lower zone, never a higher one
+typedef enum {
+    PMM_ZONE_DMA = 0,          // Below 16MB (ISA DMA)
+    PMM_ZONE_DMA32,            // Below 4GB (32-bit DMA)
+    PMM_ZONE_NORMAL,           // Everything else
+    PMM_ZONE_COUNT
+} pmm_zone_t;
+
+#define PMM_ZONE_DMA_LIMIT   0x1000000ULL    // 16MB
+#define PMM_ZONE_DMA32_LIMIT 0x100000000ULL  // 4GB
+
+// Page descriptor flags
+#define PAGE_FLAG_RESERVED (1U << 0)  // Firmware, kernel or boot allocation
+#define PAGE_FLAG_LRU      (1U << 1)  // Linked on an LRU list
+#define PAGE_FLAG_PCP      (1U << 2)  // Free, held in a per-CPU frame cache
+#define PAGE_FLAG_HUGE     (1U << 3)  // Head of a pmm_alloc_huge() frame
+#define PAGE_FLAG_MOVABLE  (1U << 4)  // Single mapping at private, can be migrated
+
+// Page descriptor owners
+typedef enum {
+    PAGE_OWNER_NONE = 0,       // Free or not claimed by a subsystem
+    PAGE_OWNER_KERNEL,         // Reserved at boot (kernel image, firmware)
+    PAGE_OWNER_PAGE_TABLE,     // Paging structure
+    PAGE_OWNER_HEAP,           // Backs the kernel heap
+    PAGE_OWNER_USER,           // Mapped into user space
+    PAGE_OWNER_SLAB,           // Backs a slab cache, private = slab
+    PAGE_OWNER_VMALLOC,        // Backs a vmalloc() area
+} page_owner_t;
+
+// LRU links are frame numbers; frame 0 is always reserved, so 0 means unlinked
+#define PAGE_LRU_NONE 0
+
+// Physical page descriptor, one per tracked frame
+// 32 bytes so two descriptors share a cache line
+typedef struct page {
+    uint32_t flags;            // PAGE_FLAG_*
+    int32_t refcount;          // References held (0 = free)
+    int32_t mapcount;          // Page table entries mapping this frame
+    uint8_t order;             // Block order when allocated with pmm_alloc_order()
+    uint8_t zone;              // pmm_zone_t
+    uint16_t owner;            // page_owner_t
+    uint64_t private;          // Owner-specific data
+    uint32_t lru_next;         // Next frame on an LRU list
+    uint32_t lru_prev;         // Previous frame on an LRU list
+} page_t;
+
+_Static_assert(sizeof(page_t) == 32, "page_t must stay 32 bytes");
+
+// Compaction
+#define PMM_COMPACT_FRAG_THRESHOLD 50  // Background compaction above this (percent)
+
+/**
+ * Move a movable page to a new frame
+ * Copies the contents and repoints the mapping recorded in page->private.
+ * Called with the PMM lock held and interrupts disabled, so it must not
+ * allocate or free physical memory.
+ *
+ * @return true if the page now lives at new_addr
+ */
+typedef bool (*pmm_migrate_fn)(page_t *page, uint64_t old_addr, uint64_t new_addr);
+
+// Shrinkers
+#define PMM_SHRINK_WATERMARK 256  // Shrink caches when fewer frames than this are free
+#define PMM_SHRINK_BATCH     64   // Frames to reclaim before retrying a failed allocation
+
+// Shrinker priorities (lower is asked first)
+#define PMM_SHRINKER_PRIORITY_HIGH   0   // Memory that is cheap to get back (empty slabs)
+#define PMM_SHRINKER_PRIORITY_NORMAL 10
+#define PMM_SHRINKER_PRIORITY_LOW    20  // Memory that is expensive to rebuild (huge pools)
+
+/**
+ * Cache that gives frames back when memory runs low
+ * count() reports how many frames scan() could free right now; scan()
+ * frees up to target frames and returns how many it freed. Both run on
+ * allocation paths, so they must not wait on a lock their cache may hold
+ * while allocating.
+ */
+typedef struct pmm_shrinker {
+    const char *name;
+    uint64_t (*count)(void);
+    uint64_t (*scan)(uint64_t target);
+    uint32_t priority;                 // PMM_SHRINKER_PRIORITY_*
+    uint64_t reclaimed;                // Frames freed so far
+    struct pmm_shrinker *next;         // Registered shrinkers, by priority
+} pmm_shrinker_t;
+
 // Memory region types (from UEFI/E820)
 #define MEMORY_TYPE_AVAILABLE       1  // EfiConventionalMemory
 #define MEMORY_TYPE_RESERVED        2  // EfiReservedMemoryType
@@ -55,11 +166,39 @@ void pmm_init(boot_info_t *boot_info);
 
 /**
  * Allocate a single physical page frame
+ * Prefers the highest zone, keeping DMA-capable memory for drivers
  *
  * @return Physical address of allocated page, or 0 if out of memory
  */
 uint64_t pmm_alloc_frame(void);
 
+/**
+ * Allocate a single physical page frame from zone or a lower zone
+ *
+ * @param zone Highest acceptable zone
+ * @return Physical address of allocated page, or 0 if out of memory
+ */
+uint64_t pmm_alloc_frame_zone(pmm_zone_t zone);
+
+/**
+ * Allocate a zero-filled physical page frame
+ *
+ * Served from the pre-zeroed pool when possible, otherwise the frame
+ * is cleared on the spot
+ *
+ * @return Physical address of zeroed frame, or 0 if out of memory
+ */
+uint64_t pmm_alloc_zeroed_frame(void);
+
+/**
+ * Zero up to max frames ahead of time for pmm_alloc_zeroed_frame()
+ * Meant to be called when the CPU has nothing better to do
+ *
+ * @param max Maximum frames to zero
+ * @return Number of frames added to the pool (0 when full)
+ */
+uint32_t pmm_zero_pool_refill(uint32_t max);
+
 /**
  * Allocate multiple contiguous physical page frames
  *
@@ -68,6 +207,60 @@ uint64_t pmm_alloc_frame(void);
  */
 uint64_t pmm_alloc_frames(uint64_t count);
 
+/**
+ * Allocate multiple contiguous physical page frames from zone or a lower zone
+ *
+ * @param count Number of pages to allocate
+ * @param zone Highest acceptable zone
+ * @return Physical address of first page, or 0 if not enough contiguous memory
+ */
+uint64_t pmm_alloc_frames_zone(uint64_t count, pmm_zone_t zone);
+
+/**
+ * Allocate a naturally aligned block of 2^order page frames
+ * (order 9 = 2MB aligned)
+ *
+ * @param order Block order (0 to PMM_MAX_ORDER)
+ * @return Physical address of block, or 0 if no block is available
+ */
+uint64_t pmm_alloc_order(uint32_t order);
+
+/**
+ * Free a block allocated with pmm_alloc_order()
+ *
+ * @param addr Physical address of block
+ * @param order Block order used for allocation
+ */
+void pmm_free_order(uint64_t addr, uint32_t order);
+
+/**
+ * Allocate a huge frame, naturally aligned to its size
+ * Served from the reserved pool first, then from the buddy allocator
+ *
+ * @param order PMM_HUGE_ORDER_2MB or PMM_HUGE_ORDER_1GB
+ * @return Physical address of the frame, or 0 if none is available
+ */
+uint64_t pmm_alloc_huge(uint32_t order);
+
+/**
+ * Free a frame allocated with pmm_alloc_huge()
+ * Refills the reserved pool before returning memory to the buddy allocator
+ *
+ * @param addr Physical address of the frame
+ * @param order Order used for allocation
+ */
+void pmm_free_huge(uint64_t addr, uint32_t order);
+
+/**
+ * Resize the reserved pool of huge frames
+ * The pool never grows past 1/8 of free memory
+ *
+ * @param order PMM_HUGE_ORDER_2MB or PMM_HUGE_ORDER_1GB
+ * @param count Number of frames to keep reserved
+ * @return Number of frames actually reserved
+ */
+uint32_t pmm_huge_pool_reserve(uint32_t order, uint32_t count);
+
 /**
  * Free a previously allocated physical page frame
  *
@@ -106,6 +299,21 @@ void pmm_mark_used_range(uint64_t addr, uint64_t count);
  */
 bool pmm_is_allocated(uint64_t addr);
 
+/**
+ * Set per-CPU frame cache watermarks
+ * An empty cache is refilled with low frames in one batch; a cache that
+ * grows past high is drained back down to low in one batch.
+ *
+ * @param low Refill target (must be below high)
+ * @param high Drain threshold (below PMM_PCP_CAPACITY)
+ */
+void pmm_pcp_set_watermarks(uint32_t low, uint32_t high);
+
+/**
+ * Return all frames cached by the current CPU to the global allocator
+ */
+void pmm_pcp_drain(void);
+
 /**
  * Get PMM statistics
  *
@@ -127,6 +335,110 @@ uint64_t pmm_get_total_memory(void);
  */
 uint64_t pmm_get_free_memory(void);
 
+/**
+ * Get the end of the highest physical page tracked by the PMM
+ *
+ * @return Physical address one past the last tracked page
+ */
+uint64_t pmm_get_highest_address(void);
+
+/**
+ * Set up page descriptors placed above the boot identity map
+ * Called by vmm_init() once all RAM is mapped; does nothing if the
+ * descriptors were already set up by pmm_init()
+ */
+void pmm_init_page_descriptors(void);
+
+/**
+ * Get the descriptor of a physical page
+ *
+ * @param addr Physical address (any address within the page)
+ * @return Page descriptor, or NULL if the page is not tracked
+ */
+page_t* pmm_page(uint64_t addr);
+
+/**
+ * Get the physical address described by a page descriptor
+ *
+ * @param page Page descriptor
+ * @return Physical address of the page
+ */
+uint64_t pmm_page_addr(page_t *page);
+
+/**
+ * Take an additional reference on a page
+ *
+ * @param page Page descriptor
+ */
+void pmm_page_get(page_t *page);
+
+/**
+ * Drop a reference on a page, freeing it (or its pmm_alloc_order()
+ * block) when the last reference goes away
+ *
+ * @param page Page descriptor
+ * @return Remaining references
+ */
+int32_t pmm_page_put(page_t *page);
+
+/**
+ * Register the callback used to migrate movable pages during compaction
+ *
+ * @param fn Migration callback (provided by the VMM)
+ */
+void pmm_register_migrate(pmm_migrate_fn fn);
+
+/**
+ * Free blocks of 2^order pages by migrating movable pages out of them
+ *
+ * @param order Block order to create (capped at PMM_MAX_ORDER)
+ * @param zone Highest zone to compact; lower zones are tried after it
+ * @param blocks Number of free blocks wanted
+ * @return Number of blocks freed
+ */
+uint32_t pmm_compact(uint32_t order, pmm_zone_t zone, uint32_t blocks);
+
+/**
+ * Compact one max-order block if free memory is badly fragmented
+ * Meant to be called when the CPU has nothing better to do
+ *
+ * @return true if any page was migrated
+ */
+bool pmm_compact_background(void);
+
+/**
+ * Get the fragmentation of free memory for an allocation order
+ *
+ * @param order Allocation order
+ * @return Percentage of free pages that are not in blocks of at least 2^order pages
+ */
+uint32_t pmm_fragmentation(uint32_t order);
+
+/**
+ * Register a cache shrinker
+ * Shrinkers run by priority, in registration order within a priority
+ *
+ * @param shrinker Shrinker owned by the caller, kept until unregistered
+ */
+void pmm_register_shrinker(pmm_shrinker_t *shrinker);
+
+/**
+ * Unregister a cache shrinker
+ *
+ * @param shrinker Previously registered shrinker
+ */
+void pmm_unregister_shrinker(pmm_shrinker_t *shrinker);
+
+/**
+ * Ask registered shrinkers for frames, in priority order
+ * Called by the allocator when free frames drop below
+ * PMM_SHRINK_WATERMARK or an allocation fails
+ *
+ * @param target Number of frames wanted
+ * @return Number of frames freed
+ */
+uint64_t pmm_shrink(uint64_t target);
+
 /**
  * Print PMM status to console (for debugging)
  */
@@ -6,8 +6,11 @@
 
 #include "process.h"
 #include "kheap.h"
+#include "slab.h"
 #include "console.h"
 #include "vmm.h"
+#include "pmm.h"
+#include "vma.h"
 #include "types.h"
 #include "scheduler.h"
 
@@ -22,6 +25,13 @@ static thread_t *current_thread = NULL;
 // Kernel idle process
 static process_t *idle_process = NULL;
 
+// Object caches for control blocks and kernel stacks
+#define THREAD_STACK_SIZE 8192
+
+static kmem_cache_t *process_cache = NULL;
+static kmem_cache_t *thread_cache = NULL;
+static kmem_cache_t *stack_cache = NULL;
+
 /**
  * Get current running thread
  */
@@ -29,6 +39,14 @@ thread_t* thread_get_current(void) {
     return current_thread;
 }
 
+/**
+ * Get the top of a thread's kernel stack
+ * Entries from user mode (system calls, interrupts) start here
+ */
+uint64_t thread_kernel_stack_top(thread_t *thread) {
+    return (uint64_t)thread->stack_base + thread->stack_size;
+}
+
 /**
  * Get current running process
  */
@@ -76,7 +94,7 @@ void thread_set_state(thread_t *thread, task_state_t state) {
  */
 process_t* process_create(const char *name, void (*entry_point)(void)) {
     // Allocate process control block
-    process_t *proc = (process_t*)kmalloc(sizeof(process_t));
+    process_t *proc = (process_t*)kmem_cache_alloc(process_cache);
     if (!proc) {
         console_print("[PROC] ERROR: Failed to allocate process\n");
         return NULL;
@@ -92,8 +110,15 @@ process_t* process_create(const char *name, void (*entry_point)(void)) {
     }
     proc->name[i] = '\0';
 
-    // Memory management (use kernel page directory for now)
-    proc->page_directory = vmm_get_cr3();
+    // Memory management: a private user half, sharing the kernel's
+    proc->page_directory = vmm_create_address_space();
+    if (!proc->page_directory) {
+        console_print("[PROC] ERROR: Failed to create address space\n");
+        kmem_cache_free(process_cache, proc);
+        return NULL;
+    }
+    proc->vmas = NULL;
+    proc->vma_lock = (spinlock_t)SPINLOCK_INIT;
     proc->heap_start = NULL;
     proc->heap_end = NULL;
 
@@ -121,7 +146,12 @@ process_t* process_create(const char *name, void (*entry_point)(void)) {
         proc->main_thread = thread_create(proc, entry_point, 128);
         if (!proc->main_thread) {
             console_print("[PROC] ERROR: Failed to create main thread\n");
-            kfree(proc);
+            process_list_head = proc->next;
+            if (process_list_head) {
+                process_list_head->prev = NULL;
+            }
+            vmm_destroy_address_space(proc->page_directory);
+            kmem_cache_free(process_cache, proc);
             return NULL;
         }
     }
@@ -129,6 +159,63 @@ process_t* process_create(const char *name, void (*entry_point)(void)) {
     return proc;
 }
 
+/**
+ * Fork a process
+ * The child gets the parent's regions and a copy-on-write copy of its
+ * user address space, and a single thread that starts at resume with
+ * interrupts disabled
+ *
+ * @param resume Kernel code that returns the child to where the parent was
+ * @param frame Registers the parent saved on entry to the kernel, copied
+ *              to the top of the child's kernel stack for resume to restore
+ * @param frame_size Size of frame in bytes
+ * @return The child, or NULL on failure
+ */
+process_t* process_fork(process_t *parent, void (*resume)(void),
+                        const void *frame, uint64_t frame_size) {
+    if (!parent || !frame) {
+        return NULL;
+    }
+
+    process_t *child = process_create(parent->name, NULL);
+    if (!child) {
+        return NULL;
+    }
+
+    child->heap_start = parent->heap_start;
+    child->heap_end = parent->heap_end;
+
+    if (!vma_fork(parent, child)) {
+        console_print("[PROC] ERROR: Failed to copy address space\n");
+        process_destroy(child);
+        return NULL;
+    }
+
+    uint32_t priority = parent->main_thread ? parent->main_thread->priority : 128;
+    thread_t *thread = thread_create(child, resume, priority);
+    child->main_thread = thread;
+    if (!thread) {
+        console_print("[PROC] ERROR: Failed to create main thread\n");
+        process_destroy(child);
+        return NULL;
+    }
+
+    // The frame sits where the child's own entry from user mode would
+    // have left it, so resume unwinds it like a normal return
+    uint64_t stack = thread_kernel_stack_top(thread) - frame_size;
+    for (uint64_t i = 0; i < frame_size; i++) {
+        ((uint8_t*)stack)[i] = ((const uint8_t*)frame)[i];
+    }
+
+    // Forks come from system calls, which run with interrupts off, so the
+    // thread can't be scheduled before its context is finished
+    thread->context.rsp = stack;
+    thread->context.rbp = stack;
+    thread->context.rflags = 0x002;
+
+    return child;
+}
+
 /**
  * Create a new thread
  */
@@ -138,7 +225,7 @@ thread_t* thread_create(process_t *proc, void (*entry_point)(void), uint32_t pri
     }
 
     // Allocate thread control block
-    thread_t *thread = (thread_t*)kmalloc(sizeof(thread_t));
+    thread_t *thread = (thread_t*)kmem_cache_alloc(thread_cache);
     if (!thread) {
         console_print("[PROC] ERROR: Failed to allocate thread\n");
         return NULL;
@@ -149,13 +236,13 @@ thread_t* thread_create(process_t *proc, void (*entry_point)(void), uint32_t pri
     thread->state = TASK_STATE_NEW;
     thread->process = proc;
 
-    // Allocate kernel stack (8KB)
-    uint64_t stack_size = 8192;
+    // Allocate kernel stack
+    uint64_t stack_size = THREAD_STACK_SIZE;
     thread->stack_size = stack_size;
-    thread->stack_base = kmalloc(stack_size);
+    thread->stack_base = kmem_cache_alloc(stack_cache);
     if (!thread->stack_base) {
         console_print("[PROC] ERROR: Failed to allocate thread stack\n");
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
 
@@ -227,11 +314,11 @@ void thread_destroy(thread_t *thread) {
 
     // Free stack
     if (thread->stack_base) {
-        kfree(thread->stack_base);
+        kmem_cache_free(stack_cache, thread->stack_base);
     }
 
     // Free TCB
-    kfree(thread);
+    kmem_cache_free(thread_cache, thread);
 }
 
 /**
@@ -257,8 +344,13 @@ void process_destroy(process_t *proc) {
         proc->next->prev = proc->prev;
     }
 
+    // Free the regions, then the address space and the user frames
+    // faulted into them
+    vma_unmap_all(proc);
+    vmm_destroy_address_space(proc->page_directory);
+
     // Free PCB
-    kfree(proc);
+    kmem_cache_free(process_cache, proc);
 }
 
 /**
@@ -416,7 +508,12 @@ void process_print_list(void) {
  */
 static void idle_task(void) {
     while (1) {
-        __asm__ __volatile__("hlt");  // Wait for interrupt
+        // Spend idle time pre-zeroing frames for pmm_alloc_zeroed_frame()
+        // and compacting fragmented memory, and only halt once there is
+        // nothing left to do
+        if (pmm_zero_pool_refill(PMM_ZERO_POOL_BATCH) == 0 && !pmm_compact_background()) {
+            __asm__ __volatile__("hlt");  // Wait for interrupt
+        }
     }
 }
 
@@ -432,6 +529,17 @@ void process_init(void) {
     next_pid = 1;
     next_tid = 1;
 
+    // Create object caches
+    if (!process_cache) {
+        process_cache = kmem_cache_create("process_t", sizeof(process_t), 0, NULL);
+        thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 0, NULL);
+        stack_cache = kmem_cache_create("thread_stack", THREAD_STACK_SIZE, 16, NULL);
+    }
+    if (!process_cache || !thread_cache || !stack_cache) {
+        console_print("[PROC] ERROR: Failed to create object caches\n");
+        return;
+    }
+
     // Create idle process (PID 0)
     idle_process = process_create("idle", idle_task);
     if (!idle_process) {
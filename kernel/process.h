@@ -8,6 +8,9 @@
 #define _KERNEL_PROCESS_H_
 
 #include "types.h"
+#include "spinlock.h"
+
+struct vma;
 
 // Process/Thread IDs
 typedef uint32_t pid_t;
@@ -73,7 +76,9 @@ typedef struct process {
     char name[64];                  // Process name
 
     // Memory management
-    uint64_t page_directory;        // CR3 value (page table root)
+    uint64_t page_directory;        // CR3 value (PML4 | address space ID)
+    struct vma *vmas;               // User memory regions (red-black tree by address)
+    spinlock_t vma_lock;            // Protects vmas and faults on them
     void *heap_start;               // Heap start address
     void *heap_end;                 // Heap end address
 
@@ -99,6 +104,8 @@ void process_init(void);
 
 // Process creation and termination
 process_t* process_create(const char *name, void (*entry_point)(void));
+process_t* process_fork(process_t *parent, void (*resume)(void),
+                        const void *frame, uint64_t frame_size);
 void process_destroy(process_t *proc);
 void process_exit(int exit_code);
 
@@ -110,6 +117,7 @@ void thread_exit(void);
 // Process/Thread queries
 process_t* process_get_current(void);
 thread_t* thread_get_current(void);
+uint64_t thread_kernel_stack_top(thread_t *thread);
 process_t* process_find_by_pid(pid_t pid);
 thread_t* thread_find_by_tid(tid_t tid);
 
@@ -8,6 +8,8 @@
 #include "process.h"
 #include "console.h"
 #include "timer.h"
+#include "vmm.h"
+#include "tss.h"
 #include "types.h"
 
 // Scheduler state
@@ -122,6 +124,16 @@ static void scheduler_switch_to(thread_t *next) {
     // Increment switch counter
     sched_state.stats.total_switches++;
 
+    // Threads of the same process share an address space; PCIDs keep
+    // the TLB warm across switches between processes. Compare against
+    // what is loaded, not the previous thread, which may not exist
+    if (next->process->page_directory != vmm_current_address_space()) {
+        vmm_switch_address_space(next->process->page_directory);
+    }
+
+    // Entries from user mode land on the thread's own kernel stack
+    tss_set_kernel_stack(thread_kernel_stack_top(next));
+
     // Perform actual context switch (if there was a previous thread)
     if (current && current != next) {
         switch_context(&current->context, &next->context);
@@ -0,0 +1,502 @@
+/**
+ * AuroraOS Kernel - Slab Allocator Implementation
+ *
+ * Every cache keeps its slabs on full, partial and empty lists, so
+ * allocation and free are O(1). Free objects are chained through a link
+ * word stored inside the object. Slabs are identity-mapped PMM blocks
+ * and each of their page descriptors points back at the slab.
+ */
+
+#include "slab.h"
+#include "pmm.h"
+#include "console.h"
+#include "types.h"
+
+// Slab descriptor
+typedef struct slab {
+    struct slab *next;              // Next slab on the same list
+    struct slab *prev;              // Previous slab on the same list
+    kmem_cache_t *cache;            // Owning cache
+    uint64_t mem;                   // Start of the slab's pages
+    void *free;                     // First free object
+    uint32_t inuse;                 // Allocated objects
+    uint32_t colour;                // Offset of the first object
+} slab_t;
+
+// Bootstrap caches
+static kmem_cache_t cache_cache;    // kmem_cache_t objects
+static kmem_cache_t slab_cache;     // Off-slab headers
+
+static kmem_cache_t *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+static bool slab_ready = false;
+
+// Helper macros
+#define ALIGN_UP(addr, align)   (((addr) + (align) - 1) & ~((align) - 1))
+
+/**
+ * Get free list link of a free object
+ */
+static inline void** object_link(kmem_cache_t *cache, void *obj) {
+    return (void**)((uint8_t*)obj + cache->free_offset);
+}
+
+/**
+ * Get the list a slab belongs on for its fill level
+ */
+static inline slab_t** slab_list_for(kmem_cache_t *cache, slab_t *slab) {
+    if (slab->inuse == 0) {
+        return &cache->empty;
+    }
+    if (slab->inuse == cache->objects_per_slab) {
+        return &cache->full;
+    }
+    return &cache->partial;
+}
+
+/**
+ * Add slab to front of a list
+ */
+static inline void slab_list_add(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/**
+ * Remove slab from a list
+ */
+static inline void slab_list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * Compute the layout of a cache
+ *
+ * @return false if the object can't fit a slab
+ */
+static bool cache_setup(kmem_cache_t *cache, const char *name, uint64_t size,
+                        uint64_t align, kmem_ctor_t ctor) {
+    if (size == 0 || align > PAGE_SIZE || (align & (align - 1)) != 0) {
+        return false;
+    }
+    if (align < SLAB_MIN_ALIGN) {
+        align = SLAB_MIN_ALIGN;
+    }
+
+    // Constructed objects must keep their contents while free, so the
+    // free list link goes after the object instead of over it
+    uint64_t slot;
+    if (ctor) {
+        cache->free_offset = (uint32_t)ALIGN_UP(size, sizeof(void*));
+        slot = cache->free_offset + sizeof(void*);
+    } else {
+        cache->free_offset = 0;
+        slot = size < sizeof(void*) ? sizeof(void*) : size;
+    }
+    slot = ALIGN_UP(slot, align);
+
+    cache->flags = slot >= SLAB_OFF_SLAB_MIN ? SLAB_FLAG_OFF_SLAB : 0;
+    uint64_t header = (cache->flags & SLAB_FLAG_OFF_SLAB) ? 0 : ALIGN_UP(sizeof(slab_t), align);
+
+    // Smallest slab that holds enough objects
+    uint32_t order = 0;
+    uint64_t bytes, objects;
+    for (;;) {
+        bytes = PAGE_SIZE << order;
+        objects = bytes > header ? (bytes - header) / slot : 0;
+        if (objects >= SLAB_MIN_OBJECTS || order == SLAB_MAX_ORDER) {
+            break;
+        }
+        order++;
+    }
+    if (objects == 0) {
+        return false;
+    }
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->slot_size = slot;
+    cache->align = align;
+    cache->order = order;
+    cache->objects_per_slab = (uint32_t)objects;
+    cache->ctor = ctor;
+
+    // Spread the leftover space over first-object offsets so objects of
+    // different slabs don't all compete for the same cache sets
+    cache->colour_step = align > SLAB_CACHE_LINE ? align : SLAB_CACHE_LINE;
+    cache->colour_count = (uint32_t)((bytes - header - objects * slot) / cache->colour_step) + 1;
+    cache->colour_next = 0;
+
+    cache->full = NULL;
+    cache->partial = NULL;
+    cache->empty = NULL;
+    cache->num_slabs = 0;
+    cache->active_objects = 0;
+    cache->num_allocations = 0;
+    cache->num_frees = 0;
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    cache->next = NULL;
+    return true;
+}
+
+/**
+ * Add cache to the global list
+ */
+static void cache_register(kmem_cache_t *cache) {
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+/**
+ * Allocate and construct a new slab
+ * Called without the cache lock held
+ */
+static slab_t* slab_grow(kmem_cache_t *cache) {
+    uint64_t mem = pmm_alloc_order(cache->order);
+    if (mem == 0) {
+        return NULL;
+    }
+
+    slab_t *slab;
+    uint64_t base;
+    if (cache->flags & SLAB_FLAG_OFF_SLAB) {
+        slab = (slab_t*)kmem_cache_alloc(&slab_cache);
+        if (!slab) {
+            pmm_free_order(mem, cache->order);
+            return NULL;
+        }
+        base = mem;
+    } else {
+        slab = (slab_t*)mem;
+        base = mem + ALIGN_UP(sizeof(slab_t), cache->align);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    slab->colour = (uint32_t)(cache->colour_next * cache->colour_step);
+    cache->colour_next = (cache->colour_next + 1) % cache->colour_count;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    slab->cache = cache;
+    slab->mem = mem;
+    slab->inuse = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Construct objects and chain them in address order
+    base += slab->colour;
+    slab->free = NULL;
+    for (uint32_t i = cache->objects_per_slab; i > 0; i--) {
+        void *obj = (void*)(base + (uint64_t)(i - 1) * cache->slot_size);
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *object_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    // Let kmem_cache_free() find the slab from any object address
+    for (uint64_t i = 0; i < (1ULL << cache->order); i++) {
+        page_t *page = pmm_page(mem + i * PAGE_SIZE);
+        if (page) {
+            page->owner = PAGE_OWNER_SLAB;
+            page->private = (uint64_t)slab;
+        }
+    }
+
+    return slab;
+}
+
+/**
+ * Return an empty slab to the PMM
+ * Called without the cache lock held
+ */
+static void slab_release(kmem_cache_t *cache, slab_t *slab) {
+    uint64_t mem = slab->mem;
+
+    if (cache->flags & SLAB_FLAG_OFF_SLAB) {
+        kmem_cache_free(&slab_cache, slab);
+    }
+    pmm_free_order(mem, cache->order);
+}
+
+/**
+ * Create an object cache
+ */
+kmem_cache_t* kmem_cache_create(const char *name, uint64_t size, uint64_t align, kmem_ctor_t ctor) {
+    if (!slab_ready) {
+        console_print("[SLAB] ERROR: Slab allocator not initialized\n");
+        return NULL;
+    }
+
+    kmem_cache_t *cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        return NULL;
+    }
+
+    if (!cache_setup(cache, name, size, align, ctor)) {
+        console_print("[SLAB] ERROR: Invalid object size or alignment for cache ");
+        console_print(name);
+        console_print("\n");
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    cache_register(cache);
+    return cache;
+}
+
+/**
+ * Destroy an object cache
+ * All objects must have been freed
+ */
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (!cache || cache == &cache_cache || cache == &slab_cache) {
+        return;
+    }
+
+    if (cache->active_objects != 0) {
+        console_print("[SLAB] ERROR: Destroying cache ");
+        console_print(cache->name);
+        console_print(" with objects in use\n");
+        return;
+    }
+
+    kmem_cache_shrink(cache);
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    kmem_cache_t **link = &cache_list;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    kmem_cache_free(&cache_cache, cache);
+}
+
+/**
+ * Release all empty slabs of a cache
+ *
+ * @return Number of pages returned to the PMM
+ */
+uint64_t kmem_cache_shrink(kmem_cache_t *cache) {
+    if (!cache) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    slab_t *slab = cache->empty;
+    cache->empty = NULL;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    uint64_t released = 0;
+    while (slab) {
+        slab_t *next = slab->next;
+        slab_release(cache, slab);
+        released++;
+        slab = next;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+    cache->num_slabs -= released;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return released << cache->order;
+}
+
+/**
+ * Allocate an object from a cache
+ */
+void* kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    slab_t *slab = cache->partial ? cache->partial : cache->empty;
+    if (!slab) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+
+        slab = slab_grow(cache);
+        if (!slab) {
+            console_print("[SLAB] ERROR: Out of memory growing cache ");
+            console_print(cache->name);
+            console_print("\n");
+            return NULL;
+        }
+
+        flags = spin_lock_irqsave(&cache->lock);
+        slab_list_add(&cache->empty, slab);
+        cache->num_slabs++;
+
+        // Prefer a partial slab if one appeared meanwhile
+        slab = cache->partial ? cache->partial : cache->empty;
+    }
+
+    slab_list_remove(slab_list_for(cache, slab), slab);
+    void *obj = slab->free;
+    slab->free = *object_link(cache, obj);
+    slab->inuse++;
+    slab_list_add(slab_list_for(cache, slab), slab);
+
+    cache->active_objects++;
+    cache->num_allocations++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+/**
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!cache || !obj) {
+        return;
+    }
+
+    page_t *page = pmm_page((uint64_t)obj);
+    if (!page || page->owner != PAGE_OWNER_SLAB || ((slab_t*)page->private)->cache != cache) {
+        console_print("[SLAB] ERROR: Object ");
+        console_print_hex((uint64_t)obj);
+        console_print(" does not belong to cache ");
+        console_print(cache->name);
+        console_print("\n");
+        return;
+    }
+
+    slab_t *slab = (slab_t*)page->private;
+    slab_t *release = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    slab_list_remove(slab_list_for(cache, slab), slab);
+    *object_link(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    // Keep one empty slab around to absorb alloc/free churn
+    if (slab->inuse == 0 && cache->empty) {
+        release = slab;
+        cache->num_slabs--;
+    } else {
+        slab_list_add(slab_list_for(cache, slab), slab);
+    }
+
+    cache->active_objects--;
+    cache->num_frees++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (release) {
+        slab_release(cache, release);
+    }
+}
+
+/**
+ * Count pages held by empty slabs
+ */
+static uint64_t slab_shrink_count(void) {
+    uint64_t pages = 0;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+        spin_lock(&cache->lock);
+        for (slab_t *slab = cache->empty; slab; slab = slab->next) {
+            pages += 1ULL << cache->order;
+        }
+        spin_unlock(&cache->lock);
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    return pages;
+}
+
+/**
+ * Release empty slabs, cache by cache, until target pages are freed
+ */
+static uint64_t slab_shrink_scan(uint64_t target) {
+    uint64_t freed = 0;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t *cache = cache_list; cache && freed < target; cache = cache->next) {
+        freed += kmem_cache_shrink(cache);
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    return freed;
+}
+
+// Empty slabs are the cheapest memory to give back
+static pmm_shrinker_t slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+    .priority = PMM_SHRINKER_PRIORITY_HIGH,
+};
+
+/**
+ * Initialize slab allocator
+ * Needs page descriptors, so it runs after vmm_init()
+ */
+void slab_init(void) {
+    console_print("[SLAB] Initializing slab allocator...\n");
+
+    if (!pmm_page(0)) {
+        console_print("[SLAB] ERROR: Page descriptors not available\n");
+        return;
+    }
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), SLAB_CACHE_LINE, NULL);
+    cache_setup(&slab_cache, "slab", sizeof(slab_t), 0, NULL);
+    cache_register(&cache_cache);
+    cache_register(&slab_cache);
+
+    slab_ready = true;
+    pmm_register_shrinker(&slab_shrinker);
+    console_print("[SLAB] Slab allocator initialized\n");
+}
+
+/**
+ * Print slab cache statistics
+ */
+void slab_print_stats(void) {
+    console_print("\n[SLAB] Cache Statistics:\n");
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+        console_print("  ");
+        console_print(cache->name);
+        console_print(": ");
+        console_print_dec(cache->object_size);
+        console_print(" bytes, ");
+        console_print_dec(cache->active_objects);
+        console_print("/");
+        console_print_dec(cache->num_slabs * cache->objects_per_slab);
+        console_print(" objects, ");
+        console_print_dec(cache->num_slabs);
+        console_print(" slabs of ");
+        console_print_dec(1ULL << cache->order);
+        console_print(" pages");
+        if (cache->flags & SLAB_FLAG_OFF_SLAB) {
+            console_print(" (off-slab)");
+        }
+        console_print("\n");
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
@@ -0,0 +1,78 @@
+/**
+ * AuroraOS Kernel - Slab Allocator
+ *
+ * Object caches for fixed-size kernel objects (Bonwick-style slabs)
+ * Each cache carves page blocks from the PMM into equal objects
+ */
+
+#ifndef _KERNEL_SLAB_H_
+#define _KERNEL_SLAB_H_
+
+#include "types.h"
+#include "spinlock.h"
+
+// Slab configuration
+#define SLAB_MIN_ALIGN     8             // Objects are at least word aligned
+#define SLAB_CACHE_LINE    64            // Coloring step
+#define SLAB_MAX_ORDER     3             // Largest slab is 8 pages
+#define SLAB_MIN_OBJECTS   8             // Grow slabs until they hold this many
+#define SLAB_OFF_SLAB_MIN  512           // Objects this big keep the slab header elsewhere
+
+// Cache flags
+#define SLAB_FLAG_OFF_SLAB (1U << 0)     // Slab header lives in a separate cache
+
+// Object constructor, run once when a slab is created. Objects must be
+// returned to the cache in their constructed state
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct slab;
+
+// Object cache
+typedef struct kmem_cache {
+    const char *name;
+    uint64_t object_size;           // Size requested by the creator
+    uint64_t slot_size;             // Distance between objects
+    uint64_t align;                 // Object alignment
+    uint32_t free_offset;           // Free list link offset inside a free object
+    uint32_t order;                 // Slab size is 2^order pages
+    uint32_t objects_per_slab;
+    uint32_t flags;                 // SLAB_FLAG_*
+
+    // Coloring
+    uint32_t colour_count;          // Distinct first-object offsets
+    uint32_t colour_next;           // Offset index for the next slab
+    uint64_t colour_step;           // Bytes between offsets
+
+    kmem_ctor_t ctor;
+
+    // Slab lists
+    struct slab *full;
+    struct slab *partial;
+    struct slab *empty;
+
+    // Statistics
+    uint64_t num_slabs;
+    uint64_t active_objects;
+    uint64_t num_allocations;
+    uint64_t num_frees;
+
+    spinlock_t lock;
+    struct kmem_cache *next;        // All caches
+} kmem_cache_t;
+
+// Slab initialization
+void slab_init(void);
+
+// Cache management
+kmem_cache_t* kmem_cache_create(const char *name, uint64_t size, uint64_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(kmem_cache_t *cache);
+uint64_t kmem_cache_shrink(kmem_cache_t *cache);
+
+// Object allocation
+void* kmem_cache_alloc(kmem_cache_t *cache);
+void  kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// Debugging and statistics
+void slab_print_stats(void);
+
+#endif // _KERNEL_SLAB_H_
@@ -0,0 +1,66 @@
+/**
+ * AuroraOS Kernel - Spinlocks
+ *
+ * Simple test-and-set spinlocks for data shared between CPUs
+ */
+
+#ifndef _KERNEL_SPINLOCK_H_
+#define _KERNEL_SPINLOCK_H_
+
+#include "types.h"
+#include "cpu.h"
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+/**
+ * Acquire a spinlock
+ */
+static inline void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        // Wait on a plain read so the cache line is not bounced
+        while (lock->locked) {
+            __asm__ __volatile__("pause");
+        }
+    }
+}
+
+/**
+ * Try to acquire a spinlock without waiting
+ *
+ * @return true if the lock was taken
+ */
+static inline bool spin_trylock(spinlock_t *lock) {
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Release a spinlock
+ */
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Disable interrupts and acquire a spinlock
+ *
+ * @return Saved RFLAGS for spin_unlock_irqrestore()
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * Release a spinlock and restore interrupt state
+ */
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+#endif // _KERNEL_SPINLOCK_H_
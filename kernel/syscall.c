@@ -9,6 +9,8 @@
 #include "process.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "vma.h"
+#include "vmm.h"
 #include "types.h"
 
 // MSR (Model Specific Register) addresses for SYSCALL/SYSRET
@@ -118,6 +120,132 @@ static int64_t sys_getpid(uint64_t arg1, uint64_t arg2, uint64_t arg3,
     return -1;
 }
 
+/**
+ * sys_fork - Create a copy of the calling process
+ * The child shares the parent's memory copy-on-write and returns 0 from
+ * this same system call
+ */
+static int64_t sys_fork(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                        uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+
+    process_t *parent = process_get_current();
+    thread_t *thread = thread_get_current();
+    if (!parent || !thread) {
+        return -EINVAL;
+    }
+
+    // syscall_entry saved the caller's user state at the top of its
+    // kernel stack
+    uint64_t frame = thread_kernel_stack_top(thread) - SYSCALL_FRAME_SIZE;
+    process_t *child = process_fork(parent, syscall_fork_return,
+                                    (const void*)frame, SYSCALL_FRAME_SIZE);
+    if (!child) {
+        return -ENOMEM;
+    }
+    return (int64_t)child->pid;
+}
+
+/**
+ * Convert PROT_* protection to VMA_* access
+ *
+ * @return false if prot has unknown bits
+ */
+static bool prot_to_vma(uint64_t prot, uint32_t *flags) {
+    if (prot & ~(uint64_t)(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        return false;
+    }
+    *flags = ((prot & PROT_READ) ? VMA_READ : 0) |
+             ((prot & PROT_WRITE) ? VMA_WRITE : 0) |
+             ((prot & PROT_EXEC) ? VMA_EXEC : 0);
+    return true;
+}
+
+/**
+ * Check that a range is page-aligned, non-empty and in the user half
+ */
+static bool user_range_valid(uint64_t addr, uint64_t length) {
+    length = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    return length != 0 && !(addr & (PAGE_SIZE - 1)) &&
+           addr >= VMM_USER_START && addr <= VMM_USER_END - length;
+}
+
+/**
+ * sys_mmap - Map anonymous memory
+ * Only private anonymous mappings are supported; pages are zero-filled
+ * on first touch
+ *
+ * @return Start of the mapping
+ */
+static int64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot,
+                        uint64_t flags, uint64_t arg5, uint64_t arg6) {
+    (void)arg5; (void)arg6;
+
+    process_t *proc = process_get_current();
+    uint32_t vma_flags;
+    if (!proc || length == 0 || length > VMM_USER_END - VMM_USER_START ||
+        !prot_to_vma(prot, &vma_flags)) {
+        return -EINVAL;
+    }
+
+    if ((flags & ~(uint64_t)(MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS)) ||
+        !(flags & MAP_PRIVATE) || !(flags & MAP_ANONYMOUS)) {
+        return -EINVAL;
+    }
+
+    if (flags & MAP_FIXED) {
+        if (!user_range_valid(addr, length)) {
+            return -EINVAL;
+        }
+        vma_flags |= VMA_FIXED;
+    }
+
+    uint64_t start = vma_map(proc, addr, length, vma_flags);
+    if (start == 0) {
+        return -ENOMEM;
+    }
+    return (int64_t)start;
+}
+
+/**
+ * sys_munmap - Unmap a range of memory
+ * Parts of the range that are not mapped are ignored
+ */
+static int64_t sys_munmap(uint64_t addr, uint64_t length, uint64_t arg3,
+                          uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+    (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+
+    process_t *proc = process_get_current();
+    if (!proc || !user_range_valid(addr, length)) {
+        return -EINVAL;
+    }
+
+    if (!vma_unmap(proc, addr, length)) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * sys_mprotect - Change the protection of mapped memory
+ * Every page of the range must be mapped
+ */
+static int64_t sys_mprotect(uint64_t addr, uint64_t length, uint64_t prot,
+                            uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+    (void)arg4; (void)arg5; (void)arg6;
+
+    process_t *proc = process_get_current();
+    uint32_t vma_flags;
+    if (!proc || !user_range_valid(addr, length) || !prot_to_vma(prot, &vma_flags)) {
+        return -EINVAL;
+    }
+
+    if (!vma_protect(proc, addr, length, vma_flags)) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 /**
  * sys_yield - Yield CPU to another thread
  */
@@ -161,16 +289,17 @@ static syscall_handler_t syscall_table[SYSCALL_MAX + 1] = {
     [SYSCALL_OPEN]   = sys_unimplemented,
     [SYSCALL_CLOSE]  = sys_unimplemented,
     [SYSCALL_GETPID] = sys_getpid,
-    [SYSCALL_FORK]   = sys_unimplemented,
+    [SYSCALL_FORK]   = sys_fork,
     [SYSCALL_EXEC]   = sys_unimplemented,
     [SYSCALL_WAIT]   = sys_unimplemented,
     [SYSCALL_KILL]   = sys_unimplemented,
     [SYSCALL_SLEEP]  = sys_sleep,
     [SYSCALL_YIELD]  = sys_yield,
-    [SYSCALL_MMAP]   = sys_unimplemented,
-    [SYSCALL_MUNMAP] = sys_unimplemented,
+    [SYSCALL_MMAP]   = sys_mmap,
+    [SYSCALL_MUNMAP] = sys_munmap,
     [SYSCALL_BRK]    = sys_unimplemented,
     [SYSCALL_SBRK]   = sys_unimplemented,
+    [SYSCALL_MPROTECT] = sys_mprotect,
 };
 
 /**
@@ -269,7 +398,8 @@ void syscall_print_stats(void) {
     const char *syscall_names[] = {
         "exit", "write", "read", "open", "close",
         "getpid", "fork", "exec", "wait", "kill",
-        "sleep", "yield", "mmap", "munmap", "brk", "sbrk"
+        "sleep", "yield", "mmap", "munmap", "brk", "sbrk",
+        "mprotect"
     };
 
     for (int i = 0; i <= SYSCALL_MAX; i++) {
@@ -26,9 +26,10 @@
 #define SYSCALL_MUNMAP      13  // munmap(void *addr, size_t len)
 #define SYSCALL_BRK         14  // brk(void *addr)
 #define SYSCALL_SBRK        15  // sbrk(intptr_t increment)
+#define SYSCALL_MPROTECT    16  // mprotect(void *addr, size_t len, int prot)
 
 // Maximum syscall number
-#define SYSCALL_MAX         15
+#define SYSCALL_MAX         16
 
 // System call return values
 #define SYSCALL_SUCCESS     0
@@ -46,6 +47,18 @@
 #define EAGAIN      8   // Try again
 #define EBUSY       9   // Device or resource busy
 
+// mmap()/mprotect() protection
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+// mmap() flags
+#define MAP_SHARED      0x01    // Not supported
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10    // Map exactly at addr, replacing what is there
+#define MAP_ANONYMOUS   0x20    // Zero-filled memory, not backed by a file
+
 // File descriptor constants
 #define STDIN_FILENO    0
 #define STDOUT_FILENO   1
@@ -78,6 +91,13 @@ int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2,
 // Assembly syscall entry point
 extern void syscall_entry(void);
 
+// Return path for a forked child (see process_fork)
+extern void syscall_fork_return(void);
+
+// Bytes of user state syscall_entry saves at the top of the calling
+// thread's kernel stack: user RSP, RIP, RFLAGS, RBX, RBP, R12-R15, arg6
+#define SYSCALL_FRAME_SIZE (10 * 8)
+
 // Statistics
 void syscall_print_stats(void);
 
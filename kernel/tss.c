@@ -12,7 +12,8 @@
 
 // Global TSS (one per CPU, we only have one CPU for now)
 // Initialize to zero at compile time to avoid runtime loop
-static tss_t kernel_tss = {0};
+// Not static: syscall_entry reads RSP0 from it directly
+tss_t kernel_tss = {0};
 
 // Serial debug helper (COM1 = 0x3F8)
 static inline void serial_debug_char(char c) {
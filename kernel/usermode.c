@@ -6,7 +6,9 @@
 
 #include "usermode.h"
 #include "console.h"
-#include "kheap.h"
+#include "process.h"
+#include "vma.h"
+#include "vmm.h"
 #include "tss.h"
 #include "gdt.h"
 
@@ -89,36 +91,38 @@ void jump_to_usermode(void (*entry_point)(void) __attribute__((unused)),
 void start_usermode_process(void (*entry_point)(void)) {
     console_print("\n[USERMODE] Creating user mode process...\n");
 
-    // Allocate user mode stack (64KB)
+    process_t *proc = process_get_current();
+    thread_t *thread = thread_get_current();
+    if (!proc || !thread) {
+        console_print("[USERMODE] ERROR: No current thread\n");
+        return;
+    }
+
+    // Allocate user mode stack (64KB) as a region at the top of the
+    // process's user half, so it is private to it and copied on fork()
     uint64_t user_stack_size = 65536;
-    void *user_stack_base = kmalloc(user_stack_size);
+    uint64_t user_stack_base = vma_map(proc, VMM_USER_END - user_stack_size, user_stack_size,
+                                       VMA_READ | VMA_WRITE);
     if (!user_stack_base) {
         console_print("[USERMODE] ERROR: Failed to allocate user stack\n");
         return;
     }
 
     // Stack grows down, so pointer is at the top
-    uint64_t user_stack = (uint64_t)user_stack_base + user_stack_size - 16;
+    uint64_t user_stack = user_stack_base + user_stack_size - 16;
 
     console_print("[USERMODE] User stack allocated: ");
-    console_print_hex((uint64_t)user_stack_base);
+    console_print_hex(user_stack_base);
     console_print(" - ");
     console_print_hex(user_stack);
     console_print("\n");
 
-    // Allocate kernel stack for when we return from user mode (via syscall/interrupt)
-    uint64_t kernel_stack_size = 8192;
-    void *kernel_stack_base = kmalloc(kernel_stack_size);
-    if (!kernel_stack_base) {
-        console_print("[USERMODE] ERROR: Failed to allocate kernel stack\n");
-        kfree(user_stack_base);
-        return;
-    }
-
-    uint64_t kernel_stack = (uint64_t)kernel_stack_base + kernel_stack_size;
+    // System calls and interrupts from user mode run on the thread's
+    // kernel stack; the scheduler keeps RSP0 pointing at it
+    uint64_t kernel_stack = thread_kernel_stack_top(thread);
 
-    console_print("[USERMODE] Kernel stack allocated: ");
-    console_print_hex((uint64_t)kernel_stack_base);
+    console_print("[USERMODE] Kernel stack: ");
+    console_print_hex((uint64_t)thread->stack_base);
     console_print(" - ");
     console_print_hex(kernel_stack);
     console_print("\n");
@@ -69,6 +69,83 @@ static inline void usermode_yield(void) {
     );
 }
 
+/**
+ * User mode syscall wrapper - fork()
+ *
+ * The child comes back with only the registers the kernel saved, so
+ * every caller-saved register is clobbered
+ */
+static inline int64_t usermode_fork(void) {
+    int64_t ret;
+    __asm__ __volatile__(
+        "mov %1, %%rax\n"      // syscall number
+        "syscall\n"
+        "mov %%rax, %0\n"      // return value: child PID, or 0 in the child
+        : "=r"(ret)
+        : "i"(SYSCALL_FORK)
+        : "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory"
+    );
+    return ret;
+}
+
+/**
+ * User mode syscall wrapper - mmap()
+ */
+static inline int64_t usermode_mmap(uint64_t addr, uint64_t length, uint64_t prot,
+                                    uint64_t flags) {
+    int64_t ret;
+    __asm__ __volatile__(
+        "mov %1, %%rax\n"      // syscall number
+        "mov %2, %%rdi\n"      // arg1: addr
+        "mov %3, %%rsi\n"      // arg2: length
+        "mov %4, %%rdx\n"      // arg3: prot
+        "mov %5, %%r10\n"      // arg4: flags
+        "syscall\n"
+        "mov %%rax, %0\n"      // return value
+        : "=r"(ret)
+        : "i"(SYSCALL_MMAP), "r"(addr), "r"(length), "r"(prot), "r"(flags)
+        : "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory"
+    );
+    return ret;
+}
+
+/**
+ * User mode syscall wrapper - munmap()
+ */
+static inline int64_t usermode_munmap(uint64_t addr, uint64_t length) {
+    int64_t ret;
+    __asm__ __volatile__(
+        "mov %1, %%rax\n"      // syscall number
+        "mov %2, %%rdi\n"      // arg1: addr
+        "mov %3, %%rsi\n"      // arg2: length
+        "syscall\n"
+        "mov %%rax, %0\n"      // return value
+        : "=r"(ret)
+        : "i"(SYSCALL_MUNMAP), "r"(addr), "r"(length)
+        : "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory"
+    );
+    return ret;
+}
+
+/**
+ * User mode syscall wrapper - mprotect()
+ */
+static inline int64_t usermode_mprotect(uint64_t addr, uint64_t length, uint64_t prot) {
+    int64_t ret;
+    __asm__ __volatile__(
+        "mov %1, %%rax\n"      // syscall number
+        "mov %2, %%rdi\n"      // arg1: addr
+        "mov %3, %%rsi\n"      // arg2: length
+        "mov %4, %%rdx\n"      // arg3: prot
+        "syscall\n"
+        "mov %%rax, %0\n"      // return value
+        : "=r"(ret)
+        : "i"(SYSCALL_MPROTECT), "r"(addr), "r"(length), "r"(prot)
+        : "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory"
+    );
+    return ret;
+}
+
 /**
  * Simple strlen function
  */
@@ -87,6 +164,91 @@ static void print(const char *str) {
     usermode_write(STDOUT_FILENO, str, strlen(str));
 }
 
+/**
+ * Print a test result
+ *
+ * @return ok
+ */
+static bool check(bool ok, const char *what) {
+    print(ok ? "  [OK] " : "  [FAIL] ");
+    print(what);
+    print("\n");
+    return ok;
+}
+
+/**
+ * Map anonymous memory, fault it in, then split and merge the region
+ * with mprotect() and punch a hole in it with munmap()
+ */
+static void test_mmap(void) {
+    const uint64_t page = 4096;
+    const uint64_t words = page / sizeof(uint64_t);
+
+    int64_t addr = usermode_mmap(0, 4 * page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS);
+    if (!check(addr > 0, "mmap() 4 pages")) {
+        return;
+    }
+    volatile uint64_t *mem = (volatile uint64_t*)addr;
+
+    // First touch of each page is a demand fault that zero-fills it
+    bool zeroed = true;
+    for (uint64_t i = 0; i < 4; i++) {
+        zeroed &= mem[i * words] == 0;
+        mem[i * words] = i + 1;
+    }
+    check(zeroed, "pages zero-filled on first touch");
+    check(mem[0] == 1 && mem[3 * words] == 4, "pages keep written values");
+
+    // Read-only page in the middle splits the region in three
+    check(usermode_mprotect(addr + page, page, PROT_READ) == 0,
+          "mprotect() read-only page splits region");
+    check(mem[words] == 2, "read-only page still readable");
+
+    // Restoring the protection merges the pieces again
+    check(usermode_mprotect(addr + page, page, PROT_READ | PROT_WRITE) == 0,
+          "mprotect() back to read-write merges region");
+    mem[words] = 5;
+    check(mem[words] == 5, "merged page writable again");
+
+    // Unmapping the middle leaves the pages on either side
+    check(usermode_munmap(addr + page, 2 * page) == 0, "munmap() middle pages");
+    check(mem[0] == 1 && mem[3 * words] == 4, "pages around the hole kept");
+    check(usermode_mprotect(addr + page, page, PROT_READ) < 0,
+          "mprotect() on the hole fails");
+
+    check(usermode_mmap(0, page, PROT_READ, MAP_SHARED | MAP_ANONYMOUS) < 0,
+          "mmap() rejects shared mappings");
+    check(usermode_munmap(addr, 4 * page) == 0, "munmap() whole range");
+}
+
+/**
+ * Fork and check that parent and child each write to their own copy of
+ * the stack
+ */
+static void test_fork(void) {
+    volatile uint64_t value = 1;
+
+    int64_t pid = usermode_fork();
+    if (pid < 0) {
+        print("  [FAIL] fork() returned an error\n");
+        return;
+    }
+
+    if (pid == 0) {
+        value = 2;
+        usermode_yield();  // Let the parent write its copy
+        print(value == 2 ? "  [OK] fork() child keeps its own copy\n"
+                         : "  [FAIL] fork() child sees the parent's write\n");
+        usermode_exit(0);
+    }
+
+    value = 3;
+    usermode_yield();  // Let the child write its copy
+    print(value == 3 ? "  [OK] fork() parent keeps its own copy\n"
+                     : "  [FAIL] fork() parent sees the child's write\n");
+}
+
 /**
  * User mode test program entry point
  *
@@ -127,6 +289,12 @@ void usermode_test_program(void) {
         usermode_yield();
     }
 
+    print("\nTesting mmap()...\n");
+    test_mmap();
+
+    print("\nTesting fork()...\n");
+    test_fork();
+
     print("\nUser mode test completed successfully!\n");
     print("Calling exit(0)...\n\n");
 
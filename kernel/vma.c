@@ -0,0 +1,950 @@
+/**
+ * AuroraOS Kernel - Virtual Memory Areas Implementation
+ *
+ * Each process keeps its regions in a red-black tree ordered by address.
+ * Every node also summarises its subtree (lowest start, highest end and
+ * largest gap between regions), so lookups, free-range searches and
+ * updates are all O(log n). Neighbouring regions with the same access
+ * are merged.
+ *
+ * Reserving a region only records it; the page-fault handler maps a
+ * zeroed frame the first time a page inside it is touched. Fork shares
+ * the parent's frames read-only, and the first write to a shared page
+ * gives the writer its own copy.
+ */
+
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "console.h"
+#include "types.h"
+
+#define ALIGN_DOWN(addr, align) ((addr) & ~((align) - 1))
+#define ALIGN_UP(addr, align)   (((addr) + (align) - 1) & ~((align) - 1))
+
+static struct {
+    kmem_cache_t *vma_cache;
+    bool initialized;
+    vma_stats_t stats;
+} vma_state = {0};
+
+/**
+ * Recompute a node's subtree summary from its own range and its children
+ */
+static void vma_augment(vma_t *vma) {
+    vma_t *left = vma->left;
+    vma_t *right = vma->right;
+    uint64_t gap = 0;
+
+    vma->subtree_start = left ? left->subtree_start : vma->start;
+    vma->subtree_end = right ? right->subtree_end : vma->end;
+
+    if (left) {
+        uint64_t below = vma->start - left->subtree_end;
+        gap = left->subtree_gap > below ? left->subtree_gap : below;
+    }
+    if (right) {
+        uint64_t above = right->subtree_start - vma->end;
+        if (right->subtree_gap > above) {
+            above = right->subtree_gap;
+        }
+        if (above > gap) {
+            gap = above;
+        }
+    }
+    vma->subtree_gap = gap;
+}
+
+/**
+ * Recompute the summaries from a node up to the root
+ */
+static void vma_augment_up(vma_t *vma) {
+    for (; vma; vma = vma->parent) {
+        vma_augment(vma);
+    }
+}
+
+/**
+ * Point whatever linked to old (its parent, or the root) at new
+ */
+static void vma_replace_child(vma_t **root, vma_t *old, vma_t *new) {
+    if (!old->parent) {
+        *root = new;
+    } else if (old->parent->left == old) {
+        old->parent->left = new;
+    } else {
+        old->parent->right = new;
+    }
+}
+
+/**
+ * Rotate vma's right child up into its place
+ * Only vma and the child change subtrees, so only they are recomputed
+ */
+static void vma_rotate_left(vma_t **root, vma_t *vma) {
+    vma_t *up = vma->right;
+
+    vma->right = up->left;
+    if (up->left) {
+        up->left->parent = vma;
+    }
+    up->parent = vma->parent;
+    vma_replace_child(root, vma, up);
+    up->left = vma;
+    vma->parent = up;
+
+    vma_augment(vma);
+    vma_augment(up);
+}
+
+/**
+ * Rotate vma's left child up into its place
+ */
+static void vma_rotate_right(vma_t **root, vma_t *vma) {
+    vma_t *up = vma->left;
+
+    vma->left = up->right;
+    if (up->right) {
+        up->right->parent = vma;
+    }
+    up->parent = vma->parent;
+    vma_replace_child(root, vma, up);
+    up->right = vma;
+    vma->parent = up;
+
+    vma_augment(vma);
+    vma_augment(up);
+}
+
+/**
+ * Link a region into its process's tree and rebalance
+ * Caller holds proc->vma_lock and has checked it overlaps nothing
+ */
+static void vma_link(process_t *proc, vma_t *vma) {
+    vma_t **link = &proc->vmas;
+    vma_t *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        link = vma->start < parent->start ? &parent->left : &parent->right;
+    }
+
+    vma->parent = parent;
+    vma->left = NULL;
+    vma->right = NULL;
+    vma->red = true;
+    *link = vma;
+    vma_augment_up(vma);
+
+    // Fix red-red violations; the root is black, so a red parent always
+    // has a parent of its own
+    while (vma->parent && vma->parent->red) {
+        vma_t *p = vma->parent;
+        vma_t *g = p->parent;
+        bool left = p == g->left;
+        vma_t *uncle = left ? g->right : g->left;
+
+        if (uncle && uncle->red) {
+            p->red = false;
+            uncle->red = false;
+            g->red = true;
+            vma = g;
+            continue;
+        }
+
+        if (vma == (left ? p->right : p->left)) {
+            if (left) {
+                vma_rotate_left(&proc->vmas, p);
+            } else {
+                vma_rotate_right(&proc->vmas, p);
+            }
+            p = vma;
+        }
+
+        p->red = false;
+        g->red = true;
+        if (left) {
+            vma_rotate_right(&proc->vmas, g);
+        } else {
+            vma_rotate_left(&proc->vmas, g);
+        }
+        break;
+    }
+    proc->vmas->red = false;
+
+    __atomic_add_fetch(&vma_state.stats.num_vmas, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Restore the tree's black heights after a black node was removed from
+ * above child (which may be NULL) under parent
+ */
+static void vma_erase_fixup(vma_t **root, vma_t *child, vma_t *parent) {
+    while (child != *root && (!child || !child->red)) {
+        bool left = child == parent->left;
+        vma_t *sibling = left ? parent->right : parent->left;
+
+        if (sibling->red) {
+            sibling->red = false;
+            parent->red = true;
+            if (left) {
+                vma_rotate_left(root, parent);
+            } else {
+                vma_rotate_right(root, parent);
+            }
+            sibling = left ? parent->right : parent->left;
+        }
+
+        vma_t *near = left ? sibling->left : sibling->right;
+        vma_t *far = left ? sibling->right : sibling->left;
+
+        if ((!near || !near->red) && (!far || !far->red)) {
+            sibling->red = true;
+            child = parent;
+            parent = child->parent;
+            continue;
+        }
+
+        if (!far || !far->red) {
+            near->red = false;
+            sibling->red = true;
+            if (left) {
+                vma_rotate_right(root, sibling);
+            } else {
+                vma_rotate_left(root, sibling);
+            }
+            sibling = left ? parent->right : parent->left;
+            far = left ? sibling->right : sibling->left;
+        }
+
+        sibling->red = parent->red;
+        parent->red = false;
+        far->red = false;
+        if (left) {
+            vma_rotate_left(root, parent);
+        } else {
+            vma_rotate_right(root, parent);
+        }
+        child = *root;
+    }
+
+    if (child) {
+        child->red = false;
+    }
+}
+
+/**
+ * Unlink a region from its process's tree and free it
+ * Caller holds proc->vma_lock
+ */
+static void vma_remove(process_t *proc, vma_t *vma) {
+    vma_t *child;
+    vma_t *parent;
+    bool red;
+
+    if (vma->left && vma->right) {
+        // Put the successor in vma's place; it has no left child
+        vma_t *next = vma->right;
+        while (next->left) {
+            next = next->left;
+        }
+
+        child = next->right;
+        parent = next->parent;
+        red = next->red;
+
+        if (parent == vma) {
+            parent = next;
+        } else {
+            parent->left = child;
+            if (child) {
+                child->parent = parent;
+            }
+            next->right = vma->right;
+            vma->right->parent = next;
+        }
+
+        next->left = vma->left;
+        vma->left->parent = next;
+        next->parent = vma->parent;
+        next->red = vma->red;
+        vma_replace_child(&proc->vmas, vma, next);
+    } else {
+        child = vma->left ? vma->left : vma->right;
+        parent = vma->parent;
+        red = vma->red;
+
+        if (child) {
+            child->parent = parent;
+        }
+        vma_replace_child(&proc->vmas, vma, child);
+    }
+
+    vma_augment_up(parent);
+    if (!red) {
+        vma_erase_fixup(&proc->vmas, child, parent);
+    }
+
+    kmem_cache_free(vma_state.vma_cache, vma);
+    __atomic_sub_fetch(&vma_state.stats.num_vmas, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the next region by address
+ */
+static vma_t* vma_next(vma_t *vma) {
+    if (vma->right) {
+        for (vma = vma->right; vma->left; vma = vma->left) {
+        }
+        return vma;
+    }
+    while (vma->parent && vma == vma->parent->right) {
+        vma = vma->parent;
+    }
+    return vma->parent;
+}
+
+/**
+ * Get the previous region by address
+ */
+static vma_t* vma_prev(vma_t *vma) {
+    if (vma->left) {
+        for (vma = vma->left; vma->right; vma = vma->right) {
+        }
+        return vma;
+    }
+    while (vma->parent && vma == vma->parent->left) {
+        vma = vma->parent;
+    }
+    return vma->parent;
+}
+
+/**
+ * Find the region containing addr
+ * Caller holds proc->vma_lock
+ */
+static vma_t* vma_lookup(process_t *proc, uint64_t addr) {
+    vma_t *vma = proc->vmas;
+    while (vma) {
+        if (addr < vma->start) {
+            vma = vma->left;
+        } else if (addr >= vma->end) {
+            vma = vma->right;
+        } else {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the lowest region that ends above addr
+ * Caller holds proc->vma_lock
+ */
+static vma_t* vma_lookup_above(process_t *proc, uint64_t addr) {
+    vma_t *found = NULL;
+    vma_t *vma = proc->vmas;
+    while (vma) {
+        if (vma->end > addr) {
+            found = vma;
+            vma = vma->left;
+        } else {
+            vma = vma->right;
+        }
+    }
+    return found;
+}
+
+/**
+ * Check that no region overlaps [start, end)
+ * Caller holds proc->vma_lock
+ */
+static bool vma_range_free(process_t *proc, uint64_t start, uint64_t end) {
+    vma_t *vma = vma_lookup_above(proc, start);
+    return !vma || vma->start >= end;
+}
+
+/**
+ * Find the lowest free range of the user half that can hold size bytes
+ * The subtree summaries tell at each node whether a fit exists below it,
+ * so the search follows one path and never backtracks
+ * Caller holds proc->vma_lock
+ *
+ * @return Start of the range, or 0 if there is none
+ */
+static uint64_t vma_find_gap(process_t *proc, uint64_t size) {
+    uint64_t lo = VMM_USER_START;   // End of the region before the subtree
+    uint64_t hi = VMM_USER_END;     // Start of the region after it
+    vma_t *vma = proc->vmas;
+
+    while (vma) {
+        vma_t *left = vma->left;
+        bool fits_below = left ? (left->subtree_start - lo >= size ||
+                                  left->subtree_gap >= size ||
+                                  vma->start - left->subtree_end >= size)
+                               : vma->start - lo >= size;
+        if (fits_below) {
+            if (!left) {
+                return lo;
+            }
+            hi = vma->start;
+            vma = left;
+        } else {
+            lo = vma->end;
+            vma = vma->right;
+        }
+    }
+
+    return hi - lo >= size ? lo : 0;
+}
+
+/**
+ * Merge a region with its neighbours where they touch it and have the
+ * same access
+ * Following regions are absorbed for as long as they match, so a run of
+ * regions that were just given the same access collapses into one
+ * Caller holds proc->vma_lock
+ *
+ * @return The region now covering vma's range
+ */
+static vma_t* vma_merge(process_t *proc, vma_t *vma) {
+    vma_t *prev = vma_prev(vma);
+    if (prev && prev->end == vma->start && prev->flags == vma->flags) {
+        uint64_t end = vma->end;
+        vma_remove(proc, vma);
+        prev->end = end;
+        vma_augment_up(prev);
+        vma = prev;
+    }
+
+    for (vma_t *next = vma_next(vma);
+         next && next->start == vma->end && next->flags == vma->flags;
+         next = vma_next(vma)) {
+        uint64_t end = next->end;
+        vma_remove(proc, next);
+        vma->end = end;
+        vma_augment_up(vma);
+    }
+
+    return vma;
+}
+
+/**
+ * Split a region in two at addr, using spare for the upper part
+ * Caller holds proc->vma_lock
+ *
+ * @return The upper part
+ */
+static vma_t* vma_split(process_t *proc, vma_t *vma, uint64_t addr, vma_t *spare) {
+    spare->start = addr;
+    spare->end = vma->end;
+    spare->flags = vma->flags;
+
+    vma->end = addr;
+    vma_augment_up(vma);
+    vma_link(proc, spare);
+    return spare;
+}
+
+/**
+ * Remove [start, end) from a process's regions, trimming or splitting
+ * the regions it only partly covers
+ * A region that contains the whole range is split, which takes *spare
+ * (and sets it to NULL)
+ * Caller holds proc->vma_lock
+ */
+static void vma_remove_range(process_t *proc, uint64_t start, uint64_t end, vma_t **spare) {
+    vma_t *vma = vma_lookup_above(proc, start);
+
+    if (vma && vma->start < start) {
+        if (vma->end > end) {
+            vma_split(proc, vma, end, *spare);
+            *spare = NULL;
+        }
+        vma->end = start;
+        vma_augment_up(vma);
+        vma = vma_next(vma);
+    }
+
+    while (vma && vma->start < end) {
+        if (vma->end > end) {
+            vma->start = end;
+            vma_augment_up(vma);
+            break;
+        }
+
+        vma_t *next = vma_next(vma);
+        vma_remove(proc, vma);
+        vma = next;
+    }
+}
+
+/**
+ * Get the PTE flags for pages of a region
+ * A region without access keeps its pages mapped but kernel-only, so
+ * their contents survive until access is restored
+ * NX is not enabled, so VMA_EXEC is not enforced
+ */
+static uint64_t vma_pte_flags(vma_t *vma) {
+    return PTE_PRESENT |
+           ((vma->flags & VMA_ACCESS) ? PTE_USER : 0) |
+           ((vma->flags & VMA_WRITE) ? PTE_WRITE : 0);
+}
+
+/**
+ * Check that a range is page-aligned, non-empty and in the user half
+ */
+static bool vma_range_valid(uint64_t addr, uint64_t size) {
+    return size != 0 && !(addr & (PAGE_SIZE - 1)) &&
+           addr >= VMM_USER_START && addr <= VMM_USER_END - size;
+}
+
+/**
+ * Map a region of anonymous memory into a process
+ * No frames are allocated until the region's pages are touched. Without
+ * VMA_FIXED, addr is only a hint: the region goes there if the range is
+ * free, and in the lowest free range that fits otherwise
+ *
+ * @param size Size in bytes (rounded up to whole pages)
+ * @param flags VMA_* access, plus VMA_FIXED to place it exactly at addr,
+ *              unmapping whatever was there
+ * @return Start of the region, or 0 on failure
+ */
+uint64_t vma_map(process_t *proc, uint64_t addr, uint64_t size, uint32_t flags) {
+    if (!vma_state.initialized || !proc) {
+        return 0;
+    }
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (size == 0 || ((flags & VMA_FIXED) && !vma_range_valid(addr, size))) {
+        console_print("[VMA] ERROR: Invalid region\n");
+        return 0;
+    }
+
+    vma_t *vma = (vma_t*)kmem_cache_alloc(vma_state.vma_cache);
+    vma_t *spare = (flags & VMA_FIXED) ? (vma_t*)kmem_cache_alloc(vma_state.vma_cache) : NULL;
+    if (!vma || ((flags & VMA_FIXED) && !spare)) {
+        if (vma) {
+            kmem_cache_free(vma_state.vma_cache, vma);
+        }
+        return 0;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+
+    if (flags & VMA_FIXED) {
+        vma_remove_range(proc, addr, addr + size, &spare);
+        vmm_space_unmap_range(proc->page_directory, addr, size);
+    } else if (!vma_range_valid(addr, size) || !vma_range_free(proc, addr, addr + size)) {
+        addr = vma_find_gap(proc, size);
+    }
+
+    if (addr == 0) {
+        spin_unlock_irqrestore(&proc->vma_lock, irq);
+        console_print("[VMA] ERROR: Address space exhausted\n");
+        kmem_cache_free(vma_state.vma_cache, vma);
+        return 0;
+    }
+
+    vma->start = addr;
+    vma->end = addr + size;
+    vma->flags = flags & VMA_ACCESS;
+    vma_link(proc, vma);
+    vma_merge(proc, vma);
+
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+
+    if (spare) {
+        kmem_cache_free(vma_state.vma_cache, spare);
+    }
+    return addr;
+}
+
+/**
+ * Unmap a range of a process's address space
+ * Regions it partly covers are trimmed or split, and the frames mapped
+ * in it are released
+ *
+ * @return false if the range is invalid or out of memory
+ */
+bool vma_unmap(process_t *proc, uint64_t addr, uint64_t size) {
+    if (!vma_state.initialized || !proc) {
+        return false;
+    }
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (!vma_range_valid(addr, size)) {
+        return false;
+    }
+
+    vma_t *spare = (vma_t*)kmem_cache_alloc(vma_state.vma_cache);
+    if (!spare) {
+        return false;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+    vma_remove_range(proc, addr, addr + size, &spare);
+    vmm_space_unmap_range(proc->page_directory, addr, size);
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+
+    if (spare) {
+        kmem_cache_free(vma_state.vma_cache, spare);
+    }
+    return true;
+}
+
+/**
+ * Change the access of a range of a process's address space
+ * Regions at its edges are split, and the pages already mapped in it
+ * are updated
+ *
+ * @param flags New VMA_* access
+ * @return false if the range is invalid, not fully mapped or out of memory
+ */
+bool vma_protect(process_t *proc, uint64_t addr, uint64_t size, uint32_t flags) {
+    if (!vma_state.initialized || !proc) {
+        return false;
+    }
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (!vma_range_valid(addr, size)) {
+        return false;
+    }
+    uint64_t end = addr + size;
+
+    vma_t *below = (vma_t*)kmem_cache_alloc(vma_state.vma_cache);
+    vma_t *above = (vma_t*)kmem_cache_alloc(vma_state.vma_cache);
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+
+    // Every page of the range must be in a region
+    vma_t *vma = vma_lookup(proc, addr);
+    bool changed = below && above && vma;
+    for (vma_t *v = vma; changed && v->end < end; ) {
+        vma_t *next = vma_next(v);
+        changed = next && next->start == v->end;
+        v = next;
+    }
+
+    if (changed) {
+        if (vma->start < addr) {
+            vma = vma_split(proc, vma, addr, below);
+            below = NULL;
+        }
+
+        for (vma_t *v = vma; v && v->start < end; v = vma_next(v)) {
+            if (v->end > end) {
+                vma_split(proc, v, end, above);
+                above = NULL;
+            }
+            v->flags = flags & VMA_ACCESS;
+        }
+
+        vmm_space_protect_range(proc->page_directory, addr, size, vma_pte_flags(vma));
+
+        // The range now holds regions with the same access side by side
+        vma_merge(proc, vma);
+    }
+
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+
+    if (below) {
+        kmem_cache_free(vma_state.vma_cache, below);
+    }
+    if (above) {
+        kmem_cache_free(vma_state.vma_cache, above);
+    }
+    return changed;
+}
+
+/**
+ * Release all of a process's regions
+ * Frames faulted into them are freed with the address space
+ */
+void vma_unmap_all(process_t *proc) {
+    if (!proc) {
+        return;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+    vma_t *vma = proc->vmas;
+    proc->vmas = NULL;
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+
+    // Free the detached tree bottom-up, climbing back through parents
+    while (vma) {
+        if (vma->left) {
+            vma = vma->left;
+            continue;
+        }
+        if (vma->right) {
+            vma = vma->right;
+            continue;
+        }
+
+        vma_t *parent = vma->parent;
+        if (parent && parent->left == vma) {
+            parent->left = NULL;
+        } else if (parent) {
+            parent->right = NULL;
+        }
+        kmem_cache_free(vma_state.vma_cache, vma);
+        __atomic_sub_fetch(&vma_state.stats.num_vmas, 1, __ATOMIC_RELAXED);
+        vma = parent;
+    }
+}
+
+/**
+ * Find the region containing an address
+ *
+ * @return The region, or NULL if addr is not in one
+ */
+vma_t* vma_find(process_t *proc, uint64_t addr) {
+    if (!proc) {
+        return NULL;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+    vma_t *vma = vma_lookup(proc, addr);
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+    return vma;
+}
+
+/**
+ * Copy a subtree of regions node for node, keeping its shape and colours
+ *
+ * @param link Set to the copy (or what was copied before running out of memory)
+ * @return false if out of memory
+ */
+static bool vma_copy_tree(vma_t *vma, vma_t *parent, vma_t **link) {
+    *link = NULL;
+    if (!vma) {
+        return true;
+    }
+
+    vma_t *copy = (vma_t*)kmem_cache_alloc(vma_state.vma_cache);
+    if (!copy) {
+        return false;
+    }
+    copy->start = vma->start;
+    copy->end = vma->end;
+    copy->flags = vma->flags;
+    copy->red = vma->red;
+    copy->parent = parent;
+    copy->left = NULL;
+    copy->right = NULL;
+    copy->subtree_start = vma->subtree_start;
+    copy->subtree_end = vma->subtree_end;
+    copy->subtree_gap = vma->subtree_gap;
+    *link = copy;
+    __atomic_add_fetch(&vma_state.stats.num_vmas, 1, __ATOMIC_RELAXED);
+
+    return vma_copy_tree(vma->left, copy, &copy->left) &&
+           vma_copy_tree(vma->right, copy, &copy->right);
+}
+
+/**
+ * Copy a process's regions and address space into a new child process
+ * The child's pages are shared with the parent copy-on-write, so this
+ * costs a page-table copy rather than a copy of the memory
+ *
+ * @param child Process with no regions and an empty user half
+ * @return false if out of memory; the caller destroys the partial child
+ */
+bool vma_fork(process_t *parent, process_t *child) {
+    if (!vma_state.initialized || !parent || !child) {
+        return false;
+    }
+
+    // The lock also holds off faults that would change the parent's
+    // page tables during the copy
+    uint64_t irq = spin_lock_irqsave(&parent->vma_lock);
+
+    bool copied = vma_copy_tree(parent->vmas, NULL, &child->vmas) &&
+                  vmm_fork_address_space(parent->page_directory, child->page_directory);
+
+    spin_unlock_irqrestore(&parent->vma_lock, irq);
+    return copied;
+}
+
+/**
+ * Back a page of an anonymous region with a zeroed frame
+ * Caller holds proc->vma_lock
+ */
+static bool fault_anonymous(process_t *proc, vma_t *vma, uint64_t addr) {
+    // Another CPU may have resolved the same fault first
+    pte_t *pte = vmm_space_get_pte(proc->page_directory, addr, false);
+    if (pte && (*pte & PTE_PRESENT)) {
+        return true;
+    }
+
+    uint64_t phys = pmm_alloc_zeroed_frame();
+    if (phys == 0) {
+        console_print("[VMA] ERROR: Out of memory in page fault\n");
+        return false;
+    }
+
+    page_t *page = pmm_page(phys);
+    if (page) {
+        // A single mapping can be migrated; the space's PCID fits in the
+        // page offset bits of addr
+        page->flags |= PAGE_FLAG_MOVABLE;
+        page->owner = PAGE_OWNER_USER;
+        page->mapcount = 1;
+        page->private = addr | (proc->page_directory & CR3_PCID_MASK);
+    }
+
+    if (!vmm_space_map_page(proc->page_directory, addr, phys, vma_pte_flags(vma))) {
+        console_print("[VMA] ERROR: Failed to map faulted page\n");
+        pmm_free_frame(phys);
+        return false;
+    }
+
+    __atomic_add_fetch(&vma_state.stats.pages_faulted_in, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Give a process its own copy of a page it shares through fork
+ * If no other mapping is left, the page is simply made writable again
+ * Caller holds proc->vma_lock
+ */
+static bool fault_cow(process_t *proc, vma_t *vma, uint64_t addr) {
+    pte_t *pte = vmm_space_get_pte(proc->page_directory, addr, false);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return fault_anonymous(proc, vma, addr);
+    }
+    if (!(*pte & PTE_COW)) {
+        // Another CPU may have resolved the same fault first
+        return (*pte & PTE_WRITE) != 0;
+    }
+
+    uint64_t old_phys = *pte & PTE_ADDR_MASK;
+    page_t *old = pmm_page(old_phys);
+
+    if (old && __atomic_load_n(&old->refcount, __ATOMIC_ACQUIRE) == 1) {
+        // The last mapping may not be the one private recorded
+        old->flags |= PAGE_FLAG_MOVABLE;
+        old->private = addr | (proc->page_directory & CR3_PCID_MASK);
+        *pte = (*pte & ~PTE_COW) | PTE_WRITE;
+        vmm_space_flush_page(proc->page_directory, addr);
+        __atomic_add_fetch(&vma_state.stats.cow_reuses, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    uint64_t phys = pmm_alloc_frame();
+    if (phys == 0) {
+        console_print("[VMA] ERROR: Out of memory in copy-on-write fault\n");
+        return false;
+    }
+
+    uint64_t *src = (uint64_t*)old_phys;
+    uint64_t *dst = (uint64_t*)phys;
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        dst[i] = src[i];
+    }
+
+    page_t *page = pmm_page(phys);
+    if (page) {
+        page->flags |= PAGE_FLAG_MOVABLE;
+        page->owner = PAGE_OWNER_USER;
+        page->mapcount = 1;
+        page->private = addr | (proc->page_directory & CR3_PCID_MASK);
+    }
+
+    if (!vmm_space_map_page(proc->page_directory, addr, phys, vma_pte_flags(vma))) {
+        console_print("[VMA] ERROR: Failed to map copied page\n");
+        pmm_free_frame(phys);
+        return false;
+    }
+
+    if (old) {
+        __atomic_sub_fetch(&old->mapcount, 1, __ATOMIC_RELAXED);
+        pmm_page_put(old);
+    }
+
+    __atomic_add_fetch(&vma_state.stats.cow_copies, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Handle a page fault on a user-half address
+ * Called from the exception handler with the faulting address from CR2
+ *
+ * @return true if the fault was resolved and the access can be retried
+ */
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    process_t *proc = process_get_current();
+    if (!vma_state.initialized || !proc || (error_code & PF_RESERVED)) {
+        return false;
+    }
+
+    // Faults are resolved in proc's address space, so retrying would
+    // fault again if another space is loaded
+    if (vmm_current_address_space() != proc->page_directory) {
+        __atomic_add_fetch(&vma_state.stats.bad_faults, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    addr = ALIGN_DOWN(addr, PAGE_SIZE);
+    bool handled = false;
+
+    uint64_t irq = spin_lock_irqsave(&proc->vma_lock);
+
+    uint32_t needed = (error_code & PF_WRITE) ? VMA_WRITE
+                    : (error_code & PF_INSTR) ? VMA_EXEC
+                    : VMA_ACCESS;
+
+    vma_t *vma = vma_lookup(proc, addr);
+    if (vma && (vma->flags & needed)) {
+        if (!(error_code & PF_PRESENT)) {
+            handled = fault_anonymous(proc, vma, addr);
+        } else if (error_code & PF_WRITE) {
+            handled = fault_cow(proc, vma, addr);
+        }
+    }
+
+    spin_unlock_irqrestore(&proc->vma_lock, irq);
+
+    __atomic_add_fetch(handled ? &vma_state.stats.faults : &vma_state.stats.bad_faults,
+                       1, __ATOMIC_RELAXED);
+    return handled;
+}
+
+/**
+ * Initialize virtual memory areas
+ * Needs the slab allocator for region descriptors
+ */
+void vma_init(void) {
+    console_print("[VMA] Initializing virtual memory areas...\n");
+
+    vma_state.vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+    if (!vma_state.vma_cache) {
+        console_print("[VMA] ERROR: Failed to create region cache\n");
+        return;
+    }
+
+    vma_state.initialized = true;
+}
+
+/**
+ * Print region and fault statistics
+ */
+void vma_print_stats(void) {
+    console_print("\n[VMA] Statistics:\n");
+    console_print("  Regions:       ");
+    console_print_dec(vma_state.stats.num_vmas);
+    console_print("\n  Faults:        ");
+    console_print_dec(vma_state.stats.faults);
+    console_print(" (");
+    console_print_dec(vma_state.stats.pages_faulted_in);
+    console_print(" pages faulted in)\n  COW copies:    ");
+    console_print_dec(vma_state.stats.cow_copies);
+    console_print(" (");
+    console_print_dec(vma_state.stats.cow_reuses);
+    console_print(" reused)\n  Bad faults:    ");
+    console_print_dec(vma_state.stats.bad_faults);
+    console_print("\n");
+}
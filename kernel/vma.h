@@ -0,0 +1,75 @@
+/**
+ * AuroraOS Kernel - Virtual Memory Areas
+ *
+ * Regions of a process's user address space. Reserving a region costs
+ * no memory; pages are backed by zeroed frames when first touched, and
+ * pages shared by fork are copied when first written
+ */
+
+#ifndef _KERNEL_VMA_H_
+#define _KERNEL_VMA_H_
+
+#include "types.h"
+#include "process.h"
+
+// Region access
+#define VMA_READ    (1U << 0)
+#define VMA_WRITE   (1U << 1)
+#define VMA_EXEC    (1U << 2)
+#define VMA_ACCESS  (VMA_READ | VMA_WRITE | VMA_EXEC)
+
+// vma_map() placement
+#define VMA_FIXED   (1U << 8)   // Map exactly at addr, replacing what is there
+
+// Page fault error code bits
+#define PF_PRESENT  (1U << 0)   // Protection violation on a present page
+#define PF_WRITE    (1U << 1)   // Write access
+#define PF_USER     (1U << 2)   // Fault in user mode
+#define PF_RESERVED (1U << 3)   // Reserved bit set in a paging entry
+#define PF_INSTR    (1U << 4)   // Instruction fetch
+
+// Virtual memory area, a node of its process's red-black tree
+typedef struct vma {
+    uint64_t start;             // First address (page-aligned)
+    uint64_t end;               // End address, exclusive (page-aligned)
+    uint32_t flags;             // VMA_* access
+    bool red;                   // Node colour
+
+    struct vma *parent;
+    struct vma *left;           // Regions below this one
+    struct vma *right;          // Regions above this one
+
+    // Summary of the subtree rooted here, for free-range searches
+    uint64_t subtree_start;     // Lowest start
+    uint64_t subtree_end;       // Highest end
+    uint64_t subtree_gap;       // Largest gap between two of its regions
+} vma_t;
+
+// Region and fault statistics
+typedef struct {
+    uint64_t num_vmas;          // Live regions, all processes
+    uint64_t faults;            // Page faults resolved
+    uint64_t pages_faulted_in;  // Zeroed frames mapped on demand
+    uint64_t cow_copies;        // Shared pages copied on write
+    uint64_t cow_reuses;        // Shared pages written after the other copies went away
+    uint64_t bad_faults;        // Faults outside a region or against its access
+} vma_stats_t;
+
+// Initialization
+void vma_init(void);
+
+// Regions
+uint64_t vma_map(process_t *proc, uint64_t addr, uint64_t size, uint32_t flags);
+bool vma_unmap(process_t *proc, uint64_t addr, uint64_t size);
+bool vma_protect(process_t *proc, uint64_t addr, uint64_t size, uint32_t flags);
+void vma_unmap_all(process_t *proc);
+vma_t* vma_find(process_t *proc, uint64_t addr);
+bool vma_fork(process_t *parent, process_t *child);
+
+// Page faults
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
+
+// Debugging and statistics
+void vma_print_stats(void);
+
+#endif // _KERNEL_VMA_H_
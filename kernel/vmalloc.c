@@ -0,0 +1,271 @@
+/**
+ * AuroraOS Kernel - Virtually Contiguous Allocations Implementation
+ *
+ * Areas are kept in an address-sorted list and placed first-fit, each
+ * followed by an unmapped guard page. Freeing clears all of an area's
+ * PTEs, flushes the TLB once and only then returns the frames.
+ */
+
+#include "vmalloc.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "console.h"
+#include "types.h"
+
+// vmalloc area
+typedef struct vmalloc_area {
+    uint64_t start;                 // First mapped address
+    uint64_t pages;                 // Mapped pages (guard not included)
+    struct vmalloc_area *next;      // Next area by address
+} vmalloc_area_t;
+
+static struct {
+    vmalloc_area_t *areas;
+    kmem_cache_t *area_cache;
+    bool initialized;
+    vmalloc_stats_t stats;
+} vmalloc_state = {0};
+
+// Protects vmalloc_state
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+/**
+ * Find a free virtual range and link area into the area list
+ *
+ * @return false if the region is exhausted
+ */
+static bool area_reserve(vmalloc_area_t *area) {
+    uint64_t span = (area->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+    uint64_t addr = VMALLOC_START;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    vmalloc_area_t **link = &vmalloc_state.areas;
+    for (vmalloc_area_t *next = *link; next; next = *link) {
+        if (next->start - addr >= span) {
+            break;
+        }
+        addr = next->start + (next->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+        link = &next->next;
+    }
+
+    bool found = VMALLOC_END - addr >= span;
+    if (found) {
+        area->start = addr;
+        area->next = *link;
+        *link = area;
+        vmalloc_state.stats.num_areas++;
+        vmalloc_state.stats.mapped_pages += area->pages;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return found;
+}
+
+/**
+ * Find the area starting at addr
+ * Caller holds vmalloc_lock
+ */
+static vmalloc_area_t** area_find(uint64_t addr) {
+    vmalloc_area_t **link = &vmalloc_state.areas;
+    while (*link && (*link)->start < addr) {
+        link = &(*link)->next;
+    }
+    return (*link && (*link)->start == addr) ? link : NULL;
+}
+
+/**
+ * Unlink the area starting at addr from the area list
+ *
+ * @return The area, or NULL if there is none
+ */
+static vmalloc_area_t* area_remove(uint64_t addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    vmalloc_area_t **link = area_find(addr);
+    vmalloc_area_t *area = link ? *link : NULL;
+    if (area) {
+        *link = area->next;
+        vmalloc_state.stats.num_areas--;
+        vmalloc_state.stats.mapped_pages -= area->pages;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+/**
+ * Unmap pages of an area and free their frames
+ *
+ * The PTEs are cleared into one TLB batch, so the whole range needs only
+ * one flush before the frames can be reused
+ */
+static void area_unmap(uint64_t start, uint64_t pages) {
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, vmm_kernel_address_space());
+
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t virt = start + i * PAGE_SIZE;
+        uint64_t phys = vmm_clear_pte(virt);
+        if (phys == 0) {
+            continue;
+        }
+
+        page_t *page = pmm_page(phys);
+        if (page) {
+            page->flags &= ~PAGE_FLAG_MOVABLE;
+        }
+        vmm_gather_page(&tlb, virt);
+        vmm_gather_free_frame(&tlb, phys);
+    }
+
+    vmm_gather_finish(&tlb);
+}
+
+/**
+ * Allocate a virtually contiguous buffer
+ */
+void* vmalloc(uint64_t size) {
+    if (!vmalloc_state.initialized || size == 0 || size > VMALLOC_SIZE) {
+        return NULL;
+    }
+
+    vmalloc_area_t *area = (vmalloc_area_t*)kmem_cache_alloc(vmalloc_state.area_cache);
+    if (!area) {
+        return NULL;
+    }
+
+    area->pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!area_reserve(area)) {
+        console_print("[VMALLOC] ERROR: Address space exhausted\n");
+        kmem_cache_free(vmalloc_state.area_cache, area);
+        return NULL;
+    }
+
+    // The area is reserved, so pages can be mapped without the lock
+    for (uint64_t i = 0; i < area->pages; i++) {
+        uint64_t virt = area->start + i * PAGE_SIZE;
+        uint64_t phys = pmm_alloc_frame();
+
+        if (phys == 0 || !vmm_map_page(virt, phys, PTE_KERNEL_FLAGS)) {
+            console_print("[VMALLOC] ERROR: Out of memory\n");
+            if (phys) {
+                pmm_free_frame(phys);
+            }
+            area_unmap(area->start, i);
+            area_remove(area->start);
+            kmem_cache_free(vmalloc_state.area_cache, area);
+            return NULL;
+        }
+
+        // Only reached through this mapping, so compaction may move it
+        page_t *page = pmm_page(phys);
+        if (page) {
+            page->owner = PAGE_OWNER_VMALLOC;
+            page->flags |= PAGE_FLAG_MOVABLE;
+            page->mapcount = 1;
+            page->private = virt;
+        }
+    }
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    vmalloc_state.stats.num_allocations++;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    return (void*)area->start;
+}
+
+/**
+ * Free a buffer allocated with vmalloc()
+ */
+void vfree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    uint64_t pages = vmalloc_size(ptr) / PAGE_SIZE;
+    if (pages == 0) {
+        console_print("[VMALLOC] ERROR: Invalid pointer in vfree\n");
+        return;
+    }
+
+    // Unmap while the area is still listed, so the range can't be
+    // handed out again before its PTEs are clear
+    area_unmap((uint64_t)ptr, pages);
+    vmalloc_area_t *area = area_remove((uint64_t)ptr);
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    vmalloc_state.stats.num_frees++;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    kmem_cache_free(vmalloc_state.area_cache, area);
+}
+
+/**
+ * Check whether a pointer lies in the vmalloc region
+ */
+bool is_vmalloc_addr(const void *ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    return addr >= VMALLOC_START && addr < VMALLOC_END;
+}
+
+/**
+ * Get the usable size of a vmalloc() buffer
+ *
+ * @return 0 if ptr is not the start of an area
+ */
+uint64_t vmalloc_size(const void *ptr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    vmalloc_area_t **link = area_find((uint64_t)ptr);
+    uint64_t size = link ? (*link)->pages * PAGE_SIZE : 0;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return size;
+}
+
+/**
+ * Initialize the vmalloc region
+ * Needs the slab allocator for area descriptors
+ */
+void vmalloc_init(void) {
+    console_print("[VMALLOC] Initializing vmalloc region...\n");
+
+    vmalloc_state.area_cache = kmem_cache_create("vmalloc_area", sizeof(vmalloc_area_t), 0, NULL);
+    if (!vmalloc_state.area_cache) {
+        console_print("[VMALLOC] ERROR: Failed to create area cache\n");
+        return;
+    }
+
+    // Create the region's top-level tables now so every address space
+    // that copies the kernel's PML4 entries shares them
+    if (!vmm_get_pte(VMALLOC_START, true)) {
+        console_print("[VMALLOC] ERROR: Failed to create region page tables\n");
+        return;
+    }
+
+    vmalloc_state.areas = NULL;
+    vmalloc_state.initialized = true;
+
+    console_print("[VMALLOC] Region at ");
+    console_print_hex(VMALLOC_START);
+    console_print(", ");
+    console_print_dec(VMALLOC_SIZE >> 30);
+    console_print(" GB\n");
+}
+
+/**
+ * Print vmalloc statistics
+ */
+void vmalloc_print_stats(void) {
+    console_print("\n[VMALLOC] Statistics:\n");
+    console_print("  Areas:         ");
+    console_print_dec(vmalloc_state.stats.num_areas);
+    console_print("\n  Mapped:        ");
+    console_print_dec(vmalloc_state.stats.mapped_pages * PAGE_SIZE / 1024);
+    console_print(" KB\n  Allocations:   ");
+    console_print_dec(vmalloc_state.stats.num_allocations);
+    console_print("\n  Frees:         ");
+    console_print_dec(vmalloc_state.stats.num_frees);
+    console_print("\n");
+}
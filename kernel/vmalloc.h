@@ -0,0 +1,42 @@
+/**
+ * AuroraOS Kernel - Virtually Contiguous Allocations
+ *
+ * Large kernel buffers mapped page by page into a higher-half region,
+ * backed by frames that need not be physically contiguous
+ */
+
+#ifndef _KERNEL_VMALLOC_H_
+#define _KERNEL_VMALLOC_H_
+
+#include "types.h"
+
+// vmalloc region (PML4 slot 402, clear of the identity map and the
+// recursive slot)
+#define VMALLOC_START       0xFFFFC90000000000ULL
+#define VMALLOC_SIZE        (64ULL << 30)             // 64GB
+#define VMALLOC_END         (VMALLOC_START + VMALLOC_SIZE)
+#define VMALLOC_GUARD_PAGES 1                         // Unmapped pages after each area
+
+// vmalloc statistics
+typedef struct {
+    uint64_t num_areas;         // Live areas
+    uint64_t mapped_pages;      // Pages backing live areas
+    uint64_t num_allocations;   // Total allocations
+    uint64_t num_frees;         // Total frees
+} vmalloc_stats_t;
+
+// Initialization
+void vmalloc_init(void);
+
+// Allocation
+void* vmalloc(uint64_t size);
+void  vfree(void *ptr);
+
+// Queries
+bool is_vmalloc_addr(const void *ptr);
+uint64_t vmalloc_size(const void *ptr);
+
+// Debugging and statistics
+void vmalloc_print_stats(void);
+
+#endif // _KERNEL_VMALLOC_H_
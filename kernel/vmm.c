@@ -10,6 +10,8 @@
 #include "types.h"
 #include "boot.h"
 #include "io.h"
+#include "cpu.h"
+#include "spinlock.h"
 
 // Serial debug helper (COM1 = 0x3F8)
 static inline void serial_debug_char(char c) {
@@ -26,6 +28,9 @@ static inline void serial_debug_str(const char *s) {
 static page_table_t *kernel_pml4 = NULL;
 static bool vmm_initialized = false;
 
+// 1GB pages can be mapped (CPUID.80000001H:EDX.Page1GB)
+static bool gbpages_supported = false;
+
 // VMM state
 static struct {
     uint64_t pml4_physical;
@@ -34,6 +39,31 @@ static struct {
     uint64_t page_tables_allocated;
 } vmm_state = {0};
 
+// Address spaces, indexed by ID. A space's ID doubles as its PCID when
+// CR4.PCIDE is set, so its TLB entries survive switches to other spaces
+static struct {
+    uint64_t pml4;              // PML4 physical address, 0 if the ID is free
+    uint64_t flush_gen;         // space_state.flush_gen when its entries were last flushed
+} spaces[VMM_MAX_SPACES];
+
+static struct {
+    bool pcid;                  // PCIDs are enabled
+    bool invpcid;               // INVPCID is available
+    uint64_t flush_gen;         // Bumped by every flush of kernel-half translations
+    uint64_t current[MAX_CPUS]; // CR3 value loaded on each CPU
+    uint32_t next_id;           // Where the next ID search starts
+    uint32_t num_spaces;        // Live address spaces, not counting the kernel's
+    uint64_t switches;          // Address space switches
+    uint64_t full_flushes;      // Switches that flushed the new space's TLB entries
+} space_state = {0};
+
+// Protects spaces[] and the ID allocator
+static spinlock_t space_lock = SPINLOCK_INIT;
+
+// INVPCID types
+#define INVPCID_ADDRESS 0   // One address in one PCID
+#define INVPCID_CONTEXT 1   // All non-global entries of one PCID
+
 // Use boot page tables from entry.S instead of creating new ones!
 // These are already set up and working, no need to reinvent the wheel.
 extern page_table_t pml4_table;
@@ -45,8 +75,8 @@ extern page_table_t pd_table;
 #define ALIGN_UP(addr, align)   (((addr) + (align) - 1) & ~((align) - 1))
 #define IS_ALIGNED(addr, align) (((addr) & ((align) - 1)) == 0)
 
-#define PTE_ADDR_MASK  0x000FFFFFFFFFF000ULL  // Physical address bits
-#define PTE_FLAGS_MASK 0xFFF0000000000FFFULL  // Flag bits
+#define HUGE_PAGE_SIZE 0x200000ULL    // 2MB
+#define GIGA_PAGE_SIZE 0x40000000ULL  // 1GB
 
 // Extract physical address from PTE
 static inline uint64_t pte_get_addr(pte_t pte) {
@@ -58,6 +88,39 @@ static inline pte_t pte_create(uint64_t phys_addr, uint64_t flags) {
     return (phys_addr & PTE_ADDR_MASK) | (flags & PTE_FLAGS_MASK);
 }
 
+// Check whether an address lies in the per-process half of a PML4
+static inline bool is_user_addr(uint64_t addr) {
+    return addr >= VMM_USER_START && addr < VMM_USER_END;
+}
+
+// Check whether a PML4 slot belongs to the per-process half
+static inline bool is_user_slot(uint32_t slot) {
+    return slot >= (VMM_USER_START >> 39) && slot < (VMM_USER_END >> 39);
+}
+
+// Invalidate TLB entries tagged with a PCID
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = { pcid, addr };
+    __asm__ __volatile__("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+/**
+ * Note that kernel-half translations were flushed on this CPU
+ * invlpg and CR3 reloads only drop entries tagged with the current PCID,
+ * so every other space is marked stale and flushed when next switched to
+ */
+static void kernel_tlb_flushed(void) {
+    if (!space_state.pcid) {
+        return;
+    }
+
+    uint64_t gen = __atomic_add_fetch(&space_state.flush_gen, 1, __ATOMIC_RELAXED);
+    spaces[space_state.current[cpu_current_id()] & CR3_PCID_MASK].flush_gen = gen;
+}
+
 /**
  * Parse virtual address into components
  */
@@ -103,6 +166,7 @@ void vmm_flush_tlb(void) {
         "movq %%rax, %%cr3\n"
         ::: "rax"
     );
+    kernel_tlb_flushed();
 }
 
 /**
@@ -114,135 +178,401 @@ void vmm_flush_tlb_single(uint64_t virt_addr) {
         :: "r"(virt_addr)
         : "memory"
     );
+
+    if (!is_user_addr(virt_addr)) {
+        kernel_tlb_flushed();
+    }
 }
 
 /**
- * Get page table entry for virtual address
- * Creates intermediate tables if needed
- *
- * @param virt_addr Virtual address
- * @param create If true, create missing page tables
- * @return Pointer to PTE or NULL if not present and create=false
+ * Flush TLB entries for a range, falling back to a full flush for large ranges
  */
-pte_t* vmm_get_pte(uint64_t virt_addr, bool create) {
-    if (!vmm_initialized) {
-        console_print("[DEBUG] vmm_get_pte: VMM not initialized!\n");
-        return NULL;
+void vmm_flush_tlb_range(uint64_t virt_addr, uint64_t size) {
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, vmm_current_address_space());
+    vmm_gather_range(&tlb, virt_addr, size);
+    vmm_gather_finish(&tlb);
+}
+
+/**
+ * Start a batch of TLB invalidations for an address space
+ */
+void vmm_gather_init(mmu_gather_t *tlb, uint64_t cr3) {
+    tlb->cr3 = cr3;
+    tlb->count = 0;
+    tlb->flush_all = false;
+    tlb->kernel = false;
+    tlb->user = false;
+    tlb->freed = PAGE_LRU_NONE;
+    tlb->num_pages = 0;
+}
+
+/**
+ * Record a page whose translation changed
+ * A 2MB or 1GB page needs only one entry, at any address inside it
+ */
+void vmm_gather_page(mmu_gather_t *tlb, uint64_t virt_addr) {
+    if (is_user_addr(virt_addr)) {
+        tlb->user = true;
+    } else {
+        tlb->kernel = true;
     }
 
-    virt_addr_t vaddr = vmm_parse_address(virt_addr);
+    if (tlb->flush_all) {
+        return;
+    }
+    if (tlb->count == VMM_FLUSH_ALL_THRESHOLD) {
+        tlb->flush_all = true;  // One full flush is now cheaper
+        return;
+    }
+    tlb->addrs[tlb->count++] = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+}
 
-    // Walk PML4
-    pte_t *pml4_entry = &kernel_pml4->entries[vaddr.pml4_index];
-    page_table_t *pdpt;
+/**
+ * Record a range of 4KB pages whose translations changed
+ */
+void vmm_gather_range(mmu_gather_t *tlb, uint64_t virt_addr, uint64_t size) {
+    uint64_t virt_end = ALIGN_UP(virt_addr + size, PAGE_SIZE);
 
-    if (!(*pml4_entry & PTE_PRESENT)) {
-        if (!create) return NULL;
+    for (uint64_t v = ALIGN_DOWN(virt_addr, PAGE_SIZE); v < virt_end && !tlb->flush_all; v += PAGE_SIZE) {
+        vmm_gather_page(tlb, v);
+    }
+}
 
-        // Allocate new PDPT
-        uint64_t pdpt_phys = pmm_alloc_frame();
-        if (pdpt_phys == 0) return NULL;
+/**
+ * Free a frame once the batch has been flushed, because stale TLB
+ * entries may still point at it until then
+ * Frames are chained through their page descriptors' lru_next
+ */
+void vmm_gather_free_frame(mmu_gather_t *tlb, uint64_t phys_addr) {
+    page_t *page = pmm_page(phys_addr);
+    if (!page) {
+        // No descriptor to chain through; flush what we have now
+        vmm_gather_finish(tlb);
+        pmm_free_frame(phys_addr);
+        return;
+    }
 
-        *pml4_entry = pte_create(pdpt_phys, PTE_KERNEL_FLAGS);
-        vmm_state.page_tables_allocated++;
+    page->lru_next = tlb->freed;
+    tlb->freed = (uint32_t)ADDR_TO_PAGE(phys_addr);
+}
+
+/**
+ * Drop a reference on a user frame once the batch has been flushed
+ * Other address spaces may share the frame, so it is released with
+ * pmm_page_put() rather than freed. A full batch is flushed early
+ */
+void vmm_gather_put_page(mmu_gather_t *tlb, page_t *page) {
+    if (tlb->num_pages == VMM_GATHER_PAGES) {
+        vmm_gather_finish(tlb);
+    }
+    tlb->pages[tlb->num_pages++] = page;
+}
+
+/**
+ * Flush every TLB entry the batch may have left stale in its address
+ * space, given that it covered too many pages to flush one by one
+ */
+static void gather_flush_all(mmu_gather_t *tlb) {
+    bool loaded = tlb->cr3 == space_state.current[cpu_current_id()];
 
-        // No need to zero - garbage in unused entries is safe (they're never accessed)
-        pdpt = (page_table_t*)pdpt_phys;
+    if (tlb->kernel || (tlb->user && loaded)) {
+        vmm_flush_tlb();
+    }
+    if (!tlb->user || loaded || !space_state.pcid) {
+        return;  // Without PCIDs, loading the space flushes it anyway
+    }
+
+    uint32_t id = (uint32_t)(tlb->cr3 & CR3_PCID_MASK);
+    if (space_state.invpcid) {
+        invpcid(INVPCID_CONTEXT, id, 0);
     } else {
-        pdpt = (page_table_t*)pte_get_addr(*pml4_entry);
+        spaces[id].flush_gen = 0;
     }
+}
 
-    // Walk PDPT
-    pte_t *pdpt_entry = &pdpt->entries[vaddr.pdpt_index];
-    page_table_t *pd;
+/**
+ * Flush the batch, with targeted invlpgs or one full flush past
+ * VMM_FLUSH_ALL_THRESHOLD pages, then free its frames
+ * The batch is reset and can be reused
+ */
+void vmm_gather_finish(mmu_gather_t *tlb) {
+    if (tlb->flush_all) {
+        gather_flush_all(tlb);
+    } else {
+        for (uint32_t i = 0; i < tlb->count; i++) {
+            vmm_space_flush_page(tlb->cr3, tlb->addrs[i]);
+        }
+    }
 
-    if (!(*pdpt_entry & PTE_PRESENT)) {
-        if (!create) return NULL;
+    // With more CPUs, this is where the batch would be shot down on every
+    // other CPU that has the address space (or, for kernel pages, any
+    // address space) loaded, in one round of IPIs
 
-        // Allocate new PD
-        uint64_t pd_phys = pmm_alloc_frame();
-        if (pd_phys == 0) return NULL;
+    while (tlb->freed != PAGE_LRU_NONE) {
+        uint64_t phys = PAGE_TO_ADDR((uint64_t)tlb->freed);
+        page_t *page = pmm_page(phys);
+        tlb->freed = page->lru_next;
+        page->lru_next = PAGE_LRU_NONE;
+        pmm_free_frame(phys);
+    }
 
-        *pdpt_entry = pte_create(pd_phys, PTE_KERNEL_FLAGS);
-        vmm_state.page_tables_allocated++;
+    for (uint32_t i = 0; i < tlb->num_pages; i++) {
+        pmm_page_put(tlb->pages[i]);
+    }
 
-        // No need to zero - garbage in unused entries is safe (they're never accessed)
-        pd = (page_table_t*)pd_phys;
-    } else {
-        // Check if this is a huge page (1GB)
-        if (*pdpt_entry & PTE_HUGE) {
-            // Cannot get PTE for huge page - would need to split it first
-            console_print("[DEBUG] vmm_get_pte: Cannot access 1GB huge page\n");
-            return NULL;
+    tlb->num_pages = 0;
+    tlb->count = 0;
+    tlb->flush_all = false;
+    tlb->kernel = false;
+    tlb->user = false;
+}
+
+/**
+ * Allocate a zeroed frame for a paging structure
+ */
+static uint64_t alloc_page_table(void) {
+    uint64_t phys = pmm_alloc_zeroed_frame();
+    if (phys == 0) {
+        return 0;
+    }
+
+    page_t *page = pmm_page(phys);
+    if (page) {
+        page->owner = PAGE_OWNER_PAGE_TABLE;
+    }
+    return phys;
+}
+
+/**
+ * Move a movable page to a new frame (compaction callback)
+ * Both frames are copied through the identity map, then the single
+ * mapping recorded in page->private is pointed at the new one. User pages
+ * carry their space's PCID in the low bits; kernel pages have PCID 0.
+ */
+static bool vmm_migrate_page(page_t *page, uint64_t old_addr, uint64_t new_addr) {
+    uint32_t id = (uint32_t)(page->private & CR3_PCID_MASK);
+    uint64_t virt = page->private & ~CR3_PCID_MASK;
+    if (spaces[id].pml4 == 0) {
+        return false;
+    }
+    uint64_t cr3 = spaces[id].pml4 | id;
+
+    pte_t *pte = vmm_space_get_pte(cr3, virt, false);
+    if (!pte || !(*pte & PTE_PRESENT) || pte_get_addr(*pte) != old_addr) {
+        return false;
+    }
+
+    uint64_t *src = (uint64_t*)old_addr;
+    uint64_t *dst = (uint64_t*)new_addr;
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        dst[i] = src[i];
+    }
+
+    *pte = pte_create(new_addr, *pte & PTE_FLAGS_MASK);
+    vmm_space_flush_page(cr3, virt);
+    return true;
+}
+
+/**
+ * Copy a new kernel-half PML4 entry into every address space
+ * Spaces copy the kernel half when they are created, so only slots that
+ * appear afterwards need this
+ */
+static void sync_kernel_slot(uint32_t slot) {
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    for (uint32_t id = 1; id < VMM_MAX_SPACES; id++) {
+        if (spaces[id].pml4) {
+            ((page_table_t*)spaces[id].pml4)->entries[slot] = kernel_pml4->entries[slot];
         }
-        pd = (page_table_t*)pte_get_addr(*pdpt_entry);
     }
+    spin_unlock_irqrestore(&space_lock, flags);
+}
 
-    // Walk PD
-    pte_t *pd_entry = &pd->entries[vaddr.pd_index];
-    page_table_t *pt;
+/**
+ * Get the PML4 that translates virt_addr in address space cr3
+ * The kernel half is shared, so it is always walked through the kernel's
+ * own PML4
+ */
+static page_table_t* space_pml4(uint64_t cr3, uint64_t virt_addr) {
+    return is_user_addr(virt_addr) ? (page_table_t*)(cr3 & PTE_ADDR_MASK) : kernel_pml4;
+}
 
-    if (!(*pd_entry & PTE_PRESENT)) {
-        if (!create) return NULL;
+// Index of the entry for an address in a table at the given level
+// (4 = PML4, 3 = PDPT, 2 = PD, 1 = PT)
+static inline uint32_t table_index(uint64_t virt_addr, int level) {
+    return (virt_addr >> (PAGE_SHIFT + 9 * (level - 1))) & 0x1FF;
+}
 
-        // Allocate new PT
-        uint64_t pt_phys = pmm_alloc_frame();
-        if (pt_phys == 0) return NULL;
+// Bytes mapped by one entry at the given level
+static inline uint64_t level_size(int level) {
+    return (uint64_t)PAGE_SIZE << (9 * (level - 1));
+}
 
-        *pd_entry = pte_create(pt_phys, PTE_KERNEL_FLAGS);
-        vmm_state.page_tables_allocated++;
+/**
+ * Split a 1GB or 2MB page into a table of the next smaller page size
+ * mapping the same memory with the same flags
+ * The old large-page entry is invalidated through tlb, or right away
+ * if there is no batch
+ *
+ * @param level Level of the entry being split (3 = PDPT, 2 = PD)
+ */
+static bool split_huge_page(uint64_t cr3, pte_t *entry, uint64_t virt_addr, int level,
+                            uint64_t table_flags, mmu_gather_t *tlb) {
+    uint64_t table_phys = alloc_page_table();
+    if (table_phys == 0) {
+        return false;
+    }
+
+    uint64_t phys_base = pte_get_addr(*entry);
+    uint64_t flags = *entry & PTE_FLAGS_MASK;
+    if (level == 2) {
+        flags &= ~PTE_HUGE;  // 4KB entries use bit 7 for PAT
+    }
 
-        // Zero out the new table
-        // DISABLED: 512-iteration loop causes stack overflow!
-        // PMM should ideally return zeroed pages, but for now we accept garbage in unused entries.
-        // Only entries we explicitly map will be set, unmapped entries remain garbage (but not accessed).
-        pt = (page_table_t*)pt_phys;
-        // for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
-        //     pt->entries[i] = 0;
-        // }
+    page_table_t *table = (page_table_t*)table_phys;
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        table->entries[i] = pte_create(phys_base + i * level_size(level - 1), flags);
+    }
+
+    *entry = pte_create(table_phys, table_flags);
+    vmm_state.page_tables_allocated++;
+
+    // The translations are unchanged, but the CPU must stop using the
+    // large-page entry; one invlpg anywhere inside it drops it
+    if (tlb) {
+        vmm_gather_page(tlb, virt_addr);
     } else {
-        // Check if this is a huge page (2MB)
-        if (*pd_entry & PTE_HUGE) {
-            // Split the huge page into 512 regular 4KB pages
-            // This is necessary when we need fine-grained mapping control
+        vmm_space_flush_page(cr3, virt_addr);
+    }
+    return true;
+}
 
-            if (!create) {
-                return NULL;  // Can't split without create permission
-            }
+/**
+ * Walk an address space down to the entry for a virtual address at a
+ * given level
+ * Creates intermediate tables if needed, splitting larger pages that
+ * cover the address; user-half tables are created user-accessible,
+ * leaving access control to the leaf entry
+ *
+ * @param level 1 for a 4KB PTE, 2 for a 2MB PD entry, 3 for a 1GB PDPT entry
+ * @param tlb Batch that collects invalidations for split pages, or NULL
+ * @return Pointer to the entry or NULL if not present and create=false
+ */
+static pte_t* page_walk(uint64_t cr3, uint64_t virt_addr, bool create, int level,
+                        mmu_gather_t *tlb) {
+    uint64_t table_flags = is_user_addr(virt_addr) ? PTE_USER_FLAGS : PTE_KERNEL_FLAGS;
+    pte_t *entry = &space_pml4(cr3, virt_addr)->entries[table_index(virt_addr, 4)];
 
-            // Get the base physical address of the huge page
-            uint64_t huge_phys_base = pte_get_addr(*pd_entry);
-            uint64_t huge_flags = *pd_entry & PTE_FLAGS_MASK;
+    for (int l = 4; l > level; l--) {
+        if (!(*entry & PTE_PRESENT)) {
+            if (!create) return NULL;
 
-            // Allocate new PT
-            uint64_t pt_phys = pmm_alloc_frame();
-            if (pt_phys == 0) {
+            // Allocate the next table (zeroed, so unused entries are not-present)
+            uint64_t table_phys = alloc_page_table();
+            if (table_phys == 0) return NULL;
+
+            *entry = pte_create(table_phys, table_flags);
+            vmm_state.page_tables_allocated++;
+
+            if (l == 4 && !is_user_slot(table_index(virt_addr, 4))) {
+                sync_kernel_slot(table_index(virt_addr, 4));
+            }
+        } else if (*entry & PTE_HUGE) {
+            // Splitting needs create permission
+            if (!create || !split_huge_page(cr3, entry, virt_addr, l, table_flags, tlb)) {
                 return NULL;
             }
+        }
 
-            pt = (page_table_t*)pt_phys;
+        page_table_t *table = (page_table_t*)pte_get_addr(*entry);
+        entry = &table->entries[table_index(virt_addr, l - 1)];
+    }
 
-            // Populate PT with 512 entries, each mapping a 4KB chunk of the huge page
-            for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
-                uint64_t page_phys = huge_phys_base + (i * PAGE_SIZE);
-                // Preserve flags but remove HUGE bit
-                uint64_t page_flags = (huge_flags & ~PTE_HUGE) | PTE_PRESENT | PTE_WRITE;
-                pt->entries[i] = pte_create(page_phys, page_flags);
-            }
+    return entry;
+}
 
-            // Replace huge page entry with PT pointer
-            *pd_entry = pte_create(pt_phys, PTE_KERNEL_FLAGS);
-            vmm_state.page_tables_allocated++;
+/**
+ * Find the leaf entry mapping a virtual address, whatever its page size
+ *
+ * @param level Set to the level of the entry found, or of the first
+ *              missing entry if the address is unmapped
+ * @return Pointer to the present leaf entry, or NULL if unmapped
+ */
+static pte_t* page_lookup(uint64_t cr3, uint64_t virt_addr, int *level) {
+    pte_t *entry = &space_pml4(cr3, virt_addr)->entries[table_index(virt_addr, 4)];
 
-            // Flush TLB to ensure CPU sees the new page table structure
-            vmm_flush_tlb();
-        } else {
-            pt = (page_table_t*)pte_get_addr(*pd_entry);
+    for (int l = 4; l >= 1; l--) {
+        if (!(*entry & PTE_PRESENT)) {
+            *level = l;
+            return NULL;
+        }
+        if (l == 1 || (l < 4 && (*entry & PTE_HUGE))) {
+            *level = l;
+            return entry;
+        }
+
+        page_table_t *table = (page_table_t*)pte_get_addr(*entry);
+        entry = &table->entries[table_index(virt_addr, l - 1)];
+    }
+    return NULL;
+}
+
+/**
+ * Free a paging structure and every table below it
+ * Mappings through it are dropped; the frames they mapped are released
+ * only if put_user is set and a user mapping owns them
+ *
+ * @param level 3 for a PDPT, 2 for a PD, 1 for a PT
+ * @param tlb Batch that frees the tables once flushed, or NULL to free
+ *            them now (the tables must no longer be reachable by the CPU)
+ */
+static void free_table(uint64_t table_phys, int level, bool put_user, mmu_gather_t *tlb) {
+    page_table_t *table = (page_table_t*)table_phys;
+
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        pte_t entry = table->entries[i];
+        if (!(entry & PTE_PRESENT)) {
+            continue;
+        }
+
+        if (level > 1 && !(entry & PTE_HUGE)) {
+            free_table(pte_get_addr(entry), level - 1, put_user, tlb);
+            continue;
+        }
+
+        page_t *page = put_user ? pmm_page(pte_get_addr(entry)) : NULL;
+        if (page && page->owner == PAGE_OWNER_USER) {
+            __atomic_sub_fetch(&page->mapcount, 1, __ATOMIC_RELAXED);
+            pmm_page_put(page);
         }
+        vmm_state.mapped_pages -= level_size(level) / PAGE_SIZE;
     }
 
-    // Return pointer to final PT entry
-    return &pt->entries[vaddr.pt_index];
+    if (tlb) {
+        vmm_gather_free_frame(tlb, table_phys);
+    } else {
+        pmm_free_frame(table_phys);
+    }
+    vmm_state.page_tables_allocated--;
+}
+
+/**
+ * Get page table entry for virtual address
+ * User-half addresses resolve in the address space loaded on this CPU
+ * Creates intermediate tables if needed
+ *
+ * @param virt_addr Virtual address
+ * @param create If true, create missing page tables
+ * @return Pointer to PTE or NULL if not present and create=false
+ */
+pte_t* vmm_get_pte(uint64_t virt_addr, bool create) {
+    if (!vmm_initialized) {
+        console_print("[DEBUG] vmm_get_pte: VMM not initialized!\n");
+        return NULL;
+    }
+
+    return page_walk(space_state.current[cpu_current_id()], virt_addr, create, 1, NULL);
 }
 
 /**
@@ -266,17 +596,16 @@ bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
 
     // Check if already mapped
     if (*pte & PTE_PRESENT) {
-        // Already mapped - update flags
+        // Already mapped - update flags, and drop the old translation
         *pte = pte_create(phys_addr, flags | PTE_PRESENT);
+        vmm_flush_tlb_single(virt_addr);
     } else {
-        // New mapping
+        // New mapping; not-present entries are never cached, so there
+        // is nothing to flush
         *pte = pte_create(phys_addr, flags | PTE_PRESENT);
         vmm_state.mapped_pages++;
     }
 
-    // Flush TLB for this page
-    vmm_flush_tlb_single(virt_addr);
-
     return true;
 }
 
@@ -298,57 +627,710 @@ bool vmm_unmap_page(uint64_t virt_addr) {
     return true;
 }
 
+/**
+ * Unmap a single page without flushing the TLB
+ * The caller must flush the page before its frame is reused
+ *
+ * @return Physical address that was mapped, or 0 if none
+ */
+uint64_t vmm_clear_pte(uint64_t virt_addr) {
+    pte_t *pte = vmm_get_pte(ALIGN_DOWN(virt_addr, PAGE_SIZE), false);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return 0;
+    }
+
+    uint64_t phys = pte_get_addr(*pte);
+    *pte = 0;
+    vmm_state.mapped_pages--;
+    return phys;
+}
+
 /**
  * Get physical address for virtual address
  */
 uint64_t vmm_get_physical(uint64_t virt_addr) {
-    uint64_t offset = virt_addr & 0xFFF;
-    virt_addr = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+    if (!vmm_initialized) {
+        return 0;
+    }
 
-    pte_t *pte = vmm_get_pte(virt_addr, false);
-    if (!pte || !(*pte & PTE_PRESENT)) {
+    int level;
+    pte_t *pte = page_lookup(space_state.current[cpu_current_id()], virt_addr, &level);
+    if (!pte) {
         return 0;
     }
 
-    return pte_get_addr(*pte) + offset;
+    return pte_get_addr(*pte) + (virt_addr & (level_size(level) - 1));
 }
 
 /**
- * Map a range of pages
+ * Map one page of the size given by level (1 = 4KB, 2 = 2MB, 3 = 1GB)
+ * Whatever mapped the range before is replaced, including tables of
+ * smaller pages, which tlb frees once it has been flushed
  */
-bool vmm_map_range(uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags) {
-    uint64_t virt_end = virt_addr + size;
+static bool map_leaf(mmu_gather_t *tlb, uint64_t virt_addr, uint64_t phys_addr,
+                     uint64_t flags, int level) {
+    pte_t *entry = page_walk(tlb->cr3, virt_addr, true, level, tlb);
+    if (!entry) {
+        return false;
+    }
+
+    pte_t old = *entry;
+    *entry = pte_create(phys_addr, (flags & ~PTE_HUGE) | PTE_PRESENT | (level > 1 ? PTE_HUGE : 0));
+
+    if (!(old & PTE_PRESENT)) {
+        vmm_state.mapped_pages += level_size(level) / PAGE_SIZE;
+    } else if (level > 1 && !(old & PTE_HUGE)) {
+        vmm_gather_range(tlb, virt_addr, level_size(level));
+        free_table(pte_get_addr(old), level - 1, false, tlb);
+        vmm_state.mapped_pages += level_size(level) / PAGE_SIZE;
+    } else {
+        vmm_gather_page(tlb, virt_addr);
+    }
+    return true;
+}
+
+/**
+ * Map a physically contiguous range using the largest pages that
+ * alignment allows: 4KB at unaligned edges, 2MB and (when the CPU
+ * supports them) 1GB pages in between
+ * Replaced translations are flushed together at the end
+ */
+static bool map_range(uint64_t cr3, uint64_t virt_addr, uint64_t phys_addr,
+                      uint64_t size, uint64_t flags) {
+    uint64_t virt_end = ALIGN_UP(virt_addr + size, PAGE_SIZE);
+    bool ok = true;
 
-    // Align start down and end up
     virt_addr = ALIGN_DOWN(virt_addr, PAGE_SIZE);
     phys_addr = ALIGN_DOWN(phys_addr, PAGE_SIZE);
-    virt_end = ALIGN_UP(virt_end, PAGE_SIZE);
 
-    for (uint64_t v = virt_addr, p = phys_addr; v < virt_end; v += PAGE_SIZE, p += PAGE_SIZE) {
-        if (!vmm_map_page(v, p, flags)) {
-            return false;
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, cr3);
+
+    while (virt_addr < virt_end) {
+        int level = 1;
+        for (int l = gbpages_supported ? 3 : 2; l > 1; l--) {
+            if (IS_ALIGNED(virt_addr | phys_addr, level_size(l)) &&
+                virt_end - virt_addr >= level_size(l)) {
+                level = l;
+                break;
+            }
         }
+
+        if (!map_leaf(&tlb, virt_addr, phys_addr, flags, level)) {
+            ok = false;
+            break;
+        }
+        virt_addr += level_size(level);
+        phys_addr += level_size(level);
     }
 
-    return true;
+    vmm_gather_finish(&tlb);
+    return ok;
+}
+
+/**
+ * Find the next leaf entry of a range, starting at *virt_addr
+ * Unmapped stretches are skipped a whole table at a time, and a large
+ * page the range only partly covers is split first
+ *
+ * @param virt_addr Advanced to the address the entry maps
+ * @param level Set to the level of the entry
+ * @return The entry, or NULL at the end of the range (or if a split failed)
+ */
+static pte_t* range_next_leaf(mmu_gather_t *tlb, uint64_t *virt_addr, uint64_t virt_end,
+                              int *level) {
+    while (*virt_addr < virt_end) {
+        uint64_t v = *virt_addr;
+        pte_t *entry = page_lookup(tlb->cr3, v, level);
+
+        if (!entry) {
+            uint64_t next = ALIGN_DOWN(v, level_size(*level)) + level_size(*level);
+            if (next <= v) {
+                return NULL;  // Wrapped past the top of the address space
+            }
+            *virt_addr = next;
+            continue;
+        }
+
+        if (*level > 1 && (!IS_ALIGNED(v, level_size(*level)) || virt_end - v < level_size(*level))) {
+            if (!page_walk(tlb->cr3, v, true, 1, tlb)) {
+                console_print("[VMM] ERROR: Out of memory splitting a large page\n");
+                return NULL;
+            }
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Unmap a range, clearing whole large pages it covers and splitting the
+ * ones it only partly covers, then flush it once
+ *
+ * @param put_user Release frames owned by user mappings once flushed;
+ *                 other frames are never freed
+ */
+static void unmap_range(uint64_t cr3, uint64_t virt_addr, uint64_t size, bool put_user) {
+    uint64_t virt_end = ALIGN_UP(virt_addr + size, PAGE_SIZE);
+    uint64_t v = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+    int level;
+    pte_t *entry;
+
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, cr3);
+
+    while ((entry = range_next_leaf(&tlb, &v, virt_end, &level))) {
+        page_t *page = put_user ? pmm_page(pte_get_addr(*entry)) : NULL;
+
+        *entry = 0;
+        vmm_state.mapped_pages -= level_size(level) / PAGE_SIZE;
+        vmm_gather_page(&tlb, v);
+
+        if (page && page->owner == PAGE_OWNER_USER) {
+            __atomic_sub_fetch(&page->mapcount, 1, __ATOMIC_RELAXED);
+            vmm_gather_put_page(&tlb, page);
+        }
+        v += level_size(level);
+    }
+
+    vmm_gather_finish(&tlb);
+}
+
+/**
+ * Change the access of every page mapped in a range, splitting large
+ * pages it only partly covers, then flush it once
+ * Only PTE_WRITE and PTE_USER are taken from flags; copy-on-write pages
+ * stay read-only until they are copied
+ */
+static void protect_range(uint64_t cr3, uint64_t virt_addr, uint64_t size, uint64_t flags) {
+    uint64_t virt_end = ALIGN_UP(virt_addr + size, PAGE_SIZE);
+    uint64_t v = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+    int level;
+    pte_t *entry;
+
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, cr3);
+
+    while ((entry = range_next_leaf(&tlb, &v, virt_end, &level))) {
+        pte_t old = *entry;
+        pte_t new = (old & ~(PTE_WRITE | PTE_USER)) | (flags & PTE_USER);
+        if ((flags & PTE_WRITE) && !(old & PTE_COW)) {
+            new |= PTE_WRITE;
+        }
+
+        if (new != old) {
+            *entry = new;
+            vmm_gather_page(&tlb, v);
+        }
+        v += level_size(level);
+    }
+
+    vmm_gather_finish(&tlb);
+}
+
+/**
+ * Map a range of pages
+ * Physically contiguous, so large pages are used wherever they fit
+ */
+bool vmm_map_range(uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags) {
+    if (!vmm_initialized) {
+        return false;
+    }
+    return map_range(space_state.current[cpu_current_id()], virt_addr, phys_addr, size, flags);
+}
+
+/**
+ * Map a physically contiguous range into an address space, using large
+ * pages wherever they fit
+ */
+bool vmm_space_map_range(uint64_t cr3, uint64_t virt_addr, uint64_t phys_addr,
+                         uint64_t size, uint64_t flags) {
+    if (!vmm_initialized) {
+        return false;
+    }
+    return map_range(cr3, virt_addr, phys_addr, size, flags);
 }
 
 /**
  * Unmap a range of pages
  */
 bool vmm_unmap_range(uint64_t virt_addr, uint64_t size) {
-    uint64_t virt_end = virt_addr + size;
+    if (!vmm_initialized) {
+        return false;
+    }
+    unmap_range(space_state.current[cpu_current_id()], virt_addr, size, false);
+    return true;
+}
+
+/**
+ * Unmap a range of an address space, releasing the user frames it maps
+ */
+void vmm_space_unmap_range(uint64_t cr3, uint64_t virt_addr, uint64_t size) {
+    if (vmm_initialized) {
+        unmap_range(cr3, virt_addr, size, true);
+    }
+}
+
+/**
+ * Change the access of the pages mapped in a range of an address space
+ *
+ * @param flags PTE_WRITE and PTE_USER as the pages should have them
+ */
+void vmm_space_protect_range(uint64_t cr3, uint64_t virt_addr, uint64_t size, uint64_t flags) {
+    if (vmm_initialized) {
+        protect_range(cr3, virt_addr, size, flags);
+    }
+}
+
+/**
+ * Find a free address space ID
+ * Caller holds space_lock
+ *
+ * @return ID, or 0 if all are in use
+ */
+static uint32_t space_id_alloc(void) {
+    for (uint32_t n = 0; n < VMM_MAX_SPACES - 1; n++) {
+        uint32_t id = (space_state.next_id + n) % (VMM_MAX_SPACES - 1) + 1;
+        if (spaces[id].pml4 == 0) {
+            space_state.next_id = id;
+            return id;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Look up the ID of a live address space
+ *
+ * @return ID, or 0 if cr3 is not a space created by vmm_create_address_space()
+ */
+static uint32_t space_id(uint64_t cr3) {
+    uint32_t id = (uint32_t)(cr3 & CR3_PCID_MASK);
+    if (id == 0 || id >= VMM_MAX_SPACES || spaces[id].pml4 != (cr3 & PTE_ADDR_MASK)) {
+        return 0;
+    }
+    return id;
+}
+
+/**
+ * Create an address space
+ * The new PML4 shares every kernel-half entry with the kernel's own, so
+ * only the user half (VMM_USER_START to VMM_USER_END) is private
+ *
+ * @return CR3 value for the space (PML4 | ID), or 0 on failure
+ */
+uint64_t vmm_create_address_space(void) {
+    if (!vmm_initialized) {
+        return 0;
+    }
+
+    uint64_t pml4_phys = alloc_page_table();
+    if (pml4_phys == 0) {
+        console_print("[VMM] ERROR: Out of memory for address space\n");
+        return 0;
+    }
+    page_table_t *pml4 = (page_table_t*)pml4_phys;
+
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+
+    uint32_t id = space_id_alloc();
+    if (id == 0) {
+        spin_unlock_irqrestore(&space_lock, flags);
+        console_print("[VMM] ERROR: Out of address space IDs\n");
+        pmm_free_frame(pml4_phys);
+        return 0;
+    }
+
+    for (uint32_t slot = 0; slot < ENTRIES_PER_TABLE; slot++) {
+        if (!is_user_slot(slot)) {
+            pml4->entries[slot] = kernel_pml4->entries[slot];
+        }
+    }
+    pml4->entries[RECURSIVE_SLOT] = pte_create(pml4_phys, PTE_KERNEL_FLAGS);
+
+    // Whatever a previous owner of this PCID left in the TLB is flushed
+    // on the first switch
+    spaces[id].pml4 = pml4_phys;
+    spaces[id].flush_gen = 0;
+    space_state.num_spaces++;
+    vmm_state.page_tables_allocated++;
+
+    spin_unlock_irqrestore(&space_lock, flags);
+    return pml4_phys | id;
+}
+
+/**
+ * Destroy an address space, freeing its user-half page tables and the
+ * user frames mapped through them
+ */
+void vmm_destroy_address_space(uint64_t cr3) {
+    uint32_t id = space_id(cr3);
+    if (id == 0) {
+        console_print("[VMM] ERROR: Invalid address space in destroy\n");
+        return;
+    }
+
+    // Never free the tables this CPU is translating through
+    if (space_state.current[cpu_current_id()] == cr3) {
+        vmm_switch_address_space(vmm_kernel_address_space());
+    }
+
+    page_table_t *pml4 = (page_table_t*)spaces[id].pml4;
+    for (uint32_t slot = 0; slot < ENTRIES_PER_TABLE; slot++) {
+        if (is_user_slot(slot) && (pml4->entries[slot] & PTE_PRESENT)) {
+            free_table(pte_get_addr(pml4->entries[slot]), 3, true, NULL);
+        }
+    }
+
+    // Drop the PCID's entries now rather than when the ID is reused
+    if (space_state.pcid && space_state.invpcid) {
+        invpcid(INVPCID_CONTEXT, id, 0);
+    }
+
+    pmm_free_frame(spaces[id].pml4);
+    vmm_state.page_tables_allocated--;
+
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    spaces[id].pml4 = 0;
+    space_state.num_spaces--;
+    spin_unlock_irqrestore(&space_lock, flags);
+}
+
+/**
+ * Copy a user-half paging structure for fork
+ * 4KB pages owned by user mappings are shared: they are marked PTE_COW
+ * and write-protected in both copies, and each gains a reference for the
+ * child. The mark stays on read-only pages too, so they are still copied
+ * if they are made writable later. Anything else (large pages, frames
+ * the process doesn't own) is shared as it is
+ *
+ * @param level 3 for a PDPT, 2 for a PD, 1 for a PT
+ * @param tlb Batch that collects the parent's write-protected pages
+ * @return Physical address of the copy, or 0 if out of memory
+ */
+static uint64_t copy_table(uint64_t table_phys, uint64_t virt_base, int level,
+                           mmu_gather_t *tlb) {
+    uint64_t copy_phys = alloc_page_table();
+    if (copy_phys == 0) {
+        return 0;
+    }
+    vmm_state.page_tables_allocated++;
+
+    page_table_t *table = (page_table_t*)table_phys;
+    page_table_t *copy = (page_table_t*)copy_phys;
+
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        pte_t entry = table->entries[i];
+        if (!(entry & PTE_PRESENT)) {
+            continue;
+        }
+        uint64_t virt = virt_base + i * level_size(level);
+
+        if (level > 1 && !(entry & PTE_HUGE)) {
+            uint64_t next = copy_table(pte_get_addr(entry), virt, level - 1, tlb);
+            if (next == 0) {
+                // Drops the references taken so far
+                free_table(copy_phys, level, true, NULL);
+                return 0;
+            }
+            copy->entries[i] = pte_create(next, entry & PTE_FLAGS_MASK);
+            continue;
+        }
+
+        page_t *page = level == 1 ? pmm_page(pte_get_addr(entry)) : NULL;
+        if (page && page->owner == PAGE_OWNER_USER) {
+            if (entry & PTE_WRITE) {
+                vmm_gather_page(tlb, virt);
+            }
+            entry = (entry & ~PTE_WRITE) | PTE_COW;
+            table->entries[i] = entry;
+            pmm_page_get(page);
+            __atomic_add_fetch(&page->mapcount, 1, __ATOMIC_RELAXED);
+        }
+
+        copy->entries[i] = entry;
+        vmm_state.mapped_pages += level_size(level) / PAGE_SIZE;
+    }
+
+    return copy_phys;
+}
+
+/**
+ * Give a new address space a copy-on-write copy of another's user half
+ * Only the page tables are copied; the user frames are shared until one
+ * side writes to them. The caller keeps the parent's mappings from
+ * changing meanwhile
+ *
+ * @param child_cr3 Space with an empty user half, from vmm_create_address_space()
+ * @return false if out of memory; the child may then hold part of the copy
+ */
+bool vmm_fork_address_space(uint64_t parent_cr3, uint64_t child_cr3) {
+    if (space_id(parent_cr3) == 0 || space_id(child_cr3) == 0) {
+        console_print("[VMM] ERROR: Invalid address space in fork\n");
+        return false;
+    }
+
+    page_table_t *parent = (page_table_t*)(parent_cr3 & PTE_ADDR_MASK);
+    page_table_t *child = (page_table_t*)(child_cr3 & PTE_ADDR_MASK);
+    bool copied = true;
+
+    mmu_gather_t tlb;
+    vmm_gather_init(&tlb, parent_cr3);
+
+    for (uint32_t slot = 0; slot < ENTRIES_PER_TABLE && copied; slot++) {
+        pte_t entry = parent->entries[slot];
+        if (!is_user_slot(slot) || !(entry & PTE_PRESENT)) {
+            continue;
+        }
 
+        uint64_t pdpt = copy_table(pte_get_addr(entry), (uint64_t)slot << 39, 3, &tlb);
+        if (pdpt == 0) {
+            console_print("[VMM] ERROR: Out of memory copying address space\n");
+            copied = false;
+            break;
+        }
+        child->entries[slot] = pte_create(pdpt, entry & PTE_FLAGS_MASK);
+    }
+
+    // The parent may still hold writable translations for pages that
+    // are now shared, even if the copy failed part way
+    vmm_gather_finish(&tlb);
+    return copied;
+}
+
+/**
+ * Load an address space on this CPU
+ * With PCIDs the space's TLB entries are kept across the switch unless
+ * they went stale while it was not loaded; without them the CR3 load
+ * flushes the TLB as usual
+ */
+void vmm_switch_address_space(uint64_t cr3) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+
+    if (cr3 != space_state.current[cpu]) {
+        uint64_t load = cr3 & PTE_ADDR_MASK;
+
+        if (space_state.pcid) {
+            uint32_t id = (uint32_t)(cr3 & CR3_PCID_MASK);
+            load |= id;
+
+            uint64_t gen = __atomic_load_n(&space_state.flush_gen, __ATOMIC_RELAXED);
+            if (spaces[id].flush_gen == gen) {
+                load |= CR3_NOFLUSH;
+            } else {
+                spaces[id].flush_gen = gen;
+                space_state.full_flushes++;
+            }
+        } else {
+            space_state.full_flushes++;
+        }
+
+        space_state.current[cpu] = cr3;
+        space_state.switches++;
+        vmm_load_cr3(load);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+/**
+ * Get the address space loaded on this CPU
+ */
+uint64_t vmm_current_address_space(void) {
+    return space_state.current[cpu_current_id()];
+}
+
+/**
+ * Get the kernel's own address space
+ */
+uint64_t vmm_kernel_address_space(void) {
+    return vmm_state.pml4_physical;
+}
+
+/**
+ * Get page table entry for a virtual address in an address space
+ * Creates intermediate tables if needed
+ */
+pte_t* vmm_space_get_pte(uint64_t cr3, uint64_t virt_addr, bool create) {
+    if (!vmm_initialized) {
+        return NULL;
+    }
+    return page_walk(cr3, virt_addr, create, 1, NULL);
+}
+
+/**
+ * Flush one page of an address space from the TLB
+ * A space that is not loaded is flushed by PCID with INVPCID, or marked
+ * stale so its next switch reloads it from scratch
+ */
+void vmm_space_flush_page(uint64_t cr3, uint64_t virt_addr) {
     virt_addr = ALIGN_DOWN(virt_addr, PAGE_SIZE);
-    virt_end = ALIGN_UP(virt_end, PAGE_SIZE);
 
-    for (uint64_t v = virt_addr; v < virt_end; v += PAGE_SIZE) {
-        vmm_unmap_page(v);
+    if (!is_user_addr(virt_addr) || cr3 == space_state.current[cpu_current_id()]) {
+        vmm_flush_tlb_single(virt_addr);
+    } else if (space_state.pcid) {
+        uint32_t id = (uint32_t)(cr3 & CR3_PCID_MASK);
+        if (space_state.invpcid) {
+            invpcid(INVPCID_ADDRESS, id, virt_addr);
+        } else {
+            spaces[id].flush_gen = 0;
+        }
     }
+    // Without PCIDs, loading the space flushes its stale entries anyway
+}
 
+/**
+ * Map a single page into an address space
+ */
+bool vmm_space_map_page(uint64_t cr3, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
+    virt_addr = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+    phys_addr = ALIGN_DOWN(phys_addr, PAGE_SIZE);
+
+    pte_t *pte = vmm_space_get_pte(cr3, virt_addr, true);
+    if (!pte) {
+        return false;
+    }
+
+    bool was_present = (*pte & PTE_PRESENT) != 0;
+    *pte = pte_create(phys_addr, flags | PTE_PRESENT);
+
+    if (was_present) {
+        vmm_space_flush_page(cr3, virt_addr);
+    } else {
+        vmm_state.mapped_pages++;
+    }
     return true;
 }
 
+/**
+ * Unmap a single page from an address space
+ *
+ * @return Physical address that was mapped, or 0 if none
+ */
+uint64_t vmm_space_unmap_page(uint64_t cr3, uint64_t virt_addr) {
+    virt_addr = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+
+    pte_t *pte = vmm_space_get_pte(cr3, virt_addr, false);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return 0;
+    }
+
+    uint64_t phys = pte_get_addr(*pte);
+    *pte = 0;
+    vmm_state.mapped_pages--;
+
+    vmm_space_flush_page(cr3, virt_addr);
+    return phys;
+}
+
+/**
+ * Check whether the CPU can map 1GB pages
+ */
+static void vmm_detect_gbpages(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001) {
+        return;
+    }
+
+    cpu_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    gbpages_supported = (edx & (1U << 26)) != 0;
+}
+
+/**
+ * Enable PCIDs if the CPU has them
+ * CR4.PCIDE may only be set while CR3 holds PCID 0, which the kernel's
+ * own address space always uses
+ */
+static void vmm_enable_pcid(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1U << 17))) {
+        return;  // No PCID; every switch reloads CR3 and flushes the TLB
+    }
+
+    if (max_leaf >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        space_state.invpcid = (ebx & (1U << 10)) != 0;
+    }
+
+    cpu_write_cr4(cpu_read_cr4() | CR4_PCIDE);
+    space_state.pcid = true;
+}
+
+/**
+ * Allocate a zeroed page table while only the first 1GB is mapped
+ * Normal allocations prefer high memory, which is not reachable yet, so
+ * take the frame from the DMA zone (always below the boot identity map)
+ */
+static uint64_t alloc_boot_table(void) {
+    uint64_t phys = pmm_alloc_frame_zone(PMM_ZONE_DMA);
+    if (phys == 0) {
+        return 0;
+    }
+
+    page_table_t *table = (page_table_t*)phys;
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        table->entries[i] = 0;
+    }
+    return phys;
+}
+
+/**
+ * Identity-map physical memory above the boot page tables' first 1GB
+ * with 2MB pages, so every frame the PMM hands out is reachable
+ */
+static void vmm_map_physical_memory(uint64_t phys_end) {
+    phys_end = ALIGN_UP(phys_end, HUGE_PAGE_SIZE);
+
+    for (uint64_t addr = PMM_IDENTITY_LIMIT; addr < phys_end; addr += GIGA_PAGE_SIZE) {
+        virt_addr_t vaddr = vmm_parse_address(addr);
+
+        pte_t *pml4_entry = &kernel_pml4->entries[vaddr.pml4_index];
+        if (!(*pml4_entry & PTE_PRESENT)) {
+            uint64_t pdpt_phys = alloc_boot_table();
+            if (pdpt_phys == 0) {
+                console_print("[VMM] ERROR: Out of memory mapping physical memory\n");
+                return;
+            }
+
+            *pml4_entry = pte_create(pdpt_phys, PTE_KERNEL_FLAGS);
+            vmm_state.page_tables_allocated++;
+        }
+
+        page_table_t *pdpt = (page_table_t*)pte_get_addr(*pml4_entry);
+        pte_t *pdpt_entry = &pdpt->entries[vaddr.pdpt_index];
+        if (*pdpt_entry & PTE_PRESENT) {
+            continue;  // Already mapped
+        }
+
+        uint64_t pd_phys = alloc_boot_table();
+        if (pd_phys == 0) {
+            console_print("[VMM] ERROR: Out of memory mapping physical memory\n");
+            return;
+        }
+
+        // One PD maps 1GB; entries past the end of RAM stay not-present
+        page_table_t *pd = (page_table_t*)pd_phys;
+        for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+            uint64_t phys = addr + i * HUGE_PAGE_SIZE;
+            pd->entries[i] = phys < phys_end ? pte_create(phys, PTE_KERNEL_FLAGS | PTE_HUGE) : 0;
+        }
+        *pdpt_entry = pte_create(pd_phys, PTE_KERNEL_FLAGS);
+        vmm_state.page_tables_allocated++;
+    }
+
+    vmm_state.kernel_pages += (phys_end - PMM_IDENTITY_LIMIT) / PAGE_SIZE;
+    vmm_flush_tlb();
+}
+
 /**
  * Initialize Virtual Memory Manager
  */
@@ -373,6 +1355,11 @@ void vmm_init(boot_info_t *boot_info) {
     serial_debug_str("set_vmm_state\n");
     serial_debug_str("A\n");
     kernel_pml4 = &pml4_table;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        space_state.current[cpu] = pml4_phys;
+    }
+    spaces[0].pml4 = pml4_phys;
+    spaces[0].flush_gen = space_state.flush_gen = 1;
     serial_debug_str("B\n");
     vmm_state.pml4_physical = pml4_phys;
     serial_debug_str("C\n");
@@ -403,6 +1390,23 @@ void vmm_init(boot_info_t *boot_info) {
     console_print("[VMM] Using boot page tables (1GB identity mapping)\n");
     serial_debug_str("AFTER_CONSOLE_PRINT\n");
 
+    // Range mappings use 1GB pages where the CPU allows
+    vmm_detect_gbpages();
+
+    // Extend the identity mapping to all RAM tracked by the PMM
+    if (pmm_get_highest_address() > PMM_IDENTITY_LIMIT) {
+        vmm_map_physical_memory(pmm_get_highest_address());
+        console_print("[VMM] Identity-mapped physical memory up to ");
+        console_print_hex(pmm_get_highest_address());
+        console_print("\n");
+    }
+
+    // Page descriptors placed above 1GB can be set up now
+    pmm_init_page_descriptors();
+
+    // Let compaction move pages mapped through the VMM
+    pmm_register_migrate(vmm_migrate_page);
+
     // PHASE 2: Now we can use vmm_map_range for additional mappings
     // since identity mapping is active and PMM allocations are accessible
 
@@ -448,6 +1452,15 @@ void vmm_init(boot_info_t *boot_info) {
     kernel_pml4->entries[RECURSIVE_SLOT] = pte_create(pml4_phys, PTE_KERNEL_FLAGS);
     serial_debug_str("after_recursive_map_set\n");
 
+    // Make kernel writes fault on read-only pages too, so copy-on-write
+    // pages are copied before the kernel writes to them for a process
+    cpu_write_cr0(cpu_read_cr0() | CR0_WP);
+
+    // Tag each address space's TLB entries so context switches keep them
+    vmm_enable_pcid();
+    console_print(space_state.pcid ? "[VMM] PCIDs enabled\n"
+                                   : "[VMM] No PCID support, switches flush the TLB\n");
+
     serial_debug_str("before_vmm_complete_msg\n");
     serial_debug_str("vmm_complete_msg_skipped\n");
     serial_debug_str("after_vmm_complete_msg\n");
@@ -470,5 +1483,13 @@ void vmm_print_stats(void) {
     console_print_dec(vmm_state.kernel_pages);
     console_print("\n  Virtual Memory:    ");
     console_print_dec(vmm_state.mapped_pages * 4);
-    console_print(" KB\n");
+    console_print(" KB\n  Address Spaces:    ");
+    console_print_dec(space_state.num_spaces);
+    console_print(space_state.pcid ? (space_state.invpcid ? " (PCID, INVPCID)" : " (PCID)") : " (no PCID)");
+    console_print("\n  Space Switches:    ");
+    console_print_dec(space_state.switches);
+    console_print(" (");
+    console_print_dec(space_state.full_flushes);
+    console_print(" flushed)\n  Large Pages:       2MB");
+    console_print(gbpages_supported ? ", 1GB\n" : "\n");
 }
@@ -11,6 +11,8 @@
 #include "types.h"
 #include "boot.h"
 
+struct page;
+
 // Page size constants
 #define PAGE_SIZE       4096
 #define PAGE_SHIFT      12
@@ -26,12 +28,22 @@
 #define PTE_DIRTY       (1ULL << 6)   // Page has been written to
 #define PTE_HUGE        (1ULL << 7)   // 2MB/1GB page (PD/PDPT level)
 #define PTE_GLOBAL      (1ULL << 8)   // Global page (not flushed on CR3 reload)
+#define PTE_COW         (1ULL << 9)   // Software: write-protected copy-on-write page
 #define PTE_NX          (1ULL << 63)  // No-execute bit
 
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL  // Physical address bits
+#define PTE_FLAGS_MASK  0xFFF0000000000FFFULL  // Flag bits
+
 // Common flag combinations
 #define PTE_KERNEL_FLAGS (PTE_PRESENT | PTE_WRITE)
 #define PTE_USER_FLAGS   (PTE_PRESENT | PTE_WRITE | PTE_USER)
 
+// Range flushes above this many pages reload CR3 instead of using invlpg
+#define VMM_FLUSH_ALL_THRESHOLD 32
+
+// User frames a TLB batch holds before it is flushed early
+#define VMM_GATHER_PAGES 64
+
 // Virtual memory layout
 #define KERNEL_VIRTUAL_BASE  0xFFFFFFFF80000000ULL  // -2GB (higher-half kernel)
 #define KERNEL_PHYSICAL_BASE 0x100000ULL            // 1MB (where kernel is loaded)
@@ -40,6 +52,24 @@
 #define RECURSIVE_SLOT      511
 #define RECURSIVE_BASE      0xFFFF800000000000ULL
 
+// User half of an address space (PML4 slots 1-255). Slot 0 holds the
+// identity map the kernel runs from, so it is shared like the upper half
+#define VMM_USER_START      0x0000008000000000ULL
+#define VMM_USER_END        0x0000800000000000ULL
+
+// Address space IDs, used as PCIDs when the CPU supports them (ID 0 is
+// the kernel's own address space)
+#define VMM_MAX_SPACES      1024
+
+// CR3 bits used with CR4.PCIDE
+#define CR3_PCID_MASK       0xFFFULL
+#define CR3_NOFLUSH         (1ULL << 63)  // Keep the PCID's TLB entries on load
+#define CR4_PCIDE           (1ULL << 17)
+
+// Supervisor writes honour read-only PTEs, so the kernel's own writes to
+// copy-on-write pages fault too
+#define CR0_WP              (1ULL << 16)
+
 // Page table structure (4KB aligned)
 typedef struct {
     uint64_t entries[ENTRIES_PER_TABLE];
@@ -58,6 +88,21 @@ typedef struct {
     uint16_t sign_ext;  // Bits 48-63: Sign extension
 } virt_addr_t;
 
+// Batched TLB invalidation. Range operations record the pages whose
+// translations they change, and frames that must stay allocated until
+// no TLB entry can reach them, then flush and free in one go
+typedef struct {
+    uint64_t cr3;                               // Address space being changed
+    uint64_t addrs[VMM_FLUSH_ALL_THRESHOLD];    // Pages to invalidate one by one
+    uint32_t count;                             // Entries used in addrs
+    bool flush_all;                             // Too many pages; flush everything
+    bool kernel;                                // Kernel-half pages were recorded
+    bool user;                                  // User-half pages were recorded
+    uint32_t freed;                             // Frames to free, chained through lru_next
+    uint32_t num_pages;                         // Entries used in pages[]
+    struct page *pages[VMM_GATHER_PAGES];       // User frames to release
+} mmu_gather_t;
+
 // VMM statistics
 typedef struct {
     uint64_t total_virtual_pages;
@@ -74,15 +119,39 @@ void vmm_init(boot_info_t *boot_info);
 pte_t* vmm_get_pte(uint64_t virt_addr, bool create);
 bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 bool vmm_unmap_page(uint64_t virt_addr);
+uint64_t vmm_clear_pte(uint64_t virt_addr);
 uint64_t vmm_get_physical(uint64_t virt_addr);
 
 // Address space management
 bool vmm_map_range(uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags);
 bool vmm_unmap_range(uint64_t virt_addr, uint64_t size);
 
+// Per-process address spaces, identified by their CR3 value (PML4 | ID)
+uint64_t vmm_create_address_space(void);
+void vmm_destroy_address_space(uint64_t cr3);
+void vmm_switch_address_space(uint64_t cr3);
+uint64_t vmm_current_address_space(void);
+uint64_t vmm_kernel_address_space(void);
+bool vmm_fork_address_space(uint64_t parent_cr3, uint64_t child_cr3);
+pte_t* vmm_space_get_pte(uint64_t cr3, uint64_t virt_addr, bool create);
+bool vmm_space_map_page(uint64_t cr3, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
+bool vmm_space_map_range(uint64_t cr3, uint64_t virt_addr, uint64_t phys_addr,
+                         uint64_t size, uint64_t flags);
+uint64_t vmm_space_unmap_page(uint64_t cr3, uint64_t virt_addr);
+void vmm_space_unmap_range(uint64_t cr3, uint64_t virt_addr, uint64_t size);
+void vmm_space_protect_range(uint64_t cr3, uint64_t virt_addr, uint64_t size, uint64_t flags);
+void vmm_space_flush_page(uint64_t cr3, uint64_t virt_addr);
+
 // TLB management
+void vmm_gather_init(mmu_gather_t *tlb, uint64_t cr3);
+void vmm_gather_page(mmu_gather_t *tlb, uint64_t virt_addr);
+void vmm_gather_range(mmu_gather_t *tlb, uint64_t virt_addr, uint64_t size);
+void vmm_gather_free_frame(mmu_gather_t *tlb, uint64_t phys_addr);
+void vmm_gather_put_page(mmu_gather_t *tlb, struct page *page);
+void vmm_gather_finish(mmu_gather_t *tlb);
 void vmm_flush_tlb(void);
 void vmm_flush_tlb_single(uint64_t virt_addr);
+void vmm_flush_tlb_range(uint64_t virt_addr, uint64_t size);
 
 // Utility functions
 virt_addr_t vmm_parse_address(uint64_t addr);